@@ -253,18 +253,17 @@ void * bench_start(void *arg)
 	nblocks = p.size % p.ns->blocksize ?
 		(p.size >> p.ns->blockshift) + 1 : p.size >> p.ns->blockshift;
 
-	for (n = 0; n < p.batch; n++) {
-		bufs[n] = pop_buf_alloc(p.mem, nblocks << p.ns->blockshift);
-		if (!bufs[n]) {
-			fprintf(stderr,
-				"failed to pop_buf_alloc() "
-				"%lu bytes on cpu %d: %s\n",
-				nblocks << p.ns->blockshift, th->cpu,
-				strerror(errno));
-			exit(0);
-		}
-		pop_buf_put(bufs[n], nblocks << p.ns->blockshift);
+	if (pop_buf_alloc_bulk(p.mem, nblocks << p.ns->blockshift,
+			       bufs, p.batch) < 0) {
+		fprintf(stderr,
+			"failed to pop_buf_alloc_bulk() "
+			"%d x %lu bytes on cpu %d: %s\n",
+			p.batch, nblocks << p.ns->blockshift, th->cpu,
+			strerror(errno));
+		exit(0);
 	}
+	for (n = 0; n < p.batch; n++)
+		pop_buf_put(bufs[n], nblocks << p.ns->blockshift);
 
 	lba = th->lba_start;
 
@@ -417,7 +416,7 @@ int main(int argc, char **argv)
 			break;
 
 		case 'p':
-			if (strncmp("hugepage", optarg, 8) == 0)
+			if (strcmp("hugepage", optarg) == 0)
 				p.p2p = NULL;
 			else
 				p.p2p = optarg;
@@ -0,0 +1,236 @@
+/* bench-ring.c: microbenchmark for pop_ring */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include <libpop.h>
+#include <libpop_ring.h>
+
+#define MAX_THREADS	32
+#define MAX_BURST	256
+
+static volatile int caught_signal = 0;
+static volatile int started = 0;
+
+struct bench {
+	pop_ring_t	*ring;
+	int		nprod, ncons;
+	unsigned int	burst;
+	int		timeout;	/* sec */
+};
+
+struct bench_thread {
+	struct bench	*b;
+	pthread_t	tid;
+	int		cpu;
+	int		id;
+
+	unsigned long	nobjs;	/* # of enqueued or dequeued objects */
+	unsigned long	nfails;	/* # of empty or full bursts */
+	unsigned long	nreorder;	/* out-of-order objects on SPSC */
+} __attribute__((aligned(64)));
+
+static void pin_cpu(pthread_t tid, int cpu)
+{
+	cpu_set_t target_cpu_set;
+
+	CPU_ZERO(&target_cpu_set);
+	CPU_SET(cpu, &target_cpu_set);
+	pthread_setaffinity_np(tid, sizeof(cpu_set_t), &target_cpu_set);
+}
+
+void *producer_body(void *arg)
+{
+	struct bench_thread *th = arg;
+	struct bench *b = th->b;
+	uint32_t objs[MAX_BURST], seq = 0;
+	unsigned int n, i;
+
+	pin_cpu(th->tid, th->cpu);
+
+	while (!started);
+
+	while (!caught_signal) {
+		for (i = 0; i < b->burst; i++)
+			objs[i] = seq + i;
+		n = pop_ring_enqueue_burst(b->ring, objs, b->burst);
+		if (n == 0) {
+			th->nfails++;
+			continue;
+		}
+		seq += n;
+		th->nobjs += n;
+	}
+
+	return NULL;
+}
+
+void *consumer_body(void *arg)
+{
+	struct bench_thread *th = arg;
+	struct bench *b = th->b;
+	uint32_t objs[MAX_BURST], next = 0;
+	unsigned int n, i;
+
+	pin_cpu(th->tid, th->cpu);
+
+	while (!started);
+
+	while (!caught_signal) {
+		n = pop_ring_dequeue_burst(b->ring, objs, b->burst);
+		if (n == 0) {
+			th->nfails++;
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			if (objs[i] != next)
+				th->nreorder++;
+			next = objs[i] + 1;
+		}
+		th->nobjs += n;
+	}
+
+	return NULL;
+}
+
+void usage(void)
+{
+	printf("bench-ring, pop_ring microbenchmark usage:\n"
+	       "    -m mode       spsc, mpsc, or mpmc (default spsc)\n"
+	       "    -p nprod      number of producer threads\n"
+	       "    -c ncons      number of consumer threads\n"
+	       "    -s size       number of ring entries\n"
+	       "    -b burst      burst size\n"
+	       "    -t timeout    duration in sec\n"
+		);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_thread ths[MAX_THREADS];
+	struct bench b;
+	struct timeval start, end;
+	unsigned long nenq = 0, ndeq = 0, nfull = 0, nempty = 0;
+	unsigned long nreorder = 0;
+	unsigned int size = 1024;
+	int ch, n, flags = POP_RING_SP_ENQ | POP_RING_SC_DEQ;
+	double elapsed;
+
+	memset(&b, 0, sizeof(b));
+	b.nprod = 1;
+	b.ncons = 1;
+	b.burst = 32;
+	b.timeout = 3;
+
+	while ((ch = getopt(argc, argv, "m:p:c:s:b:t:h")) != -1) {
+		switch (ch) {
+		case 'm':
+			if (strncmp(optarg, "spsc", 4) == 0)
+				flags = POP_RING_SP_ENQ | POP_RING_SC_DEQ;
+			else if (strncmp(optarg, "mpsc", 4) == 0)
+				flags = POP_RING_SC_DEQ;
+			else if (strncmp(optarg, "mpmc", 4) == 0)
+				flags = 0;
+			else {
+				fprintf(stderr, "invalid mode %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'p':
+			b.nprod = atoi(optarg);
+			break;
+		case 'c':
+			b.ncons = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'b':
+			b.burst = atoi(optarg);
+			if (b.burst < 1 || b.burst > MAX_BURST) {
+				fprintf(stderr, "invalid burst (1-%d)\n",
+					MAX_BURST);
+				return -1;
+			}
+			break;
+		case 't':
+			b.timeout = atoi(optarg);
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if (flags & POP_RING_SP_ENQ)
+		b.nprod = 1;
+	if (flags & POP_RING_SC_DEQ)
+		b.ncons = 1;
+	if (b.nprod + b.ncons > MAX_THREADS) {
+		fprintf(stderr, "too many threads (> %d)\n", MAX_THREADS);
+		return -1;
+	}
+
+	b.ring = pop_ring_create(size, flags);
+	if (!b.ring) {
+		fprintf(stderr, "pop_ring_create(): %s\n", strerror(errno));
+		return -1;
+	}
+
+	printf("%s ring, %u entries, %d producers, %d consumers, "
+	       "burst %u, %d sec\n",
+	       flags == (POP_RING_SP_ENQ | POP_RING_SC_DEQ) ? "spsc" :
+	       flags == POP_RING_SC_DEQ ? "mpsc" : "mpmc",
+	       b.ring->size, b.nprod, b.ncons, b.burst, b.timeout);
+
+	memset(ths, 0, sizeof(ths));
+	for (n = 0; n < b.nprod + b.ncons; n++) {
+		ths[n].b = &b;
+		ths[n].id = n;
+		ths[n].cpu = n;
+		pthread_create(&ths[n].tid, NULL,
+			       n < b.nprod ? producer_body : consumer_body,
+			       &ths[n]);
+	}
+
+	gettimeofday(&start, NULL);
+	started = 1;
+	sleep(b.timeout);
+	caught_signal = 1;
+	gettimeofday(&end, NULL);
+
+	for (n = 0; n < b.nprod + b.ncons; n++) {
+		pthread_join(ths[n].tid, NULL);
+		if (n < b.nprod) {
+			nenq += ths[n].nobjs;
+			nfull += ths[n].nfails;
+		} else {
+			ndeq += ths[n].nobjs;
+			nempty += ths[n].nfails;
+			nreorder += ths[n].nreorder;
+		}
+	}
+
+	elapsed = end.tv_sec * 1000000 + end.tv_usec;
+	elapsed -= (start.tv_sec * 1000000 + start.tv_usec);
+	elapsed /= 1000000;	/* sec */
+
+	printf("enqueue %.2f Mops, dequeue %.2f Mops, "
+	       "full %lu, empty %lu\n",
+	       nenq / elapsed / 1000000, ndeq / elapsed / 1000000,
+	       nfull, nempty);
+	if (b.nprod == 1 && b.ncons == 1)
+		printf("out of order %lu\n", nreorder);
+
+	pop_ring_free(b.ring);
+
+	return 0;
+}
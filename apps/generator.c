@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sched.h>
@@ -21,6 +22,7 @@
 #include <unvme.h>
 
 #include "pkt_desc.h"
+#include "trace.h"
 
 #define MAX_CPUS		32
 #define MAX_BATCH_SIZE		32
@@ -30,9 +32,11 @@
 #define WALK_MODE_SEQ  		0
 #define WALK_MODE_RANDOM	1
 
-#define NM_BATCH_TO_NBLOCKS(b, u)					\
-	((b) << 11 >= (u)->blocksize ? (((b) << 11) >> (u)->blockshift) : 1)
-/* if batch num * 2048 is smaller than block size, use 1 */
+/* blocks of a unit, see pkt_desc.h */
+#define UNIT_NBLOCKS()	((int)(gen.ulen >> gen.unvme->blockshift))
+
+/* max # of packets in a unit */
+#define MAX_UNIT_PKTS	(MAX_BATCH_SIZE * PKT_BLK_MAX_PKTS)
 
 
 
@@ -70,9 +74,12 @@ struct generator {
 	char	*pci;	/* p2pmem slot	*/
 	char	*nvme;	/* nvme slot	*/
 	char	*port;	/* netmap port	*/
+	char	*trace;	/* trace name on nvme */
 	int	ncpus;	/* # of cpus to be used	*/
 	int	batch;	/* # of batch	*/
 	int	nvbatch;	/* # of batch on a nvme command */
+	int	stride;	/* bytes per packet on nvme */
+	int	packed;	/* packed blocks, batch is # of blocks */
 	int	walk;	/* walk mode	*/
 	unsigned long	lba_start, lba_end;	/* start and end of slba */
 
@@ -88,6 +95,8 @@ struct generator {
 	int	verbose;	/* verbose level */
 	int	timeout;	/* timeout to end */
 
+	unsigned long upkts;	/* max # of packets in a unit */
+	size_t	ulen;		/* bytes of a unit */
 	unsigned long bpkts;	/* # of batched packet in an intereation */
 } gen;
 
@@ -120,16 +129,18 @@ void print_gen_info(void)
 	printf("ncpus (-n):      %d\n", gen.ncpus);
 	printf("batch (-b):      %d\n", gen.batch);
 	printf("nvme batch (-B): %d\n", gen.nvbatch);
+	printf("stride (-z):     %d\n", gen.stride);
 	printf("walk (-w):       %s\n", walk_mode_string[gen.walk]);
 	printf("start lba (-s):  0x%lx\n", gen.lba_start);
 	printf("end lba (-e):    0x%lx\n", gen.lba_end);
 	printf("interval (-I):   %d\n", gen.interval);
 	printf("timeout (-T):    %d\n", gen.timeout);
 	printf("\n");
+	printf("packed (-k):     %s\n", gen.packed ? "yes" : "no");
+	printf("trace (-t):      %s\n", gen.trace ? gen.trace : "none");
+	printf("\n");
 	printf("nblocks in a nvme cmd: %d (%d byte, %u byte block)\n",
-	       NM_BATCH_TO_NBLOCKS(gen.batch, gen.unvme),
-	       NM_BATCH_TO_NBLOCKS(gen.batch, gen.unvme) <<
-	       gen.unvme->blockshift,
+	       UNIT_NBLOCKS(), UNIT_NBLOCKS() << gen.unvme->blockshift,
 	       gen.unvme->blocksize);
 	printf("=====================================\n");
 }
@@ -143,6 +154,8 @@ void usage(void)
 	       "    -n ncpus             number of cpus\n"
 	       "    -b batch             batch size in a netmap iteration\n"
 	       "    -B batch             batch size in a nvme command\n"
+	       "    -z stride            bytes per packet on nvme, 256-4096\n"
+	       "    -k                   packed blocks, -b is # of 4KB blocks\n"
 	       "    -w walk mode         seq or random\n"
 	       "    -s start lba (hex)   start logical block address\n"
 	       "    -e end lba (hex)     end logical block address\n"
@@ -150,6 +163,7 @@ void usage(void)
 	       "    -F                   use fake packet instead of read from nvme\n"
 	       "    -H                   print hexdump of nvme read\n"
 	       "    -T time (sec)        timeout\n"
+	       "    -t name              send a trace written by store -t\n"
 	       "    -v                   verbose mode\n"
 		);
 }
@@ -217,21 +231,72 @@ void build_pkt(char *buf, int len, int id) {
 	udp->uh_sum     = 0;
 }
 
+void build_unit(void *unit, unsigned int len)
+{
+	unsigned int n, k;
+	void *p;
+
+	if (!gen.packed) {
+		pkt_unit_init(unit, gen.stride);
+		for (n = 0; n < gen.batch; n++)
+			build_pkt(pkt_unit_add(unit, len), len, n);
+		return;
+	}
+
+	for (k = 0, n = 0; k < gen.batch; k++) {
+		void *blk = (char *)unit + PKT_BLK_SIZE * k;
+		pkt_blk_init(blk);
+		while ((p = pkt_blk_add(blk, len)))
+			build_pkt(p, len, n++);
+	}
+}
+
+/* load_unit: store offsets from the head of the unit and lengths of
+ * packets in the unit, and return the number of packets, or -1 */
+int load_unit(void *unit, uint32_t *off, uint16_t *len)
+{
+	struct pkt_unit_ent ents[MAX_BATCH_SIZE];
+	struct pkt_blk_ent bents[PKT_BLK_MAX_PKTS];
+	int n, k, i, ret;
+
+	if (!gen.packed) {
+		ret = pkt_unit_load(unit, gen.stride, ents, gen.batch);
+		for (n = 0; n < ret; n++) {
+			off[n] = PKT_UNIT_HDRLEN + gen.stride * n;
+			len[n] = ents[n].len;
+		}
+		return ret;
+	}
+
+	/* an index read from each block */
+	for (k = 0, n = 0; k < gen.batch; k++) {
+		ret = pkt_blk_load((char *)unit + PKT_BLK_SIZE * k, bents);
+		if (ret < 0)
+			return -1;
+		for (i = 0; i < ret; i++, n++) {
+			off[n] = PKT_BLK_SIZE * k + bents[i].off;
+			len[n] = bents[i].len;
+		}
+	}
+
+	return n;
+}
+
 unsigned long next_lba(unsigned long lba,
 		       unsigned long lba_start, unsigned long lba_end,
 		       unsigned long nblocks)
 {
 	switch (gen.walk) {
 	case WALK_MODE_SEQ:
-		/* XXX: netmap_slot is 2048 byte, compised of
-		 * 4 blocks on nvme. */
+		/* XXX: a packet is gen.stride bytes on nvme. */
 		if ((lba + nblocks) < lba_end)
 			return lba + nblocks;
 		else
 			return lba_start;
 		break;
 	case WALK_MODE_RANDOM:
-		return ((rand() % (lba_end - lba_start - nblocks))
+		/* a random unit */
+		return ((rand() % ((lba_end - lba_start) / nblocks)) * nblocks
 			+ lba_start);
 		break;
 	}
@@ -243,15 +308,21 @@ unsigned long next_lba(unsigned long lba,
 
 void *thread_body(void *arg)
 {
-	int n, m, ret;
+	int n, ret;
 	struct gen_thread *th = arg;
 	int qid = th->cpu;
 	cpu_set_t target_cpu_set;
-	pop_buf_t *bufs[MAX_NVBATCH_SIZE];
-	void *pkts[MAX_NVBATCH_SIZE][MAX_BATCH_SIZE];
+	pop_buf_t **bufs, *cur[MAX_NVBATCH_SIZE];
+	uintptr_t paddr[MAX_UNIT_PKTS];
+	uint32_t off[MAX_UNIT_PKTS];
+	uint16_t len[MAX_UNIT_PKTS];
+	pop_buf_t *txbufs[MAX_UNIT_PKTS];
+	struct pop_nm_txring *ptx;
+	unsigned int nbufs, next = 0;
+	unsigned int fake_len;
 	unvme_iod_t iod[MAX_NVBATCH_SIZE];
 	unsigned long lba, batch, nvbatch, nblocks, b, vb, space, rest;
-	unsigned long head, nbytes, npkts, nbytes_nvme, ncmds;
+	unsigned long nbytes, npkts, nbytes_nvme, ncmds;
 	struct netmap_ring *ring = NETMAP_TXRING(th->nmd->nifp, th->cpu);
 
 	/* pin this thread on the cpu */
@@ -261,13 +332,29 @@ void *thread_body(void *arg)
 
 	/* allocate packet buffer. we use a single pop_buf for
 	 * multiple packet buffers. It enalbes us to get all batched
-	 * packets from nvme in a single read command */
-	for (n = 0; n < gen.nvbatch + 1; n++) {
-		bufs[n] = pop_buf_alloc(gen.mem, 2048 * gen.batch);
-		pop_buf_put(bufs[n], 2048 * gen.batch);
-
-		for (m = 0; m < gen.batch; m++)
-			pkts[n][m] = pop_buf_data(bufs[n]) + 2048 * m;
+	 * packets from nvme in a single read command. A pop_buf is
+	 * reused after all its packets are sent, so that there are
+	 * enough pop_bufs to fill the netmap ring and read next. */
+	nbufs = ring->num_slots / gen.batch + gen.nvbatch + 1;
+	bufs = calloc(nbufs, sizeof(pop_buf_t *));
+	if (!bufs ||
+	    pop_buf_alloc_bulk(gen.mem, gen.ulen, bufs, nbufs) < 0) {
+		fprintf(stderr, "pop_buf_alloc_bulk() on cpu %d: %s\n",
+			th->cpu, strerror(errno));
+		return NULL;
+	}
+	for (n = 0; n < nbufs; n++)
+		pop_buf_put(bufs[n], gen.ulen);
+
+	fake_len = gen.packed ? 64 : gen.stride;
+	if (fake_len > 1500)
+		fake_len = 1500;
+
+	ptx = pop_nm_txring_init(ring);
+	if (!ptx) {
+		fprintf(stderr, "pop_nm_txring_init() on cpu %d: %s\n",
+			th->cpu, strerror(errno));
+		return NULL;
 	}
 
 	/* initialize the start LBA */
@@ -295,13 +382,31 @@ void *thread_body(void *arg)
 			goto sync_out;
 		}
 
-		head = ring->head;
-
 		if (space >= gen.bpkts) {
 			nvbatch = gen.nvbatch;
 		} else {
-			nvbatch = space / gen.batch + 1;
-			rest = space % gen.batch;
+			nvbatch = space / gen.upkts + 1;
+			rest = space % gen.upkts;
+		}
+
+		/* pick pop_bufs on which no TX slot has packets */
+		for (vb = 0; vb < nvbatch; vb++) {
+			for (n = 0; n < nbufs; n++) {
+				cur[vb] = bufs[(next + n) % nbufs];
+				if (pop_buf_refcnt(cur[vb]) == 1)
+					break;
+			}
+			if (n == nbufs)
+				break;
+			next = (next + n + 1) % nbufs;
+		}
+		if (vb < nvbatch) {
+			/* the rest are still on the NIC */
+			printv3("no buffer left on %d\n", th->cpu);
+			nvbatch = vb;
+			rest = 0;
+			if (nvbatch == 0)
+				goto sync_out;
 		}
 
 		if (gen.fake_packet)
@@ -311,7 +416,7 @@ void *thread_body(void *arg)
 		for (vb = 0; vb < nvbatch; vb++) {
 
 			if (rest == 0 || vb + 1 < nvbatch) {
-				batch = gen.batch;
+				batch = gen.upkts;
 			} else {
 				/* last nvme batch itereation, and
 				 * number of available netmap slots is
@@ -321,8 +426,8 @@ void *thread_body(void *arg)
 				batch = rest;
 			}
 
-			pop_buf_t *buf = bufs[vb];
-			nblocks = NM_BATCH_TO_NBLOCKS(gen.batch, gen.unvme);
+			pop_buf_t *buf = cur[vb];
+			nblocks = UNIT_NBLOCKS();
 			iod[vb] = unvme_aread(gen.unvme, qid,
 					      pop_buf_data(buf),
 					      lba, nblocks);
@@ -348,7 +453,7 @@ void *thread_body(void *arg)
 		for (vb = 0; vb < nvbatch; vb++) {
 
 			if (rest == 0 || vb + 1 < nvbatch) {
-				batch = gen.batch;
+				batch = gen.upkts;
 			} else {
 				/* last nvme batch itereation, and
 				 * number of available netmap slots is
@@ -358,68 +463,65 @@ void *thread_body(void *arg)
 				batch = rest;
 			}
 
-			ret = unvme_apoll(iod[vb], UNVME_TIMEOUT);
-			if (ret != 0) {
-				printv3("unvme_apoll timeout cpu %d\n",
+			if (gen.fake_packet) {
+				build_unit(pop_buf_data(cur[vb]), fake_len);
+			} else {
+				ret = unvme_apoll(iod[vb], UNVME_TIMEOUT);
+				if (ret != 0) {
+					printv3("unvme_apoll timeout cpu %d\n",
+						th->cpu);
+					continue;
+				}
+				ncmds += 1;
+			}
+
+			/* lengths of all packets by one header read */
+			ret = load_unit(pop_buf_data(cur[vb]), off, len);
+			if (ret < 0) {
+				printv1("invalid unit header on cpu %d\n",
 					th->cpu);
 				continue;
 			}
-
-			ncmds += 1;
+			if (batch > ret)
+				batch = ret;
 
 			for (b = 0; b < batch; b++) {
-				void *p = pkts[vb][b];
-				struct netmap_slot *slot = &ring->slot[head];
-
-				if (!p) {
-					printv3("p is null, "
-						"b=%lu, batch=%lu, "
-						"gen.batch=%u cpu=%d\n",
-						b, batch, gen.batch, th->cpu);
-				}
+				void *p = pop_buf_data(cur[vb]) + off[b];
 
-				if (gen.fake_packet) {
-					build_pkt(p, 1500, b);
-					get_pktlen_from_desc(p, 2048) = 1500;
-				}
+				/* a unit spans pages, which may not be
+				 * physically contiguous */
+				paddr[b] = pop_virt_to_phys(gen.mem, p);
+				txbufs[b] = cur[vb];
 
-				slot->flags |= NS_PHY_INDIRECT;
-				slot->ptr = pop_virt_to_phys(gen.mem, p);
-				slot->len = get_pktlen_from_desc(p, 2048);
+				if (gen.hex_dump) {
+					printf("%lu/%lu packet\n", b, vb);
+					hexdump(p, len[b] < 256 ? len[b] : 256);
+				}
 
-				if (slot->len == 0) {
+				if (len[b] == 0) {
 					printv1("invalid slot len 0 on cpu %d\n",
 						th->cpu);
 					printv1("nvbatch=%lu vb=%lu batch=%lu b=%lu\n",
 						nvbatch, vb, batch, b);
 				}
 
-				head = nm_ring_next(ring, head);
-
-				npkts++;
-				nbytes += slot->len;
-
 				printv2("netmap: nvbatch=%lu batch=%lu cpu=%d "
-					"head=%lu pkt=%p\n",
-					vb, b, th->cpu, head, p);
+					"pkt=%p\n", vb, b, th->cpu, p);
 			}
-		}
 
-
-		if (gen.hex_dump) {
-			for (n = 0; n < nvbatch; n++) {
-				for (m = 0; m < batch; m++) {
-					printf("%u/%u packet\n", m, n);
-					hexdump(pkts[n][m], 256);
-				}
+			/* each slot holds a reference to the pop_buf */
+			batch = pop_nm_txring_burst_paddr(ptx, paddr, len,
+							  txbufs, batch);
+			for (b = 0; b < batch; b++) {
+				pop_buf_get(cur[vb]);
+				nbytes += len[b];
 			}
+			npkts += batch;
 		}
 
 		/* ok, nvbatch of nvme read commands finished, and all
-		 * netmap slots for this iteration are filled. Advance
-		 * the cur and call ioctl() to xmit packets */
-		ring->head = ring->cur = head;
-
+		 * netmap slots for this iteration are filled. call
+		 * ioctl() to xmit packets */
 	sync_out:
 		if (space < gen.bpkts) {
 			/* tell netmap that we need more slots */
@@ -433,6 +535,9 @@ void *thread_body(void *arg)
 		}
 		printv3("TXSYNC on cpu %d\n", th->cpu);
 
+		/* release pop_bufs of sent packets */
+		pop_nm_txring_reclaim(ptx);
+
 		/* update counters */
 		th->npkts += npkts;
 		th->nbytes += nbytes;
@@ -446,12 +551,13 @@ void *thread_body(void *arg)
 	gettimeofday(&th->end, NULL);
 
 	/* xmit pending packets */
-	/*
 	while (nm_tx_pending(ring)) {
 		ioctl(th->nmd->fd, NIOCTXSYNC, NULL);
 		usleep(1);
 	}
-	*/
+	pop_nm_txring_exit(ptx);
+	pop_buf_free_bulk(bufs, nbufs);
+	free(bufs);
 
 	return NULL;
 }
@@ -553,6 +659,7 @@ void *count_thread(void *arg)
 int main(int argc, char **argv)
 {
 	int ret, ch, n, i, max_cpu;
+	pop_mem_attr_t attr;
 
 	libpop_verbose_enable();
 
@@ -566,16 +673,17 @@ int main(int argc, char **argv)
 	gen.ncpus = 1;
 	gen.batch = 1;
 	gen.nvbatch = 1;
+	gen.stride = PKT_STRIDE;
 	gen.walk = WALK_MODE_SEQ;
 	gen.lba_start = 0;
 	//gen.lba_end = 0xe8e088b0;	/* XXX: Intel P4600 hard code */
 	gen.lba_end = 0x40000;	/* 4 blocks (1slot) x 2048 slots x 32 rings */
 	gen.verbose = 0;
 
-	while ((ch = getopt(argc, argv, "p:u:i:n:b:B:w:s:e:I:FHT:v")) != -1) {
+	while ((ch = getopt(argc, argv, "p:u:i:n:b:B:z:kw:s:e:I:FHT:t:v")) != -1) {
 		switch (ch) {
 		case 'p':
-			if (strncmp(optarg, "hugepage", 8) == 0)
+			if (strcmp(optarg, "hugepage") == 0)
 				gen.pci = NULL;
 			else
 				gen.pci = optarg;
@@ -608,6 +716,16 @@ int main(int argc, char **argv)
 				return -1;
 			}
 			break;
+		case 'z':
+			gen.stride = atoi(optarg);
+			if (!pop_nm_stride_is_valid(gen.stride)) {
+				printf("invalid stride %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'k':
+			gen.packed = 1;
+			break;
 		case 'w':
 			if (strncmp(optarg, "seq", 3) == 0)
 				gen.walk = WALK_MODE_SEQ;
@@ -645,6 +763,9 @@ int main(int argc, char **argv)
 		case 'T':
 			gen.timeout = atoi(optarg);
 			break;
+		case 't':
+			gen.trace = optarg;
+			break;
 		default:
 			usage();
 			return -1;
@@ -661,14 +782,14 @@ int main(int argc, char **argv)
 		goto err_out;
 	}
 
-	gen.bpkts = gen.batch * gen.nvbatch;
-
-
 	/* initialize rand */
 	srand((unsigned)time(NULL));
 
-	/* initialize pop mem */
-	gen.mem = pop_mem_init(gen.pci, 0);
+	/* initialize pop mem on the node of the NVMe device */
+	pop_mem_attr_init(&attr);
+	attr.numa_node = POP_MEM_NUMA_AUTO;
+	attr.numa_dev = gen.nvme;
+	gen.mem = pop_mem_init_attr(gen.pci, 0, &attr);
 	if (!gen.mem) {
 		perror("pop_mem_init");
 		return -1;
@@ -678,8 +799,54 @@ int main(int argc, char **argv)
 	gen.unvme = unvme_open(gen.nvme);
 	unvme_register_pop_mem(gen.mem);
 
+	/* the trace tells the format and the extent of units */
+	if (gen.trace) {
+		trace_t *tr = trace_open(gen.unvme, gen.mem, gen.trace);
+		if (!tr) {
+			printf("trace_open(%s): %s\n",
+			       gen.trace, strerror(errno));
+			goto err_out;
+		}
+		gen.packed = (tr->sb.format == TRACE_FMT_PACKED);
+		if (!gen.packed)
+			gen.stride = tr->sb.stride;
+		gen.batch = tr->sb.upkts;
+		gen.lba_start = tr->sb.data_lba;
+		gen.lba_end = tr->sb.data_lba +
+			tr->sb.nsegs * tr->sb.unblocks;
+		trace_close(tr);
+
+		if (gen.batch > MAX_BATCH_SIZE) {
+			printf("unit of trace %s is too large\n", gen.trace);
+			goto err_out;
+		}
+	}
+
+	if (gen.packed) {
+		gen.upkts = gen.batch * PKT_BLK_MAX_PKTS;
+		gen.ulen = gen.batch * PKT_BLK_SIZE;
+	} else {
+		gen.upkts = gen.batch;
+		gen.ulen = pkt_unit_size(gen.batch, gen.stride);
+	}
+	gen.bpkts = gen.upkts * gen.nvbatch;
+
 	print_gen_info();
 
+	if (gen.ulen & (gen.unvme->blocksize - 1)) {
+		printf("unit of %d packets is not a multiple of block\n",
+		       gen.batch);
+		goto err_out;
+	}
+
+	/* the random walk picks a unit in the LBA range of each thread */
+	if (gen.walk == WALK_MODE_RANDOM &&
+	    (gen.lba_end - gen.lba_start) / gen.ncpus < UNIT_NBLOCKS()) {
+		printf("LBA range 0x%lx-0x%lx is smaller than a unit per "
+		       "thread\n", gen.lba_start, gen.lba_end);
+		goto err_out;
+	}
+
 	/* set signal */
 	if (signal(SIGINT, sig_handler) == SIG_ERR) {
 		perror("signal");
@@ -695,11 +862,15 @@ int main(int argc, char **argv)
 		snprintf(th->nmport, MAX_NMPORT_NAME, "netmap:%s-%02d",
 			 gen.port, n);
 		th->cpu	= n;
-		th->lba_start = (gen.lba_end - gen.lba_start)
+		th->lba_start = gen.lba_start + (gen.lba_end - gen.lba_start)
 			/ gen.ncpus * n;
-		th->lba_end = (gen.lba_end - gen.lba_start)
+		th->lba_end = gen.lba_start + (gen.lba_end - gen.lba_start)
 			/ gen.ncpus * (n + 1);
 
+		/* read units where store wrote them */
+		th->lba_start -= (th->lba_start - gen.lba_start) %
+			UNIT_NBLOCKS();
+
 		/* initialize netmap port on this queue */
 		if (n == 0) {
 			int flags;
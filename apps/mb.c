@@ -81,7 +81,7 @@ int main(int argc, char **argv)
 			size = atoi(optarg);
 			break;
 		case 'p':
-			if (strncmp(optarg, "hugepage", 8) == 0)
+			if (strcmp(optarg, "hugepage") == 0)
 				mem = NULL;
 			else
 				mem = optarg;
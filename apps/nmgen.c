@@ -55,6 +55,7 @@ struct nmgen {
 	int	pktlen;	/* packet length	*/
 	int	ncpus;	/* number of cpus to be used	*/
 	int	batch;	/* batch size	*/
+	int	stride;	/* buffer stride, 0 means by pktlen or MTU */
 
 	float	interval;	/* report interval (usec) */
 	int	timeout;
@@ -63,6 +64,8 @@ struct nmgen {
 	uint8_t dstmac[ETH_ALEN], srcmac[ETH_ALEN];
 
 	pop_mem_t	*mem;	/* pop memory */
+	pop_mem_attr_t	attr;	/* -g and -f for pop memory */
+	pop_mem_pool_t	*pool;	/* -N: pop memory per NUMA node */
 };
 
 struct nmgen_thread {
@@ -156,28 +159,63 @@ void *nmgen_sender_body(void *arg)
 	struct nmgen *gen = th->gen;
 	struct netmap_ring *ring;
 	cpu_set_t target_cpu_set;
-	pop_buf_t *pbuf;
+	pop_buf_t *pbuf = NULL;
+	pop_mem_t *mem;
 	void *pkts[MAX_BATCH_NUM];
 	uintptr_t pkts_phy[MAX_BATCH_NUM];	/* phy addr of packets */
-	int n;
+	uint16_t pkts_len[MAX_BATCH_NUM];
+	/* segments of jumbo frames */
+	pop_buf_t *chains[MAX_BATCH_NUM] = { NULL };
+	pop_buf_t *pkt;
+	size_t stride;
+	int n, ret;
 
 	/* pin this thread on the cpu */
 	CPU_ZERO(&target_cpu_set);
 	CPU_SET(th->cpu, &target_cpu_set);
 	pthread_setaffinity_np(th->tid, sizeof(cpu_set_t), &target_cpu_set);
 
-	/* allcoate and build packet buffer from libpop memory */
-	pbuf = pop_buf_alloc(gen->mem, 2048 * gen->batch);
+	/* pop memory on the node of this cpu with -N */
+	mem = gen->pool ? pop_mem_pool_get(gen->pool, -1) : gen->mem;
+
+	/* allcoate and build packet buffer from libpop memory. a
+	 * packet larger than a slot is a chain of 2048-byte segments */
+	if (gen->pktlen > 2048)
+		stride = (gen->pktlen + 2047) & ~2047;
+	else
+		stride = gen->stride ? gen->stride : pop_nm_stride(gen->pktlen);
+	pbuf = pop_buf_alloc(mem, stride * gen->batch);
 	if (!pbuf) {
 		fprintf(stderr, "pop_buf_alloc() on cpu %d: %s\n",
 			th->cpu, strerror(errno));
 		goto out;
 	}
-	pop_buf_put(pbuf, 2048 * gen->batch);
+	pop_buf_put(pbuf, stride * gen->batch);
 	for (n = 0; n < gen->batch; n++) {
-		pkts[n] = pop_buf_data(pbuf) + 2048 * n;
-		pkts_phy[n]= pop_virt_to_phys(gen->mem, pkts[n]);
+		pkts[n] = pop_buf_data(pbuf) + stride * n;
+		pkts_phy[n]= pop_virt_to_phys(mem, pkts[n]);
+		pkts_len[n] = gen->pktlen;
 		build_packet(th, pkts[n]);
+
+		chains[n] = NULL;
+		if (gen->pktlen <= 2048)
+			continue;
+
+		pkt = pop_buf_clone(pbuf);
+		if (!pkt) {
+			fprintf(stderr, "pop_buf_clone() on cpu %d: %s\n",
+				th->cpu, strerror(errno));
+			goto out;
+		}
+		pop_buf_pull(pkt, stride * n);
+		pop_buf_trim(pkt, pop_buf_len(pkt) - gen->pktlen);
+		chains[n] = pop_buf_segment(pkt, 2048);
+		pop_buf_free(pkt);
+		if (!chains[n]) {
+			fprintf(stderr, "pop_buf_segment() on cpu %d: %s\n",
+				th->cpu, strerror(errno));
+			goto out;
+		}
 	}
 
 
@@ -192,7 +230,8 @@ void *nmgen_sender_body(void *arg)
 		npkts = 0;
 		nbits = 0;
 
-		if (ioctl(th->nmd->fd, NIOCTXSYNC, NULL) < 0) {
+		/* TXSYNC when a batch does not fit the free slots */
+		if (pop_nm_tx_sync(th->nmd->fd, ring, gen->batch) < 0) {
 			fprintf(stderr, "ioctl error on cpu %d: %s\n",
 				th->cpu, strerror(errno));
 			goto out;
@@ -202,21 +241,22 @@ void *nmgen_sender_body(void *arg)
 		if (!space)
 			continue;
 		batch = space > gen->batch ? gen->batch : space;
-		head = ring->head;
-
-		for (b = 0; b < batch; b++) {
-			struct netmap_slot *slot = &ring->slot[head];
-			slot->flags |= NS_PHY_INDIRECT;
-			slot->ptr = pkts_phy[b];
-			slot->len = gen->pktlen;
-
-			npkts++;
-			nbits += (gen->pktlen << 3);
 
-			head = nm_ring_next(ring, head);
+		if (gen->pktlen <= 2048) {
+			npkts = pop_nm_tx_burst_paddr(ring, pkts_phy, pkts_len,
+						      batch);
+		} else {
+			head = ring->head;
+			for (b = 0; b < batch; b++) {
+				ret = pop_nm_set_chain(ring, head, chains[b]);
+				if (ret < 0)
+					break;	/* no slots for all segments */
+				head = ret;
+				npkts++;
+			}
+			ring->head = ring->cur = head;
 		}
-
-		ring->head = ring->cur = head;
+		nbits = npkts * (gen->pktlen << 3);
 
 		th->npkts += npkts;
 		th->nbits += nbits;
@@ -238,6 +278,11 @@ void *nmgen_sender_body(void *arg)
 	       th->nbits / elapsed, th->nbits / elapsed / 1000000);
 
 out:
+	/* segments hold references to pbuf */
+	for (n = 0; n < gen->batch; n++)
+		pop_buf_chain_free(chains[n]);
+	if (pbuf)
+		pop_buf_free(pbuf);
 	return NULL;
 }
 
@@ -252,15 +297,28 @@ void *nmgen_receiver_body(void *arg)
 	struct netmap_ring *ring;
 	struct netmap_slot *slot;
 	cpu_set_t target_cpu_set;
+	size_t stride;
 
 	/* pin this thread on the cpu */
 	CPU_ZERO(&target_cpu_set);
 	CPU_SET(th->cpu, &target_cpu_set);
 	pthread_setaffinity_np(th->tid, sizeof(cpu_set_t), &target_cpu_set);
 
-	/* correlate netmap rxring with pop memory */
+	/* correlate netmap rxring with pop memory. slots are as
+	 * large as the MTU unless -z is given */
 	ring = NETMAP_RXRING(th->nmd->nifp, th->cpu);
-	prxring = pop_nm_rxring_init(th->nmd->fd, ring, gen->mem);
+	stride = gen->stride ? gen->stride : pop_nm_port_stride(gen->port);
+	if (!stride)
+		stride = ring->nr_buf_size;
+	prxring = pop_nm_rxring_init_stride(th->nmd->fd, ring,
+					    gen->pool ?
+					    pop_mem_pool_get(gen->pool, -1) :
+					    gen->mem, stride);
+	if (!prxring) {
+		fprintf(stderr, "pop_nm_rxring_init() on cpu %d: %s\n",
+			th->cpu, strerror(errno));
+		goto out;
+	}
 
 	printf("start recv loop on cpu %d, fd %d\n", th->cpu, th->nmd->fd);
 
@@ -384,6 +442,7 @@ void print_nmgen_info(struct nmgen *gen)
 	printf("pktlen (-l):         %d\n", gen->pktlen);
 	printf("ncpus (-n):          %d\n", gen->ncpus);
 	printf("batch (-b):          %d\n", gen->batch);
+	printf("stride (-z):         %d\n", gen->stride);
 	printf("interval (-i):       %f\n", gen->interval / 1000000);
 	printf("timeout (-t):        %d\n", gen->timeout);
 
@@ -405,12 +464,18 @@ void usage(void) {
 	printf("\nusage: nmge\n"
 	       "\n"
 	       "    -p port           netmap port\n"
-	       "    -P pci            pop memory slot or 'hugepage'\n"
+	       "    -P pci            pop memory slot, 'hugepage[:2M|:1G]',\n"
+	       "                      'hugetlbfs[:dir]', 'memfd', or 'anon'\n"
+	       "    -g chunk          commit pop memory by chunk MB on demand\n"
+	       "    -f nthreads       prefault pop memory on nthreads threads\n"
+	       "    -N                pop memory per NUMA node for each cpu\n"
 	       "    -m tx/rx          direction\n"
 	       "\n"
-	       "    -l pktlen         packet length\n"
+	       "    -l pktlen         packet length, over 2048 uses multiple slots\n"
 	       "    -n ncpus          number of CPUs to be used\n"
 	       "    -b batch          batch size\n"
+	       "    -z stride         buffer stride, 256-4096 (default by\n"
+	       "                      pktlen for tx, by MTU for rx)\n"
 	       "\n"
 	       "    -i interval       report interval\n"
 	       "    -t timeout        timeout to stop\n"
@@ -429,7 +494,7 @@ int main(int argc, char **argv)
 	struct nmgen_thread ths[MAX_CPU_NUM];
 	struct nmgen gen;
 	pthread_t ctid;
-	int ch, n;
+	int ch, n, numa = 0;
 
 	srand((unsigned)time(NULL));
 
@@ -443,18 +508,30 @@ int main(int argc, char **argv)
 	inet_pton(AF_INET, "10.0.10.1", &gen.dstip);
 	inet_pton(AF_INET, "10.0.10.2", &gen.srcip);
 	memset(gen.dstmac, 0xFF, ETH_ALEN);
+	pop_mem_attr_init(&gen.attr);
 
-	while ((ch = getopt(argc, argv, "p:P:m:l:n:b:i:t:d:s:D:S:h")) != -1) {
+	while ((ch = getopt(argc, argv, "p:P:g:f:Nm:l:n:b:z:i:t:d:s:D:S:h")) != -1) {
 		switch (ch) {
 		case 'p':
 			gen.port = optarg;
 			break;
 		case 'P':
-			if (strncmp(optarg, "hugepage", 8) == 0)
+			if (strcmp(optarg, "hugepage") == 0)
 				gen.pci = NULL;
 			else
 				gen.pci = optarg;
 			break;
+		case 'g':
+			gen.attr.initial = (size_t)atoi(optarg) << 20;
+			gen.attr.grow_chunk = gen.attr.initial;
+			gen.attr.watermark = 90;
+			break;
+		case 'f':
+			gen.attr.prefault_threads = atoi(optarg);
+			break;
+		case 'N':
+			numa = 1;
+			break;
 		case 'm':
 			if (strncmp(optarg, "tx", 2) == 0)
 				gen.mode = NMGEN_MODE_TX;
@@ -484,6 +561,13 @@ int main(int argc, char **argv)
 				return -1;
 			}
 			break;
+		case 'z':
+			gen.stride = atoi(optarg);
+			if (!pop_nm_stride_is_valid(gen.stride)) {
+				fprintf(stderr, "invalid stride %s\n", optarg);
+				return -1;
+			}
+			break;
 		case 'i':
 			sscanf(optarg, "%f", &gen.interval);
 			gen.interval *= 1000000;
@@ -519,13 +603,36 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
+	if (gen.stride && gen.mode == NMGEN_MODE_TX &&
+	    gen.pktlen <= 2048 && gen.stride < gen.pktlen) {
+		fprintf(stderr, "stride %d is smaller than pktlen %d\n",
+			gen.stride, gen.pktlen);
+		return -1;
+	}
+
+	/* the NIC writes frames up to the MTU into each slot */
+	if (gen.stride && gen.mode == NMGEN_MODE_RX &&
+	    pop_nm_port_stride(gen.port) > (size_t)gen.stride) {
+		fprintf(stderr, "stride %d is smaller than %lu for the MTU "
+			"of %s\n", gen.stride, pop_nm_port_stride(gen.port),
+			gen.port);
+		return -1;
+	}
+
 	/* rx needs all cpus to check all queues (skimped work) */
 	if (gen.mode == NMGEN_MODE_RX)
 		gen.ncpus = count_online_cpus();
 
 	print_nmgen_info(&gen);
 
-	gen.mem = pop_mem_init(gen.pci, 0);
+	/* place pop memory on the node of the NIC, or on each node */
+	gen.attr.numa_node = POP_MEM_NUMA_AUTO;
+	gen.attr.numa_dev = gen.port;
+	if (numa) {
+		gen.pool = pop_mem_pool_create(gen.pci, 0, &gen.attr);
+		gen.mem = gen.pool ? pop_mem_pool_get(gen.pool, 0) : NULL;
+	} else
+		gen.mem = pop_mem_init_attr(gen.pci, 0, &gen.attr);
 	if (!gen.mem) {
 		fprintf(stderr, "pop_mem_init(%s): %s\n",
 			gen.pci, strerror(errno));
@@ -639,7 +746,10 @@ int main(int argc, char **argv)
 	for (n = 0; n < gen.ncpus; n++)
 		pthread_join(ths[n].tid, NULL);
 
-	pop_mem_exit(gen.mem);
+	if (gen.pool)
+		pop_mem_pool_destroy(gen.pool);
+	else
+		pop_mem_exit(gen.mem);
 
 	return 0;
 }
@@ -20,6 +20,7 @@
 #include <linux/if_ether.h>
 
 #include <libpop.h>
+#include <libpop_ring.h>
 
 #define NETMAP_WITH_LIBS
 #include <net/netmap_user.h>
@@ -28,6 +29,8 @@
 #include <unvme.h>
 
 #include "pkt_desc.h"
+#include "trace.h"
+#include "tsc.h"
 
 static int caught_signal = 0;
 
@@ -54,6 +57,11 @@ int count_online_cpus(void)
 #define SLOT_NUM	256
 
 #define MAX_NVBATCH_NUM	128
+
+#define REPLAY_LEAD_INIT	1000000		/* nsec */
+#define REPLAY_LEAD_MAX		1000000000	/* nsec */
+#define REPLAY_LEAD_CALM	1024	/* batches without late units */
+
 #define NVGEN_WALK_MODE_SEQ	0
 #define	NVGEN_WALK_MODE_RANDOM	1
 #define	NVGEN_WALK_MODE_SAME	2
@@ -69,23 +77,37 @@ struct nvgen {
 
 	/* unvme */
 	char	*nvme;		/* PCIe slot for NVMe device */
+	char	*trace;		/* trace name on the device */
+	double	win_start, win_len;	/* time window of the trace (sec) */
+	uint64_t	seg_start, seg_end;	/* segments in the window */
 	int	nvbatch;	/* batch size for NVMe commands */
 	int	walk;		/* walk mode */
 	unsigned long		lba_start, lba_end;	/* LBA */
 	const unvme_ns_t	*unvme;	/* UNVMe context */
-	
+
+	int	stride;	/* bytes per packet on a unit */
+	int	packed;	/* packed blocks, a slot is a block */
+	int	upkts;	/* packets (packed: blocks) per unit */
+	int	upos;	/* slots per unit, with the header */
+	int	unblocks;	/* blocks per unit */
+
+	/* replay (-R). a packet departs at start_tsc + (its timestamp
+	 * on the trace - ts_origin) * tsc_scale. threads send segments
+	 * of the window in turn, and the window is repeated every period */
+	double		speed;		/* 0 is top speed, no schedule */
+	trace_t		*tr;
+	uint64_t	ts_origin;	/* first timestamp in the window */
+	double		tsc_per_ns;
+	double		tsc_scale;	/* tsc_per_ns / speed */
+	uint64_t	start_tsc;
+	uint64_t	period;		/* nsec */
+	size_t		tslen;		/* bytes to read timestamps of a unit */
 
 	float	interval;	/* report interval (usec) */
 	int	timeout;
 
 	pop_mem_t	*mem;	/* pop memory */
-};
-
-/* ring queue between netmap and unvme */
-struct nvgen_ring {
-	uint32_t	head;	/* write point	*/
-	uint32_t	tail;	/* read point	*/
-	uint32_t	mask;	/* bit mask for ring buffer */
+	pop_arena_t	*arenas;	/* per-thread arenas on mem */
 };
 
 struct nvgen_thread {
@@ -102,12 +124,30 @@ struct nvgen_thread {
 
 	unsigned long	lba_start, lba_end;	/* LBA range for this thread */
 
-	/* ring between netmap and unvme */
-	struct nvgen_ring	ring;
+	/* ring between netmap and unvme. positions are slots on buf */
+	pop_ring_t	*ring;
 
 	/* packet buffer on pop mem. managed by ring */
 	void		*buf;
 
+	/* packets on each slot, loaded to DRAM. a strided slot has 0
+	 * (the header, or invalid) or 1 packet, and a packed slot
+	 * (block) has up to PKT_BLK_MAX_PKTS packets */
+	uint8_t		npk[SLOT_NUM];
+	struct pkt_blk_ent	(*pk)[PKT_BLK_MAX_PKTS];
+
+	/* replay. departure TSC of packets on each slot, timestamps
+	 * read from NVMe for nvbatch units, a copy of the timestamps of
+	 * a unit on DRAM, and lead (TSC), how far ahead of departures
+	 * units are read, which adapts to the latency of NVMe and is
+	 * bounded by the ring */
+	uint64_t	(*pts)[PKT_BLK_MAX_PKTS];
+	void		*tsbuf;
+	uint64_t	*ts;
+	uint64_t	lead;
+	unsigned long	nlate;	/* units read after their departure */
+	unsigned long	hist[TSC_HIST_NBUCKETS];	/* departure error */
+
 	int		cancel;
 	unsigned long	npkts;	/* packet counter	*/
 	unsigned long	nbits;	/* bit counter	for Ethernet NIC */
@@ -117,106 +157,168 @@ struct nvgen_thread {
 
 
 
-void nvgen_ring_init(struct nvgen_ring *r)
+int nvgen_init_thread_body(struct nvgen_thread *th)
 {
-	r->head = 0;
-	r->tail = 0;
-	r->mask = SLOT_NUM - 1;
-}
+	struct nvgen *gen = th->gen;
 
-static inline bool ring_empty(const struct nvgen_ring *r)
-{
-	return (r->head == r->tail);
-}
+	th->lba_start = gen->lba_start +
+		(gen->lba_end - gen->lba_start) / gen->ncpus * th->cpu;
+	th->lba_end = gen->lba_start +
+		(gen->lba_end - gen->lba_start) / gen->ncpus * (th->cpu + 1);
 
-static inline bool ring_full(const struct nvgen_ring *r)
-{
-	return (((r->head + 1) & r->mask) == r->tail);
-}
+	/* read units where store wrote them */
+	th->lba_start -= (th->lba_start - gen->lba_start) % gen->unblocks;
 
-static inline uint32_t ring_write_next(struct nvgen_ring *r, uint32_t head)
-{
-	return (head + 1) & r->mask;
-}
+	printf("cpu=%d lba_start 0x%lx bla_end 0x%lx\n",
+	       th->cpu, th->lba_start, th->lba_end);
 
-static inline uint32_t ring_write_next_batch(struct nvgen_ring *r,
-					     uint32_t head,
-					     uint32_t batch)
-{
-	return (head + batch) & r->mask;
-}
+	th->buf = pop_arena_alloc(&gen->arenas[th->cpu],
+				  gen->stride * SLOT_NUM);
+	if (!th->buf) {
+		fprintf(stderr, "pop_arena_alloc() on cpu %d: %s\n",
+			th->cpu, strerror(errno));
+		return -1;
+	}
 
-static inline uint32_t ring_read_next(struct nvgen_ring *r, uint32_t tail)
-{
-	return (tail + 1) & r->mask;
-}
+	th->pk = calloc(SLOT_NUM, sizeof(*th->pk));
+	if (!th->pk) {
+		fprintf(stderr, "failed to allocate packet index on cpu %d\n",
+			th->cpu);
+		return -1;
+	}
 
+	if (gen->speed > 0) {
+		th->tsbuf = pop_arena_alloc(&gen->arenas[th->cpu],
+					    gen->tslen * gen->nvbatch);
+		th->pts = calloc(SLOT_NUM, sizeof(*th->pts));
+		th->ts = calloc(trace_seg_max_pkts(gen->tr), sizeof(uint64_t));
+		if (!th->tsbuf || !th->pts || !th->ts) {
+			fprintf(stderr, "failed to allocate timestamps on "
+				"cpu %d\n", th->cpu);
+			return -1;
+		}
+		th->lead = REPLAY_LEAD_INIT * gen->tsc_per_ns;
+	}
 
-#define ring_read_avail(r) \
-	((r)->head - (r)->tail) < 0 ?			\
-	(r)->head - (r)->tail + SLOT_NUM :		\
-	(r)->head - (r)->tail
+	th->ring = pop_ring_create(SLOT_NUM,
+				   POP_RING_SP_ENQ | POP_RING_SC_DEQ);
+	if (!th->ring) {
+		fprintf(stderr, "pop_ring_create() on cpu %d: %s\n",
+			th->cpu, strerror(errno));
+		return -1;
+	}
+	
+	return 0;
+}
 
-/*
-static inline uint32_t ring_read_avail(const struct nvgen_ring *r)
+static inline uint64_t replay_tsc(struct nvgen *gen, uint64_t ns)
 {
-	int remain = r->head - r->tail;
-	if (remain < 0)
-		remain += SLOT_NUM;
-	return remain;
+	return gen->start_tsc + (uint64_t)(ns * gen->tsc_scale);
 }
-*/
 
-static uint32_t ring_write_avail(const struct nvgen_ring *r)
+/* replay_departure: departure of the first packet of segment seg on
+ * the loop-th round, from the index */
+static inline uint64_t replay_departure(struct nvgen *gen, uint64_t seg,
+					uint64_t loop)
 {
-	int remain = r->tail - r->head;
+	return replay_tsc(gen, gen->tr->segs[seg].ts_first +
+			  loop * gen->period - gen->ts_origin);
+}
 
-	if (remain == 0)
-		return SLOT_NUM;
+/* replay_aread_ts: read timestamps of packets on segment seg to buf.
+ * they start at the returned offset on buf */
+unvme_iod_t replay_aread_ts(struct nvgen_thread *th, uint64_t seg,
+			    void *buf, unsigned int *skip)
+{
+	struct nvgen *gen = th->gen;
+	const unvme_ns_t *ns = gen->unvme;
+	struct trace_seg *s = &gen->tr->segs[seg];
+	uint64_t off = s->pkt_first * sizeof(uint64_t);
+	size_t len;
 
-	if (remain < 0)
-		remain += SLOT_NUM - 1;
+	*skip = off & (ns->blocksize - 1);
+	len = *skip + s->npkts * sizeof(uint64_t);
 
-	return remain;
+	return unvme_aread(ns, th->cpu, buf,
+			   gen->tr->sb.ts_lba + (off >> ns->blockshift),
+			   (len + ns->blocksize - 1) >> ns->blockshift);
 }
 
-int nvgen_init_thread_body(struct nvgen_thread *th)
+/* replay_load: set departures of packets on the upos slots from pos,
+ * which hold segment seg on the loop-th round of the trace. ts on pop
+ * memory, p2pmem with -P, is copied to DRAM at once as pkt_unit_load()
+ * does. returns the departure of the first packet, or 0 when no packet */
+uint64_t replay_load(struct nvgen_thread *th, unsigned int pos,
+		     uint64_t seg, uint64_t loop, const uint64_t *ts)
 {
-	pop_buf_t *pbuf;
 	struct nvgen *gen = th->gen;
+	struct trace_seg *s = &gen->tr->segs[seg];
+	uint64_t base = loop * gen->period - gen->ts_origin;
+	unsigned int n, k, i = 0;
+
+	memcpy(th->ts, ts, s->npkts * sizeof(uint64_t));
+	ts = th->ts;
+
+	for (n = 0; n < gen->upos; n++) {
+		if (!s->npkts)
+			th->npk[pos + n] = 0;
+		for (k = 0; k < th->npk[pos + n]; k++, i++) {
+			/* the unit does not match the index */
+			if (i >= s->npkts)
+				i = s->npkts - 1;
+			th->pts[pos + n][k] = replay_tsc(gen, base + ts[i]);
+		}
+	}
 
-	th->lba_start = gen->lba_end / gen->ncpus * th->cpu;
-	th->lba_end = gen->lba_end / gen->ncpus * (th->cpu + 1);
+	for (n = 0; n < gen->upos; n++) {
+		if (th->npk[pos + n])
+			return th->pts[pos + n][0];
+	}
+	return 0;
+}
 
-	printf("cpu=%d lba_start 0x%lx bla_end 0x%lx\n",
-	       th->cpu, th->lba_start, th->lba_end);
+void replay_report(struct nvgen_thread *th)
+{
+	unsigned long total = 0;
+	int n;
 
-	pbuf = pop_buf_alloc(gen->mem, 2048 * SLOT_NUM);
-	if (!pbuf) {
-		fprintf(stderr, "pop_buf_alloc() on cpu %d: %s\n",
-			th->cpu, strerror(errno));
-		return -1;
+	for (n = 0; n < TSC_HIST_NBUCKETS; n++)
+		total += th->hist[n];
+	if (!total)
+		return;
+
+	printf("CPU=%d departure error of %lu packets, "
+	       "%lu units read late, lead %.1f usec\n",
+	       th->cpu, total, th->nlate,
+	       th->lead / th->gen->tsc_per_ns / 1000);
+	for (n = 0; n < TSC_HIST_NBUCKETS; n++) {
+		if (!th->hist[n])
+			continue;
+		printf("  %s %10lu nsec: %12lu (%6.2f%%)\n",
+		       n < TSC_HIST_NBUCKETS - 1 ? "< " : ">=",
+		       n < TSC_HIST_NBUCKETS - 1 ? 1UL << n : 1UL << (n - 1),
+		       th->hist[n], (double)th->hist[n] / total * 100);
 	}
-	pop_buf_put(pbuf, 2048 * SLOT_NUM);
-	th->buf = pop_buf_data(pbuf);
-
-	nvgen_ring_init(&th->ring);
-	
-	return 0;
 }
 
 void *nvgen_sender_netmap_body(void *arg)
 {
-	unsigned int head, tail, loaded, space, batch, b;
+	unsigned int loaded, space, batch, b, done = 0, inflight = 0;
+	unsigned int tpk = 0;	/* packets sent on the tail slot */
+	unsigned int nsched = 0;	/* packets of the last burst */
+	uint32_t oldest, tail;
 	unsigned long npkts, nbits;
+	struct pop_nm_txring *ptx;
 	double elapsed;
 	struct timeval start, end;
 	struct nvgen_thread *th = arg;
 	struct nvgen *gen = th->gen;
 	struct netmap_ring *ring;
 	cpu_set_t target_cpu_set;
-	void *pkts[SLOT_NUM];
 	uintptr_t pkts_phy[SLOT_NUM];	/* phy addr of packets */
+	uintptr_t paddr[MAX_BATCH_NUM];
+	uint16_t len[MAX_BATCH_NUM];
+	uint64_t sched[MAX_BATCH_NUM], now = 0;
 	int n;
 
 	/* pin this thread on the cpu */
@@ -226,12 +328,20 @@ void *nvgen_sender_netmap_body(void *arg)
 
 	/* determine phy addr of packets on pop buf region */
 	for (n = 0; n < SLOT_NUM; n++) {
-		pkts[n] = th->buf + (2048 * n);
-		pkts_phy[n] = pop_virt_to_phys(gen->mem, pkts[n]);
+		pkts_phy[n] = pop_virt_to_phys(gen->mem,
+					       th->buf + (gen->stride * n));
 	}
 
 	ring = NETMAP_TXRING(th->nmd->nifp, th->cpu);
 
+	/* slots on the NIC are released to the unvme thread when sent */
+	ptx = pop_nm_txring_init(ring);
+	if (!ptx) {
+		fprintf(stderr, "pop_nm_txring_init() on cpu %d: %s\n",
+			th->cpu, strerror(errno));
+		goto out;
+	}
+
 	printf("start xmit loop on cpu %d, fd %d\n", th->cpu, th->nmd->fd);
 
 	gettimeofday(&start, NULL);
@@ -241,55 +351,97 @@ void *nvgen_sender_netmap_body(void *arg)
 		npkts = 0;
 		nbits = 0;
 
-		/* wait packets read from NVMe */
-		loaded = ring_read_avail(&th->ring);
-		if (loaded < 2)
+		/* wait packets read from NVMe. the first inflight
+		 * entries are on the NIC or skipped */
+		loaded = pop_ring_sc_peek(th->ring, &oldest, inflight + 1);
+		loaded -= inflight;
+		tail = (oldest + inflight) & (SLOT_NUM - 1);
+		if (!loaded && !inflight)
 			continue;
-			
+
+		/* replay: wait for the departure of the next packet.
+		 * sync while waiting only to push the last burst, or to
+		 * release slots to the unvme thread */
+		if (gen->speed > 0) {
+			now = tsc_read();
+			if (!nsched && inflight < SLOT_NUM / 2 &&
+			    (!loaded || (tpk < th->npk[tail] &&
+					 th->pts[tail][tpk] > now))) {
+				pop_cpu_relax();
+				continue;
+			}
+		}
+
 		if (ioctl(th->nmd->fd, NIOCTXSYNC, NULL) < 0) {
 			fprintf(stderr, "ioctl error on cpu %d: %s\n",
 				th->cpu, strerror(errno));
 			goto out;
 		}
 
+		/* departure error of the last burst: from the schedule
+		 * to this doorbell */
+		if (gen->speed > 0) {
+			now = tsc_read();
+			for (b = 0; b < nsched; b++)
+				tsc_hist_add(th->hist, (now - sched[b]) /
+					     gen->tsc_per_ns);
+			nsched = 0;
+		}
+
+		/* sent packets can be overwritten by NVMe now. release
+		 * slots whose packets are all sent. completions of a
+		 * slot partially done are carried to the next round */
+		done += pop_nm_txring_complete(ptx, NULL, SLOT_NUM);
+		for (n = 0; n < inflight; n++) {
+			if (th->npk[oldest] > done)
+				break;
+			done -= th->npk[oldest];
+			oldest = (oldest + 1) & (SLOT_NUM - 1);
+		}
+		if (n) {
+			pop_ring_sc_release(th->ring, n);
+			inflight -= n;
+		}
+
+		if (!loaded)
+			continue;
+
 		space = nm_ring_space(ring);
 		if (!space)
 			continue;
 
-		/* XXX: we use 4k block NVMe, so handling multiple of 2
-		 * packets is convenient */
-		space &= ~0x0001;
-
 		batch = space > gen->batch ? gen->batch : space;
-		batch = batch > loaded ? loaded : batch;
 
-		head = ring->head;
-		tail = th->ring.tail;
-
-		for (b = 0; b < batch; b++) {
-			struct netmap_slot *slot = &ring->slot[head];
-			slot->flags |= NS_PHY_INDIRECT;
-			slot->ptr = pkts_phy[tail];
-			slot->len = get_pktlen_from_desc(pkts[tail], 2048);
-
-			npkts++;
-			nbits += (slot->len << 3);
-
-			/* advance nvgen_ring and netmap_ring */
-			tail = ring_read_next(&th->ring, tail);
-			head = nm_ring_next(ring, head);
+		/* offsets and lengths are on DRAM, not on the p2pmem. a
+		 * slot is inflight when all its packets are handed. on
+		 * replay, packets whose departure is ahead wait */
+		for (b = 0, n = 0; b < batch && n < loaded;) {
+			for (; b < batch && tpk < th->npk[tail]; b++, tpk++) {
+				struct pkt_blk_ent *pk = &th->pk[tail][tpk];
+				if (gen->speed > 0) {
+					if (th->pts[tail][tpk] > now) {
+						batch = b;
+						break;
+					}
+					sched[b] = th->pts[tail][tpk];
+				}
+				paddr[b] = pkts_phy[tail] + pk->off;
+				len[b] = pk->len;
+				nbits += (len[b] << 3);
+			}
+			if (tpk < th->npk[tail])
+				break;
+			tpk = 0;
+			tail = (tail + 1) & (SLOT_NUM - 1);
+			n++;
 		}
 
-		ring->head = ring->cur = head;
-		/* XXX: xmit all stored packets here */
-		/*
-		while (nm_tx_pending(ring)) {
-			ioctl(th->nmd->fd, NIOCTXSYNC, NULL);
-			sched_yield();
-		}
-		*/
+		npkts = pop_nm_txring_burst_paddr(ptx, paddr, len, NULL, b);
+		inflight += n;
+
+		if (gen->speed > 0)
+			nsched = npkts;
 
-		th->ring.tail = tail;
 		th->npkts += npkts;
 		th->nbits += nbits;
 	}
@@ -298,6 +450,7 @@ void *nvgen_sender_netmap_body(void *arg)
 		ioctl(th->nmd->fd, NIOCTXSYNC, NULL);
 		usleep(1);
 	}
+	pop_nm_txring_exit(ptx);
 
 	gettimeofday(&end, NULL);
 
@@ -309,6 +462,9 @@ void *nvgen_sender_netmap_body(void *arg)
 	       th->npkts / elapsed, th->npkts / elapsed / 1000000,
 	       th->nbits / elapsed, th->nbits / elapsed / 1000000);
 
+	if (gen->speed > 0)
+		replay_report(th);
+
 out:
 	return NULL;
 }
@@ -319,14 +475,16 @@ unsigned long next_lba(int walk, unsigned long lba,
 {
 	switch (walk) {
 	case NVGEN_WALK_MODE_SEQ:
-		if (lba + (nblocks << 1) < lba_end)
+		if (lba + (nblocks << 1) <= lba_end)
 			return lba + nblocks;
 		else
 			return lba_start;
 		break;
 
 	case NVGEN_WALK_MODE_RANDOM:
-		return rand() % (lba_end - lba_start - nblocks) + lba_start;
+		/* a random unit */
+		return (rand() % ((lba_end - lba_start) / nblocks)) * nblocks +
+			lba_start;
 
 	case NVGEN_WALK_MODE_SAME:
 		return lba;
@@ -342,8 +500,16 @@ void *nvgen_sender_unvme_body(void *arg)
 	struct nvgen_thread *th = arg;
 	struct nvgen *gen = th->gen;
 
-	unsigned int lba, space, batch, b, head, nblocks = 0;
+	unsigned int lba, space, batch, b, pos, hlen;
+	uint32_t head;
 	unvme_iod_t iod[MAX_NVBATCH_NUM];
+	unvme_iod_t tsiod[MAX_NVBATCH_NUM];
+	unsigned int tsskip[MAX_NVBATCH_NUM];
+	uint64_t segs[MAX_NVBATCH_NUM], loops[MAX_NVBATCH_NUM];
+	uint64_t seg = gen->seg_start + th->cpu, loop = 0;
+	uint64_t first, ready, t0, t, lat_avg = 0;
+	unsigned int calm = 0;
+	struct pkt_unit_ent ents[PKT_UNIT_MAX_PKTS];
 	void *slots[SLOT_NUM];
 	cpu_set_t target_cpu_set;
 	int n, ret, cpu;
@@ -355,62 +521,141 @@ void *nvgen_sender_unvme_body(void *arg)
 	pthread_setaffinity_np(th->tid, sizeof(cpu_set_t), &target_cpu_set);
 
 	for (n = 0; n < SLOT_NUM; n++) {
-		slots[n] = th->buf + (2048 * n);
+		slots[n] = th->buf + (gen->stride * n);
 	}
 
 	lba = th->lba_start;
 
+	/* replay: threads read segments in turn */
+	if (gen->speed > 0 && seg >= gen->seg_end)
+		return NULL;
+
 	printf("start unvme loop qid %d on cpu %d\n", th->cpu, cpu);
 
 	while (!th->cancel) {
 		
-		space = ring_write_avail(&th->ring);
-		if (space < 2)
+		space = pop_ring_sp_reserve(th->ring, &head, gen->upos);
+		if (space < gen->upos)
 			continue;
-		       
-		/* XXX: we use 4k block NVMe, so handling multiple of 2
-		 * packets is convenient */
-		space &= ~0x0001;
-		batch = space >> 1 > gen->nvbatch ? gen->nvbatch : space >> 1;
 
-		/*
-		printf("head=%u tail=%u space=%u batch=%u\n",
-		       th->ring.head, th->ring.tail, space, batch);
-		*/
-
-		if (gen->walk == NVGEN_WALK_MODE_SEQ) {
-			nblocks = batch;
-			batch = 1;
-		} else if (gen->walk == NVGEN_WALK_MODE_RANDOM) {
-			nblocks = 1;
-			//batch = batch;
-		} else {
-			fprintf(stderr, "invalid walk %d\n", gen->walk);
-			break;
+		/* a read fills contiguous slots with a unit. slots at
+		 * the end of buf short of a unit are skipped */
+		if (SLOT_NUM - head < gen->upos) {
+			for (n = head; n < SLOT_NUM; n++)
+				th->npk[n] = 0;
+			pop_ring_sp_commit(th->ring, SLOT_NUM - head);
+			continue;
 		}
+		if (space > SLOT_NUM - head)
+			space = SLOT_NUM - head;
 
-		head = th->ring.head;
-		for (b = 0; b < batch; b++) { /* slot is 2k, block is 4k */
-			iod[b] = unvme_aread(gen->unvme, th->cpu,
-					     slots[head], lba, nblocks);
+		batch = space / gen->upos;
+		batch = batch > gen->nvbatch ? gen->nvbatch : batch;
+
+		t0 = tsc_read();
+		first = 0;
+		for (b = 0; b < batch; b++) {
+			if (gen->speed > 0) {
+				/* units up to lead ahead are on the ring */
+				if (replay_departure(gen, seg, loop) >
+				    t0 + th->lead)
+					break;
+				lba = trace_seg_lba(gen->tr, seg);
+				tsiod[b] = replay_aread_ts(th, seg,
+							   th->tsbuf +
+							   gen->tslen * b,
+							   &tsskip[b]);
+				segs[b] = seg;
+				loops[b] = loop;
+				seg += gen->ncpus;
+				if (seg >= gen->seg_end) {
+					seg = gen->seg_start + th->cpu;
+					loop++;
+				}
+			}
 
-			lba = next_lba(gen->walk, lba,
-				       th->lba_start, th->lba_end, nblocks);
+			iod[b] = unvme_aread(gen->unvme, th->cpu,
+					     slots[head + gen->upos * b], lba,
+					     gen->unblocks);
 
-			head = ring_write_next_batch(&th->ring, head,
-						     (nblocks << 1));
-			/* slot is 2k, but block is 4k. advance ring
-			 * with nblock * 2*/
+			lba = next_lba(gen->walk, lba, th->lba_start,
+				       th->lba_end, gen->unblocks);
 		}
+		if (!b) {
+			pop_cpu_relax();
+			continue;
+		}
+		batch = b;
 
 		for (b = 0; b < batch; b++) {
+			pos = head + gen->upos * b;
 			ret = unvme_apoll(iod[b], UNVME_TIMEOUT);
-			if (ret == 0) {
-				th->nbytes += nblocks * 4096;
+			if (gen->speed > 0 &&
+			    (!tsiod[b] || unvme_apoll(tsiod[b], UNVME_TIMEOUT)))
+				ret = -1;
+			if (ret == 0)
+				th->nbytes += gen->unblocks *
+					gen->unvme->blocksize;
+
+			/* packets for the netmap thread */
+			for (n = 0; n < gen->upos; n++)
+				th->npk[pos + n] = 0;
+			if (ret != 0)
+				continue;
+
+			if (gen->packed) {
+				/* an index on each block */
+				for (n = 0; n < gen->upos; n++) {
+					ret = pkt_blk_load(slots[pos + n],
+							   th->pk[pos + n]);
+					th->npk[pos + n] = ret < 0 ? 0 : ret;
+				}
+			} else {
+				ret = pkt_unit_load(slots[pos], gen->stride,
+						    ents, gen->upkts);
+				hlen = gen->upos - gen->upkts;
+				for (n = 0; n < ret; n++) {
+					th->npk[pos + hlen + n] = 1;
+					th->pk[pos + hlen + n][0].off = 0;
+					th->pk[pos + hlen + n][0].len =
+						ents[n].len;
+				}
+			}
+
+			if (gen->speed > 0) {
+				t = replay_load(th, pos, segs[b], loops[b],
+						th->tsbuf + gen->tslen * b +
+						tsskip[b]);
+				if (!first)
+					first = t;
 			}
 		}
 
-		th->ring.head = head;
+		/* replay: units must be on the ring before the departure
+		 * of their first packet. a late unit doubles the lead.
+		 * the lead decays while no unit is late, but stays above
+		 * four times the latency of NVMe */
+		if (gen->speed > 0 && first) {
+			ready = tsc_read();
+			t = ready - t0;
+			lat_avg = lat_avg ? (lat_avg * 7 + t) >> 3 : t;
+			if (first < ready) {
+				th->nlate++;
+				th->lead <<= 1;
+				calm = 0;
+			} else if (++calm >= REPLAY_LEAD_CALM) {
+				th->lead -= th->lead >> 3;
+				calm = 0;
+			}
+
+			t = REPLAY_LEAD_MAX * gen->tsc_per_ns;
+			if (th->lead > t)
+				th->lead = t;
+			if (th->lead < (lat_avg << 2))
+				th->lead = lat_avg << 2;
+		}
+
+		pop_ring_sp_commit(th->ring, gen->upos * batch);
 	}
 
 	return NULL;
@@ -562,6 +807,26 @@ void *count_thread(void *arg)
 	return NULL;
 }
 
+/* nvgen_trace_window: find segments in the time window by the index
+ * of the trace. a segment partially in the window is included */
+int nvgen_trace_window(struct nvgen *gen, trace_t *tr)
+{
+	uint64_t ts_start, ts_end;
+
+	ts_start = tr->sb.ts_first + (uint64_t)(gen->win_start * 1e9);
+	gen->seg_start = trace_seek(tr, ts_start);
+	gen->seg_end = tr->sb.nsegs;
+	if (gen->win_len > 0) {
+		ts_end = ts_start + (uint64_t)(gen->win_len * 1e9);
+		gen->seg_end = trace_seek(tr, ts_end);
+		if (gen->seg_end < tr->sb.nsegs &&
+		    tr->segs[gen->seg_end].ts_first <= ts_end)
+			gen->seg_end++;
+	}
+
+	return gen->seg_start < gen->seg_end ? 0 : -1;
+}
+
 void print_nvgen_info(struct nvgen *gen)
 {
 	printf("================ nvgen ================\n");
@@ -572,6 +837,16 @@ void print_nvgen_info(struct nvgen *gen)
 	       gen->mode == NVGEN_MODE_TX ? "tx" : "rx");
 	printf("ncpus (-n):          %d\n", gen->ncpus);
 	printf("batch (-b):          %d\n", gen->batch);
+	printf("stride (-z):         %d\n", gen->stride);
+	printf("packed (-k):         %s\n", gen->packed ? "yes" : "no");
+	printf("unit packets (-U):   %d\n", gen->upkts);
+	printf("trace (-T):          %s\n", gen->trace ? gen->trace : "none");
+	printf("window (-S, -D):     %.3f sec from %.3f sec\n",
+	       gen->win_len, gen->win_start);
+	if (gen->speed > 0)
+		printf("replay speed (-R):   %gx\n", gen->speed);
+	else
+		printf("replay speed (-R):   top\n");
 	printf("nvme end lba (-e)    0x%lx\n", gen->lba_end);
 	printf("nvme batch (-B):     %d\n", gen->nvbatch);
 	printf("nvme walk mode (-w): %s\n",
@@ -587,13 +862,27 @@ void usage(void) {
 	printf("\nusage: nmge\n"
 	       "\n"
 	       "    -p port           netmap port\n"
-	       "    -P pci            pop memory slot or 'hugepage'\n"
+	       "    -P pci            pop memory slot, 'hugepage[:2M|:1G]',\n"
+	       "                      'hugetlbfs[:dir]', 'memfd', or 'anon'\n"
 	       "    -u pci            pcie slot for nvme device\n"
 	       "    -m tx/rx          direction (now, tx only)\n"
 	       "\n"
 	       "    -n ncpus          number of CPUs to be used\n"
 	       "    -b batch          batch size for netmap\n"
+	       "    -z stride         bytes per packet on nvme, 256-4096\n"
+	       "    -k                packed blocks on nvme (store -k)\n"
+	       "    -U npkts          packets in a unit on nvme (store -b),\n"
+	       "                      or blocks in a unit with -k\n"
 	       "\n"
+	       "    -T name           send a trace written by store -t\n"
+	       "    -S sec            start of the window of the trace (-T)\n"
+	       "    -D sec            duration of the window, 0 to the end\n"
+	       "    -R speed          replay the trace (-T) on its timestamps\n"
+	       "                      at speed times, e.g., 1 or 10, or 'top'\n"
+	       "                      units are read ahead of their departure\n"
+	       "                      by a lead that adapts to NVMe latency,\n"
+	       "                      up to the ring of each thread. packets\n"
+	       "                      faster than NVMe can read depart late\n"
 	       "    -e lba            end lba on nvme\n"
 	       "    -B bacth          batch size for unvme\n"
 	       "    -w walk           walk mode (seq or random)"
@@ -608,7 +897,9 @@ int main(int argc, char **argv)
 {
 	struct nvgen_thread ths[MAX_CPU_NUM];
 	struct nvgen gen;
+	pop_mem_attr_t attr;
 	pthread_t ctid;
+	size_t usize, asize;
 	int ch, n;
 
 	srand((unsigned)time(NULL));
@@ -619,16 +910,18 @@ int main(int argc, char **argv)
 	gen.batch = 1;
 	gen.lba_end = 0xF0000;
 	gen.nvbatch = 1;
+	gen.stride = PKT_STRIDE;
+	gen.upkts = 16;
 	gen.interval = 1000000;
 	gen.timeout = 0;
 
-	while ((ch = getopt(argc, argv, "p:P:u:m:n:b:e:B:w:i:t:h")) != -1) {
+	while ((ch = getopt(argc, argv, "p:P:u:m:n:b:z:kU:T:S:D:R:e:B:w:i:t:h")) != -1) {
 		switch (ch) {
 		case 'p':
 			gen.port = optarg;
 			break;
 		case 'P':
-			if (strncmp(optarg, "hugepage", 8) == 0)
+			if (strcmp(optarg, "hugepage") == 0)
 				gen.pci = NULL;
 			else
 				gen.pci = optarg;
@@ -662,6 +955,50 @@ int main(int argc, char **argv)
 				return -1;
 			}
 			break;
+		case 'z':
+			gen.stride = atoi(optarg);
+			if (!pop_nm_stride_is_valid(gen.stride)) {
+				fprintf(stderr, "invalid stride %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'k':
+			gen.packed = 1;
+			break;
+		case 'U':
+			gen.upkts = atoi(optarg);
+			if (gen.upkts < 1) {
+				fprintf(stderr, "invalid npkts %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'T':
+			gen.trace = optarg;
+			break;
+		case 'S':
+			if (sscanf(optarg, "%lf", &gen.win_start) < 1 ||
+			    gen.win_start < 0) {
+				fprintf(stderr, "invalid start %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'D':
+			if (sscanf(optarg, "%lf", &gen.win_len) < 1 ||
+			    gen.win_len < 0) {
+				fprintf(stderr, "invalid duration %s\n",
+					optarg);
+				return -1;
+			}
+			break;
+		case 'R':
+			if (strcmp(optarg, "top") == 0)
+				gen.speed = 0;
+			else if (sscanf(optarg, "%lf", &gen.speed) < 1 ||
+				 gen.speed <= 0) {
+				fprintf(stderr, "invalid speed %s\n", optarg);
+				return -1;
+			}
+			break;
 		case 'e':
 			if (sscanf(optarg, "0x%lx", &gen.lba_end) < 1) {
 				printf("invalid end lba: %s\n", optarg);
@@ -709,6 +1046,10 @@ int main(int argc, char **argv)
 		fprintf(stderr, "-u unvme device must be specified\n");
 		return -1;
 	}
+	if (gen.speed > 0 && !gen.trace) {
+		fprintf(stderr, "-R needs a trace (-T)\n");
+		return -1;
+	}
 
 	if (gen.ncpus * 2 > count_online_cpus()) {
 		fprintf(stderr, "ncpus must be < %d\n", count_online_cpus());
@@ -721,8 +1062,12 @@ int main(int argc, char **argv)
 
 	print_nvgen_info(&gen);
 
-	/* initialize libpop and unvme */
-	gen.mem = pop_mem_init(gen.pci, 0);
+	/* initialize libpop and unvme. pop memory sits on the node
+	 * of the NVMe device that DMAs to it */
+	pop_mem_attr_init(&attr);
+	attr.numa_node = POP_MEM_NUMA_AUTO;
+	attr.numa_dev = gen.nvme;
+	gen.mem = pop_mem_init_attr(gen.pci, 0, &attr);
 	if (!gen.mem) {
 		fprintf(stderr, "pop_mem_init(%s): %s\n",
 			gen.pci, strerror(errno));
@@ -732,6 +1077,93 @@ int main(int argc, char **argv)
 	gen.unvme = unvme_open(gen.nvme);
 	unvme_register_pop_mem(gen.mem);
 
+	/* the trace tells the format and the extent of units */
+	if (gen.trace) {
+		trace_t *tr = trace_open(gen.unvme, gen.mem, gen.trace);
+		if (!tr) {
+			fprintf(stderr, "trace_open(%s): %s\n",
+				gen.trace, strerror(errno));
+			return -1;
+		}
+		struct trace_seg *sf, *sl;
+		uint64_t npkts;
+
+		gen.packed = (tr->sb.format == TRACE_FMT_PACKED);
+		gen.stride = tr->sb.stride;
+		gen.upkts = tr->sb.upkts;
+
+		if (nvgen_trace_window(&gen, tr) < 0) {
+			fprintf(stderr, "no packets in the window of trace "
+				"%s\n", gen.trace);
+			return -1;
+		}
+		gen.lba_start = trace_seg_lba(tr, gen.seg_start);
+		gen.lba_end = trace_seg_lba(tr, gen.seg_end);
+
+		/* replay keeps the index to find segments and their
+		 * timestamps */
+		if (gen.speed > 0) {
+			sf = &tr->segs[gen.seg_start];
+			sl = &tr->segs[gen.seg_end - 1];
+			npkts = sl->pkt_first + sl->npkts - sf->pkt_first;
+			gen.tr = tr;
+			gen.ts_origin = sf->ts_first;
+			gen.period = sl->ts_last - sf->ts_first;
+			if (npkts > 1)
+				gen.period += gen.period / (npkts - 1);
+			if (!gen.period)
+				gen.period = 1;
+			gen.tslen = trace_seg_max_pkts(tr) * sizeof(uint64_t);
+			gen.tslen = ((gen.tslen + gen.unvme->blocksize - 1) &
+				     ~(gen.unvme->blocksize - 1)) +
+				gen.unvme->blocksize;
+		} else
+			trace_close(tr);
+	}
+
+	/* a unit is read into upos contiguous slots, see pkt_desc.h */
+	if (gen.packed) {
+		gen.stride = PKT_BLK_SIZE;
+		gen.upos = gen.upkts;
+		usize = (size_t)gen.upkts * PKT_BLK_SIZE;
+	} else {
+		gen.upos = PKT_UNIT_HDRLEN / gen.stride + gen.upkts;
+		usize = pkt_unit_size(gen.upkts, gen.stride);
+	}
+	if (gen.upos > SLOT_NUM / 2) {
+		fprintf(stderr, "unit of %d packets is too large\n",
+			gen.upkts);
+		return -1;
+	}
+	if (usize & (gen.unvme->blocksize - 1)) {
+		fprintf(stderr, "unit of %d packets is not a multiple of "
+			"block\n", gen.upkts);
+		return -1;
+	}
+	gen.unblocks = usize >> gen.unvme->blockshift;
+
+	/* the random walk picks a unit in the LBA range of each thread */
+	if (gen.mode == NVGEN_MODE_TX && !gen.tr &&
+	    gen.walk == NVGEN_WALK_MODE_RANDOM &&
+	    (gen.lba_end - gen.lba_start) / gen.ncpus < gen.unblocks) {
+		fprintf(stderr, "LBA range 0x%lx-0x%lx is smaller than a unit "
+			"per thread\n", gen.lba_start, gen.lba_end);
+		return -1;
+	}
+
+	/* a slice of the pop memory for each thread */
+	if (gen.mode == NVGEN_MODE_TX) {
+		asize = gen.stride * SLOT_NUM;
+		if (gen.speed > 0)
+			asize += gen.tslen * gen.nvbatch;
+		gen.arenas = pop_mem_split(gen.mem, gen.ncpus, asize);
+		if (!gen.arenas) {
+			fprintf(stderr, "pop_mem_split(%s): %s\n",
+				gen.pci, strerror(errno));
+			return -1;
+		}
+	}
+
 	if (signal(SIGINT, sig_handler) == SIG_ERR) {
 		perror("signal");
 		return -1;
@@ -810,11 +1242,27 @@ int main(int argc, char **argv)
 	}
 
 
+	/* replay starts after threads fill their rings */
+	if (gen.speed > 0) {
+		gen.tsc_per_ns = tsc_calibrate(100);
+		gen.tsc_scale = gen.tsc_per_ns / gen.speed;
+		gen.start_tsc = tsc_read() +
+			(uint64_t)(gen.tsc_per_ns * (gen.ncpus + 100) * 1000000);
+		printf("tsc %.3f GHz, replay period %lu nsec\n",
+		       gen.tsc_per_ns, gen.period);
+	}
+
+	/* set up all senders before any starts */
+	for (n = 0; n < gen.ncpus; n++) {
+		if (gen.mode == NVGEN_MODE_TX &&
+		    nvgen_init_thread_body(&ths[n]) < 0)
+			return -1;
+	}
+
 	/* spawn the threads */
 	for (n = 0; n < gen.ncpus; n++) {
 		switch (gen.mode) {
 		case NVGEN_MODE_TX:
-			nvgen_init_thread_body(&ths[n]);
 			pthread_create(&ths[n].tid, NULL,
 				       nvgen_sender_netmap_body, &ths[n]);
 			pthread_create(&ths[n].tid, NULL,
@@ -839,9 +1287,18 @@ int main(int argc, char **argv)
 
 	/* join the threads */
 	pthread_join(ctid, NULL);
-	for (n = 0; n < gen.ncpus; n++)
+	for (n = 0; n < gen.ncpus; n++) {
 		pthread_join(ths[n].tid, NULL);
+		free(ths[n].pk);
+		free(ths[n].pts);
+		free(ths[n].ts);
+	}
+
+	if (gen.tr)
+		trace_close(gen.tr);
 
+	if (gen.arenas)
+		pop_mem_unsplit(gen.arenas);
 	pop_mem_exit(gen.mem);
 
 	return 0;
@@ -0,0 +1,956 @@
+/* nvpcap.c: import pcap/pcapng files to traces on nvme, and export */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <libpop.h>
+#include <libpop_ring.h>
+#include <unvme.h>
+
+#include "pkt_desc.h"
+#include "trace.h"
+
+#define MAX_THREADS	32
+#define MAX_INFLIGHT	64
+#define NSEC		1000000000ULL
+
+/* classic pcap */
+#define PCAP_MAGIC_US	0xa1b2c3d4
+#define PCAP_MAGIC_NS	0xa1b23c4d
+#define LINKTYPE_ETHERNET	1
+
+struct pcap_hdr {
+	uint32_t	magic;
+	uint16_t	major, minor;
+	int32_t		thiszone;
+	uint32_t	sigfigs;
+	uint32_t	snaplen;
+	uint32_t	linktype;
+};
+
+struct pcap_rec {
+	uint32_t	ts_sec;
+	uint32_t	ts_frac;	/* usec or nsec by the magic */
+	uint32_t	caplen;
+	uint32_t	len;
+};
+
+/* pcapng */
+#define PCAPNG_SHB	0x0a0d0d0a
+#define PCAPNG_IDB	0x00000001
+#define PCAPNG_SPB	0x00000003
+#define PCAPNG_EPB	0x00000006
+#define PCAPNG_BOM	0x1a2b3c4d
+#define PCAPNG_OPT_TSRESOL	9
+#define MAX_IFS		64
+
+struct input {
+	char		*base;	/* mmap of the file */
+	size_t		size, pos;
+
+	int		ng;	/* pcapng */
+	int		swap;	/* byte order differs from ours */
+	int		nsec;	/* pcap: nsec timestamps */
+	uint32_t	linktype;	/* of the header or the last IDB */
+
+	/* pcapng: if_tsresol of interfaces in the section */
+	int		nifs;
+	uint8_t		tsresol[MAX_IFS];
+
+	uint64_t	last_ts;
+};
+
+struct job {
+	uint64_t	seg;
+	unsigned int	npkts;
+	uint32_t	csum;
+	int		done;	/* the unit is on nvme */
+
+	/* packets split from the input, on DRAM */
+	uint64_t	*off;	/* offset in the file */
+	uint16_t	*len;
+	uint64_t	*ts;
+};
+
+struct nvpcap {
+	char		*nvme;
+	char		*name;	/* trace name */
+	char		*file;
+	int		export;
+
+	int		nthreads;
+	int		inflight;	/* async writes in flight per thread */
+	int		batch;	/* packets (packed: blocks) per unit */
+	int		stride;
+	int		packed;
+	unsigned long	lba_start, lba_end;
+
+	const unvme_ns_t	*ns;
+	pop_mem_t	*mem;
+	trace_t		*tr;
+	struct input	in;
+
+	/* jobs between the splitter and the workers */
+	struct job	*jobs;
+	unsigned int	njobs;
+	pop_ring_t	*ring;
+	int		split_done;
+	int		error;
+} nv;
+
+struct worker {
+	pthread_t	tid;
+	int		id;
+	unsigned long	nunits;
+	unsigned long	nbytes;
+} __attribute__((aligned(64)));
+
+
+static inline uint16_t in16(struct input *in, uint16_t v)
+{
+	return in->swap ? __builtin_bswap16(v) : v;
+}
+
+static inline uint32_t in32(struct input *in, uint32_t v)
+{
+	return in->swap ? __builtin_bswap32(v) : v;
+}
+
+static uint64_t tsresol_to_ns(uint64_t ts, uint8_t resol)
+{
+	/* if_tsresol: 10^-v or, with the MSB, 2^-v sec */
+	uint8_t v = resol & 0x7f;
+	uint64_t p = 1;
+
+	if (resol & 0x80)
+		return (uint64_t)(((unsigned __int128)ts * NSEC) >> v);
+
+	if (v <= 9) {
+		for (; v < 9; v++)
+			p *= 10;
+		return ts * p;
+	}
+	for (; v > 9; v--)
+		p *= 10;
+	return ts / p;
+}
+
+static int input_open(struct input *in, const char *path)
+{
+	struct stat st;
+	uint32_t magic;
+	int fd;
+
+	memset(in, 0, sizeof(*in));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size < (off_t)sizeof(struct pcap_hdr)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	in->size = st.st_size;
+	in->base = mmap(NULL, in->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (in->base == MAP_FAILED)
+		return -1;
+	madvise(in->base, in->size, MADV_SEQUENTIAL);
+
+	memcpy(&magic, in->base, sizeof(magic));
+	switch (magic) {
+	case PCAPNG_SHB:
+		in->ng = 1;	/* byte order is in the SHB */
+		return 0;
+	case PCAP_MAGIC_NS:
+		in->nsec = 1;
+		/* fallthrough */
+	case PCAP_MAGIC_US:
+		break;
+	default:
+		magic = __builtin_bswap32(magic);
+		if (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) {
+			munmap(in->base, in->size);
+			errno = EINVAL;
+			return -1;
+		}
+		in->swap = 1;
+		in->nsec = (magic == PCAP_MAGIC_NS);
+	}
+
+	/* packets are stored and exported as Ethernet frames */
+	in->linktype = in32(in, ((struct pcap_hdr *)in->base)->linktype);
+	if (in->linktype != LINKTYPE_ETHERNET) {
+		munmap(in->base, in->size);
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+
+	in->pos = sizeof(struct pcap_hdr);
+	return 0;
+}
+
+static void input_close(struct input *in)
+{
+	munmap(in->base, in->size);
+}
+
+static int input_next_pcap(struct input *in, uint64_t *off, uint32_t *caplen,
+			   uint64_t *ts)
+{
+	struct pcap_rec rec;
+
+	if (in->pos + sizeof(rec) > in->size)
+		return 0;
+
+	memcpy(&rec, in->base + in->pos, sizeof(rec));
+	*off = in->pos + sizeof(rec);
+	*caplen = in32(in, rec.caplen);
+	*ts = (uint64_t)in32(in, rec.ts_sec) * NSEC +
+		(uint64_t)in32(in, rec.ts_frac) * (in->nsec ? 1 : 1000);
+
+	if (*off + *caplen > in->size)
+		return 0;	/* truncated */
+
+	in->pos = *off + *caplen;
+	return 1;
+}
+
+static int pcapng_idb(struct input *in, char *body, uint32_t blen)
+{
+	/* linktype(2) reserved(2) snaplen(4) options */
+	uint32_t pos = 8;
+	uint16_t code, len;
+
+	in->linktype = in16(in, *(uint16_t *)body);
+	if (in->linktype != LINKTYPE_ETHERNET) {
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+
+	if (in->nifs == MAX_IFS)
+		return 0;
+
+	in->tsresol[in->nifs] = 6;	/* usec by default */
+
+	while (pos + 4 <= blen) {
+		code = in16(in, *(uint16_t *)(body + pos));
+		len = in16(in, *(uint16_t *)(body + pos + 2));
+		if (code == 0 || pos + 4 + len > blen)
+			break;
+		if (code == PCAPNG_OPT_TSRESOL && len == 1)
+			in->tsresol[in->nifs] = body[pos + 4];
+		pos += 4 + ((len + 3) & ~3);
+	}
+
+	in->nifs++;
+	return 0;
+}
+
+static int input_next_pcapng(struct input *in, uint64_t *off,
+			     uint32_t *caplen, uint64_t *ts)
+{
+	uint32_t type, blen, ifid;
+	uint64_t t;
+	char *body;
+
+	while (in->pos + 12 <= in->size) {
+		type = *(uint32_t *)(in->base + in->pos);
+		if (type == PCAPNG_SHB) {
+			/* a new section may have another byte order */
+			in->swap = (*(uint32_t *)(in->base + in->pos + 8) !=
+				    PCAPNG_BOM);
+			in->nifs = 0;
+		}
+		type = in32(in, type);
+		blen = in32(in, *(uint32_t *)(in->base + in->pos + 4));
+		if (blen < 12 || (blen & 3) || in->pos + blen > in->size)
+			return 0;	/* truncated or broken */
+
+		body = in->base + in->pos + 8;
+		blen -= 12;
+		in->pos += blen + 12;
+
+		switch (type) {
+		case PCAPNG_IDB:
+			if (pcapng_idb(in, body, blen) < 0)
+				return -1;
+			break;
+
+		case PCAPNG_EPB:
+			/* ifid ts_hi ts_lo caplen origlen data */
+			if (blen < 20)
+				break;
+			ifid = in32(in, *(uint32_t *)body);
+			t = (uint64_t)in32(in, *(uint32_t *)(body + 4)) << 32 |
+				in32(in, *(uint32_t *)(body + 8));
+			*caplen = in32(in, *(uint32_t *)(body + 12));
+			if (*caplen > blen - 20)
+				break;
+			*off = body + 20 - in->base;
+			*ts = tsresol_to_ns(t, ifid < (uint32_t)in->nifs ?
+					    in->tsresol[ifid] : 6);
+			return 1;
+
+		case PCAPNG_SPB:
+			/* origlen data, without timestamp */
+			if (blen < 4)
+				break;
+			*caplen = in32(in, *(uint32_t *)body);
+			if (*caplen > blen - 4)
+				*caplen = blen - 4;
+			*off = body + 4 - in->base;
+			*ts = in->last_ts;
+			return 1;
+
+		default:
+			break;	/* SHB, statistics, name resolution, etc. */
+		}
+	}
+
+	return 0;
+}
+
+static int input_next(struct input *in, uint64_t *off, uint32_t *caplen,
+		      uint64_t *ts)
+{
+	int ret;
+
+	do {
+		if (in->ng)
+			ret = input_next_pcapng(in, off, caplen, ts);
+		else
+			ret = input_next_pcap(in, off, caplen, ts);
+	} while (ret == 1 && *caplen == 0);
+
+	if (ret == 1)
+		in->last_ts = *ts;
+
+	return ret;
+}
+
+
+/* import */
+
+static void build_unit(struct job *job, void *unit)
+{
+	unsigned int n, k = 0;
+	char *blk = unit;
+	void *p;
+
+	if (!nv.packed) {
+		pkt_unit_init(unit, nv.stride);
+		for (n = 0; n < job->npkts; n++) {
+			p = pkt_unit_add(unit, job->len[n]);
+			memcpy(p, nv.in.base + job->off[n], job->len[n]);
+		}
+		return;
+	}
+
+	/* the splitter packed packets in the same way */
+	for (n = 0; n < nv.batch; n++)
+		pkt_blk_init(blk + PKT_BLK_SIZE * n);
+
+	for (n = 0; n < job->npkts; n++) {
+		while (!(p = pkt_blk_add(blk, job->len[n])) &&
+		       ++k < nv.batch)
+			blk += PKT_BLK_SIZE;
+		memcpy(p, nv.in.base + job->off[n], job->len[n]);
+	}
+}
+
+void *worker_body(void *arg)
+{
+	struct worker *w = arg;
+	int qid = w->id + 1;	/* queue 0 is for the trace metadata */
+	size_t usize = (size_t)nv.tr->sb.unblocks << nv.ns->blockshift;
+	pop_buf_t *bufs[MAX_INFLIGHT];
+	unvme_iod_t iod[MAX_INFLIGHT];
+	struct job *jobs[MAX_INFLIGHT];
+	unsigned int head = 0, tail = 0;	/* in flight: [tail, head) */
+	cpu_set_t cpu_set;
+	uint32_t j;
+	int n;
+
+	CPU_ZERO(&cpu_set);
+	CPU_SET(w->id, &cpu_set);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+
+	if (pop_buf_alloc_bulk(nv.mem, usize, bufs, nv.inflight) < 0) {
+		fprintf(stderr, "pop_buf_alloc_bulk() on thread %d: %s\n",
+			w->id, strerror(errno));
+		nv.error = 1;
+		return NULL;
+	}
+	for (n = 0; n < nv.inflight; n++)
+		pop_buf_put(bufs[n], usize);
+
+	while (!__atomic_load_n(&nv.error, __ATOMIC_RELAXED)) {
+		if (pop_ring_dequeue_burst(nv.ring, &j, 1) == 0) {
+			if (head != tail)
+				goto poll;	/* nothing to do but wait */
+			if (__atomic_load_n(&nv.split_done, __ATOMIC_ACQUIRE) &&
+			    pop_ring_count(nv.ring) == 0)
+				break;
+			pop_cpu_relax();
+			continue;
+		}
+
+		n = head % nv.inflight;
+		jobs[n] = &nv.jobs[j];
+		build_unit(jobs[n], pop_buf_data(bufs[n]));
+		jobs[n]->csum = trace_csum(0, pop_buf_data(bufs[n]), usize);
+		iod[n] = unvme_awrite(nv.ns, qid, pop_buf_data(bufs[n]),
+				      trace_seg_lba(nv.tr, jobs[n]->seg),
+				      nv.tr->sb.unblocks);
+		head++;
+		if (head - tail < nv.inflight)
+			continue;
+
+	poll:
+		n = tail % nv.inflight;
+		if (unvme_apoll(iod[n], UNVME_TIMEOUT) != 0) {
+			fprintf(stderr, "unvme_awrite timeout on lba 0x%lx\n",
+				trace_seg_lba(nv.tr, jobs[n]->seg));
+			nv.error = 1;
+			break;
+		}
+		__atomic_store_n(&jobs[n]->done, 1, __ATOMIC_RELEASE);
+		w->nunits++;
+		w->nbytes += usize;
+		tail++;
+	}
+
+	for (; tail != head; tail++)
+		unvme_apoll(iod[tail % nv.inflight], UNVME_TIMEOUT);
+	pop_buf_free_bulk(bufs, nv.inflight);
+
+	return NULL;
+}
+
+static int import(void)
+{
+	struct worker ws[MAX_THREADS];
+	unsigned int maxpkts, maxlen, blk = 0, boff = 0, bn = 0;
+	unsigned long ntrunc = 0, nreorder = 0;
+	uint64_t seg = 0, committed = 0, off, ts, last_ts = 0;
+	uint32_t caplen, j;
+	struct timeval start, end;
+	struct job *job = NULL;
+	double elapsed;
+	int n, ret = -1, pend = 0, eof = 0, got = 0;
+
+	if (input_open(&nv.in, nv.file) < 0) {
+		if (errno == EPROTONOSUPPORT)
+			fprintf(stderr, "%s: linktype %u is not Ethernet\n",
+				nv.file, nv.in.linktype);
+		else
+			fprintf(stderr, "failed to open %s: %s\n",
+				nv.file, strerror(errno));
+		return -1;
+	}
+
+	nv.tr = trace_create(nv.ns, nv.mem, nv.name, nv.lba_start, nv.lba_end,
+			     nv.packed ? TRACE_FMT_PACKED : TRACE_FMT_UNIT,
+			     nv.stride, nv.batch);
+	if (!nv.tr) {
+		fprintf(stderr, "trace_create(%s): %s\n",
+			nv.name, strerror(errno));
+		goto out;
+	}
+
+	maxpkts = trace_seg_max_pkts(nv.tr);
+	maxlen = nv.packed ? PKT_BLK_SIZE - PKT_BLK_IDXLEN : nv.stride;
+
+	/* jobs in flight and queued, at most */
+	nv.njobs = nv.nthreads * nv.inflight * 2;
+	nv.jobs = calloc(nv.njobs, sizeof(struct job));
+	nv.ring = pop_ring_create(nv.njobs, POP_RING_SP_ENQ);
+	if (!nv.jobs || !nv.ring) {
+		fprintf(stderr, "failed to allocate %u jobs\n", nv.njobs);
+		goto out;
+	}
+	for (j = 0; j < nv.njobs; j++) {
+		nv.jobs[j].off = malloc(sizeof(uint64_t) * maxpkts);
+		nv.jobs[j].len = malloc(sizeof(uint16_t) * maxpkts);
+		nv.jobs[j].ts = malloc(sizeof(uint64_t) * maxpkts);
+		if (!nv.jobs[j].off || !nv.jobs[j].len || !nv.jobs[j].ts) {
+			fprintf(stderr, "failed to allocate %u jobs\n",
+				nv.njobs);
+			goto out;
+		}
+	}
+
+	printf("import %s (%s) to trace %s, %lu units max\n",
+	       nv.file, nv.in.ng ? "pcapng" : "pcap", nv.name,
+	       nv.tr->sb.nsegs_max);
+
+	gettimeofday(&start, NULL);
+
+	memset(ws, 0, sizeof(ws));
+	for (n = 0; n < nv.nthreads; n++) {
+		ws[n].id = n;
+		pthread_create(&ws[n].tid, NULL, worker_body, &ws[n]);
+	}
+
+	/* walk record headers and split packets into units, which
+	 * workers fill and write in parallel. finished units are
+	 * recorded to the trace in order. */
+	while (!__atomic_load_n(&nv.error, __ATOMIC_RELAXED)) {
+		while (committed < seg) {
+			struct job *c = &nv.jobs[committed % nv.njobs];
+			if (!__atomic_load_n(&c->done, __ATOMIC_ACQUIRE))
+				break;
+			if (trace_append_seg(nv.tr, c->npkts, c->ts,
+					     c->csum) < 0) {
+				fprintf(stderr, "trace_append_seg(): %s\n",
+					strerror(errno));
+				nv.error = 1;
+				break;
+			}
+			c->done = 0;
+			committed++;
+			if (committed % 1024 == 0)
+				printf("write %lu units, %lu packets\r",
+				       committed, nv.tr->sb.npkts);
+		}
+
+		if (eof) {
+			if (committed == seg)
+				break;
+			pop_cpu_relax();
+			continue;
+		}
+		if (seg - committed == nv.njobs) {
+			pop_cpu_relax();
+			continue;
+		}
+
+		if (!job) {
+			if (seg == nv.tr->sb.nsegs_max) {
+				printf("\ntrace %s is full\n", nv.name);
+				eof = 1;
+				__atomic_store_n(&nv.split_done, 1,
+						 __ATOMIC_RELEASE);
+				continue;
+			}
+			job = &nv.jobs[seg % nv.njobs];
+			job->seg = seg;
+			job->npkts = 0;
+			blk = 0;
+			boff = PKT_BLK_IDXLEN;
+			bn = 0;
+		}
+
+		while (pend || (got = input_next(&nv.in, &off, &caplen,
+						 &ts)) == 1) {
+			if (!pend) {
+				if (caplen > maxlen) {
+					caplen = maxlen;
+					ntrunc++;
+				}
+				/* a trace is in time order */
+				if (ts < last_ts) {
+					ts = last_ts;
+					nreorder++;
+				}
+				last_ts = ts;
+			}
+			pend = 0;
+
+			if (nv.packed) {
+				/* as pkt_blk_add() does */
+				if (bn == PKT_BLK_MAX_PKTS ||
+				    boff + caplen > PKT_BLK_SIZE) {
+					blk++;
+					boff = PKT_BLK_IDXLEN;
+					bn = 0;
+				}
+				if (blk == nv.batch) {
+					pend = 1;
+					break;
+				}
+				boff += PKT_BLK_ALIGN_UP(caplen);
+				bn++;
+			}
+
+			job->off[job->npkts] = off;
+			job->len[job->npkts] = caplen;
+			job->ts[job->npkts] = ts;
+			job->npkts++;
+			if (job->npkts == maxpkts)
+				break;
+		}
+
+		if (got < 0) {
+			fprintf(stderr, "\n%s: linktype %u is not Ethernet\n",
+				nv.file, nv.in.linktype);
+			nv.error = 1;
+			break;
+		}
+		if (!pend && job->npkts < maxpkts)
+			eof = 1;
+
+		if (job->npkts) {
+			j = job - nv.jobs;
+			while (pop_ring_sp_enqueue_burst(nv.ring, &j, 1) == 0)
+				pop_cpu_relax();
+			seg++;
+		}
+		job = NULL;
+
+		/* workers exit when no job is left after this */
+		if (eof)
+			__atomic_store_n(&nv.split_done, 1, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&nv.split_done, 1, __ATOMIC_RELEASE);
+	for (n = 0; n < nv.nthreads; n++)
+		pthread_join(ws[n].tid, NULL);
+
+	gettimeofday(&end, NULL);
+
+	if (nv.error)
+		goto out;
+
+	elapsed = end.tv_sec * 1000000 + end.tv_usec;
+	elapsed -= (start.tv_sec * 1000000 + start.tv_usec);
+	elapsed /= 1000000;	/* sec */
+
+	printf("\n%lu packets in %lu units, %.2f sec, %.2f MBps\n",
+	       nv.tr->sb.npkts, nv.tr->sb.nsegs, elapsed,
+	       (double)(nv.tr->sb.nsegs * nv.tr->sb.unblocks <<
+			nv.ns->blockshift) / elapsed / 1000000);
+	for (n = 0; n < nv.nthreads; n++)
+		printf("thread %d: %lu units, %lu bytes\n",
+		       n, ws[n].nunits, ws[n].nbytes);
+	if (ntrunc)
+		printf("%lu packets truncated to %u bytes\n", ntrunc, maxlen);
+	if (nreorder)
+		printf("%lu packets out of time order\n", nreorder);
+
+	ret = 0;
+
+out:
+	if (nv.tr && trace_close(nv.tr) < 0) {
+		fprintf(stderr, "trace_close(%s): %s\n",
+			nv.name, strerror(errno));
+		ret = -1;
+	}
+	if (nv.jobs) {
+		for (j = 0; j < nv.njobs; j++) {
+			free(nv.jobs[j].off);
+			free(nv.jobs[j].len);
+			free(nv.jobs[j].ts);
+		}
+		free(nv.jobs);
+	}
+	if (nv.ring)
+		pop_ring_free(nv.ring);
+	input_close(&nv.in);
+
+	return ret;
+}
+
+
+/* export */
+
+#define TS_BATCH	65536
+
+static int load_unit(trace_t *tr, void *unit, uint32_t *off, uint16_t *len)
+{
+	struct pkt_unit_ent ents[PKT_UNIT_MAX_PKTS];
+	struct pkt_blk_ent bents[PKT_BLK_MAX_PKTS];
+	unsigned int k, i;
+	int n, ret;
+
+	if (tr->sb.format == TRACE_FMT_UNIT) {
+		ret = pkt_unit_load(unit, tr->sb.stride, ents, tr->sb.upkts);
+		for (n = 0; n < ret; n++) {
+			off[n] = PKT_UNIT_HDRLEN + tr->sb.stride * n;
+			len[n] = ents[n].len;
+		}
+		return ret;
+	}
+
+	for (k = 0, n = 0; k < tr->sb.upkts; k++) {
+		ret = pkt_blk_load((char *)unit + PKT_BLK_SIZE * k, bents);
+		if (ret < 0)
+			return -1;
+		for (i = 0; i < ret; i++, n++) {
+			off[n] = PKT_BLK_SIZE * k + bents[i].off;
+			len[n] = bents[i].len;
+		}
+	}
+
+	return n;
+}
+
+static int export(void)
+{
+	unsigned long nbad = 0, nwritten = 0;
+	uint64_t seg, issued, ts_base = 0, *ts = NULL;
+	unsigned int maxpkts, ts_n = 0;
+	struct pcap_hdr hdr;
+	struct pcap_rec rec;
+	pop_buf_t *bufs[MAX_INFLIGHT];
+	unvme_iod_t iod[MAX_INFLIGHT];
+	uint32_t *off = NULL;
+	uint16_t *len = NULL;
+	size_t usize;
+	FILE *fp = NULL;
+	trace_t *tr;
+	unsigned int i;
+	int n, ret = -1;
+	void *unit;
+
+	tr = trace_open(nv.ns, nv.mem, nv.name);
+	if (!tr) {
+		fprintf(stderr, "trace_open(%s): %s\n",
+			nv.name, strerror(errno));
+		return -1;
+	}
+
+	usize = (size_t)tr->sb.unblocks << nv.ns->blockshift;
+	maxpkts = trace_seg_max_pkts(tr);
+	off = malloc(sizeof(*off) * maxpkts);
+	len = malloc(sizeof(*len) * maxpkts);
+	ts = malloc(sizeof(*ts) * TS_BATCH);
+	if (!off || !len || !ts ||
+	    pop_buf_alloc_bulk(nv.mem, usize, bufs, nv.inflight) < 0) {
+		fprintf(stderr, "failed to allocate buffers: %s\n",
+			strerror(errno));
+		goto out;
+	}
+	for (n = 0; n < nv.inflight; n++)
+		pop_buf_put(bufs[n], usize);
+
+	fp = fopen(nv.file, "w");
+	if (!fp) {
+		fprintf(stderr, "failed to open %s: %s\n",
+			nv.file, strerror(errno));
+		goto out_free;
+	}
+	setvbuf(fp, NULL, _IOFBF, 1 << 20);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = PCAP_MAGIC_NS;
+	hdr.major = 2;
+	hdr.minor = 4;
+	hdr.snaplen = 65535;
+	hdr.linktype = LINKTYPE_ETHERNET;
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+
+	printf("export trace %s to %s, %lu packets in %lu units\n",
+	       nv.name, nv.file, tr->sb.npkts, tr->sb.nsegs);
+
+	/* keep inflight reads ahead of the unit being written out */
+	for (seg = 0, issued = 0; seg < tr->sb.nsegs; seg++) {
+		for (; issued < tr->sb.nsegs && issued < seg + nv.inflight;
+		     issued++) {
+			n = issued % nv.inflight;
+			iod[n] = unvme_aread(nv.ns, 1, pop_buf_data(bufs[n]),
+					     tr->segs[issued].lba,
+					     tr->sb.unblocks);
+		}
+
+		n = seg % nv.inflight;
+		unit = pop_buf_data(bufs[n]);
+		if (unvme_apoll(iod[n], UNVME_TIMEOUT) != 0) {
+			fprintf(stderr, "unvme_aread timeout on lba 0x%lx\n",
+				tr->segs[seg].lba);
+			goto out_close;
+		}
+		if (trace_seg_verify(tr, seg, unit) < 0 ||
+		    load_unit(tr, unit, off, len) !=
+		    (int)tr->segs[seg].npkts) {
+			nbad++;
+			continue;
+		}
+
+		for (i = 0; i < tr->segs[seg].npkts; i++) {
+			uint64_t pkt = tr->segs[seg].pkt_first + i, t;
+
+			if (pkt < ts_base || pkt >= ts_base + ts_n) {
+				ts_base = pkt;
+				ts_n = tr->sb.npkts - pkt < TS_BATCH ?
+					tr->sb.npkts - pkt : TS_BATCH;
+				if (trace_read_ts(tr, ts_base, ts, ts_n) < 0) {
+					fprintf(stderr, "trace_read_ts(): %s\n",
+						strerror(errno));
+					goto out_close;
+				}
+			}
+
+			t = ts[pkt - ts_base];
+			rec.ts_sec = t / NSEC;
+			rec.ts_frac = t % NSEC;
+			rec.caplen = len[i];
+			rec.len = len[i];
+			fwrite(&rec, sizeof(rec), 1, fp);
+			fwrite((char *)unit + off[i], len[i], 1, fp);
+			nwritten++;
+		}
+
+		if ((seg + 1) % 1024 == 0)
+			printf("read %lu units, %lu packets\r", seg, nwritten);
+	}
+
+	printf("\n%lu packets written to %s\n", nwritten, nv.file);
+	if (nbad)
+		printf("%lu units are broken, skipped\n", nbad);
+	ret = 0;
+
+out_close:
+	for (; seg + 1 < issued; seg++)
+		unvme_apoll(iod[(seg + 1) % nv.inflight], UNVME_TIMEOUT);
+	if (fclose(fp) != 0)
+		ret = -1;
+out_free:
+	pop_buf_free_bulk(bufs, nv.inflight);
+out:
+	free(off);
+	free(len);
+	free(ts);
+	trace_close(tr);
+
+	return ret;
+}
+
+void usage(void)
+{
+	printf("usage: nvpcap\n"
+	       "    -u pci               nvme slot under unvme\n"
+	       "    -t name              trace name on the nvme\n"
+	       "    -r file              import an Ethernet pcap or pcapng\n"
+	       "    -w file              export the trace to a pcap file\n"
+	       "\n"
+	       "    -n nthreads          threads to import (default 1)\n"
+	       "    -q inflight          async i/o in flight per thread\n"
+	       "    -b batch             # of packets in a unit\n"
+	       "    -z stride            bytes per packet, 256-4096\n"
+	       "    -k                   packed blocks, -b is # of blocks\n"
+	       "    -s start lba (hex)   start of the trace, after the last\n"
+	       "                         trace by default\n"
+	       "    -e end lba (hex)     end of the trace, the drive by default\n"
+		);
+}
+
+int main(int argc, char **argv)
+{
+	int ch;
+
+	memset(&nv, 0, sizeof(nv));
+	nv.nthreads = 1;
+	nv.inflight = 8;
+	nv.batch = 16;
+	nv.stride = PKT_STRIDE;
+
+	while ((ch = getopt(argc, argv, "u:t:r:w:n:q:b:z:ks:e:h")) != -1) {
+		switch (ch) {
+		case 'u':
+			nv.nvme = optarg;
+			break;
+		case 't':
+			nv.name = optarg;
+			break;
+		case 'r':
+			nv.file = optarg;
+			nv.export = 0;
+			break;
+		case 'w':
+			nv.file = optarg;
+			nv.export = 1;
+			break;
+		case 'n':
+			nv.nthreads = atoi(optarg);
+			if (nv.nthreads < 1 || nv.nthreads > MAX_THREADS) {
+				printf("invalid nthreads %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'q':
+			nv.inflight = atoi(optarg);
+			if (nv.inflight < 1 || nv.inflight > MAX_INFLIGHT) {
+				printf("invalid inflight %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'b':
+			nv.batch = atoi(optarg);
+			if (nv.batch < 1 || nv.batch > PKT_UNIT_MAX_PKTS) {
+				printf("invalid batch size %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'z':
+			nv.stride = atoi(optarg);
+			if (!pop_nm_stride_is_valid(nv.stride)) {
+				printf("invalid stride %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'k':
+			nv.packed = 1;
+			break;
+		case 's':
+			if (sscanf(optarg, "0x%lx", &nv.lba_start) < 1) {
+				printf("invalid start lba %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'e':
+			if (sscanf(optarg, "0x%lx", &nv.lba_end) < 1) {
+				printf("invalid end lba %s\n", optarg);
+				return -1;
+			}
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if (!nv.nvme || !nv.name || !nv.file) {
+		usage();
+		return -1;
+	}
+
+	nv.ns = unvme_open(nv.nvme);
+	if (!nv.ns) {
+		printf("failed to unvme_open(%s)\n", nv.nvme);
+		return -1;
+	}
+	if (nv.nthreads + 1 > nv.ns->qcount) {
+		printf("%d threads need %d queues, %d available\n",
+		       nv.nthreads, nv.nthreads + 1, nv.ns->qcount);
+		return -1;
+	}
+	if (!nv.lba_end)
+		nv.lba_end = nv.ns->blockcount;
+
+	nv.mem = pop_mem_init(NULL, 0);
+	unvme_register_pop_mem(nv.mem);
+
+	if (nv.export)
+		return export();
+	return import();
+}
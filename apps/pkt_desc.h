@@ -3,19 +3,179 @@
 #ifndef _PKT_DESC_H_
 #define _PKT_DESC_H_
 
+#include <stdint.h>
+#include <string.h>
 
-/* struct pkt_desc is placed on the end of the packet buffer on a
- * pop_buf */
-struct pkt_desc {
-	unsigned int length;
+
+/*
+ * Packets on NVMe are stored in units. A unit is what an NVMe command
+ * reads or writes, and starts with a header block that holds the
+ * lengths and flags of all packets in the unit, followed by the
+ * packets at stride-byte intervals:
+ *
+ *   | pkt_unit_hdr (PKT_UNIT_HDRLEN) | pkt 0 | pkt 1 | ... | pkt n-1 |
+ *
+ * A reader copies the header from p2pmem to DRAM by pkt_unit_load()
+ * once per unit, instead of reading a trailer of each packet across
+ * PCIe.
+ */
+
+#define PKT_STRIDE	2048	/* default stride, a netmap slot */
+
+#define PKT_UNIT_HDRLEN	4096
+#define PKT_UNIT_MAGIC	0x55544b50	/* "PKTU" */
+
+struct pkt_unit_ent {
+	uint16_t	len;
+	uint16_t	flags;	/* reserved, 0 */
 } __attribute__((__packed__));
 
+struct pkt_unit_hdr {
+	uint32_t	magic;
+	uint16_t	npkts;
+	uint16_t	stride;
+	struct pkt_unit_ent	ent[0];
+} __attribute__((__packed__));
+
+#define PKT_UNIT_MAX_PKTS						\
+	((PKT_UNIT_HDRLEN - sizeof(struct pkt_unit_hdr)) /		\
+	 sizeof(struct pkt_unit_ent))
+
+static inline size_t pkt_unit_size(unsigned int npkts, unsigned int stride)
+{
+	return PKT_UNIT_HDRLEN + (size_t)npkts * stride;
+}
+
+static inline void *pkt_unit_pkt(void *unit, unsigned int stride,
+				 unsigned int n)
+{
+	return (char *)unit + PKT_UNIT_HDRLEN + (size_t)stride * n;
+}
+
+static inline void pkt_unit_init(void *unit, unsigned int stride)
+{
+	struct pkt_unit_hdr *hdr = unit;
+
+	hdr->magic = PKT_UNIT_MAGIC;
+	hdr->npkts = 0;
+	hdr->stride = stride;
+}
+
+/* pkt_unit_add: append a len-byte packet to the header, and return
+ * the buffer for it */
+static inline void *pkt_unit_add(void *unit, unsigned int len)
+{
+	struct pkt_unit_hdr *hdr = unit;
+	struct pkt_unit_ent *ent = &hdr->ent[hdr->npkts];
+
+	ent->len = len;
+	ent->flags = 0;
+
+	return pkt_unit_pkt(unit, hdr->stride, hdr->npkts++);
+}
+
+/* pkt_unit_load: copy up to max entries of the header to ents, and
+ * return the number of packets in the unit (up to max), or -1 when
+ * the unit is not a unit of stride-byte packets. */
+static inline int pkt_unit_load(void *unit, unsigned int stride,
+				struct pkt_unit_ent *ents, unsigned int max)
+{
+	struct pkt_unit_hdr hdr;
+	unsigned int n;
+
+	/* one sequential read of the header across PCIe */
+	memcpy(&hdr, unit, sizeof(hdr));
+	if (hdr.magic != PKT_UNIT_MAGIC || hdr.stride != stride)
+		return -1;
+
+	n = hdr.npkts < max ? hdr.npkts : max;
+	memcpy(ents, (struct pkt_unit_hdr *)unit + 1, sizeof(*ents) * n);
+
+	return n;
+}
+
+
+/*
+ * Packed blocks (-k). Packets are laid back-to-back in PKT_BLK_SIZE
+ * blocks, each of which starts with an index of the packet lengths:
+ *
+ *   | pkt_blk_hdr (PKT_BLK_IDXLEN) | pkt 0 | pkt 1 | ... |  (4KB)
+ *
+ * A packet starts at a PKT_BLK_ALIGN boundary, so that the NIC reads
+ * it by whole cache lines from the middle of a block, and never spans
+ * blocks. A block holds up to 62 64-byte packets instead of two in
+ * 2048-byte strides.
+ */
+#define PKT_BLK_SIZE	4096
+#define PKT_BLK_IDXLEN	128
+#define PKT_BLK_ALIGN	64
+#define PKT_BLK_MAGIC	0x4b50	/* "PK" */
+#define PKT_BLK_MAX_PKTS	((PKT_BLK_IDXLEN - 4) / 2)
+
+#define PKT_BLK_ALIGN_UP(x)	(((x) + PKT_BLK_ALIGN - 1) & ~(PKT_BLK_ALIGN - 1))
+
+struct pkt_blk_hdr {
+	uint16_t	magic;
+	uint16_t	npkts;
+	uint16_t	len[PKT_BLK_MAX_PKTS];
+} __attribute__((__packed__));
+
+/* a packet on a block, loaded to DRAM */
+struct pkt_blk_ent {
+	uint16_t	off;	/* from the head of the block */
+	uint16_t	len;
+};
+
+static inline void pkt_blk_init(void *blk)
+{
+	struct pkt_blk_hdr *hdr = blk;
+
+	hdr->magic = PKT_BLK_MAGIC;
+	hdr->npkts = 0;
+}
+
+/* pkt_blk_add: append a len-byte packet to the block, and return the
+ * buffer for it, or NULL when the block is full */
+static inline void *pkt_blk_add(void *blk, unsigned int len)
+{
+	struct pkt_blk_hdr *hdr = blk;
+	unsigned int n, off = PKT_BLK_IDXLEN;
+
+	if (hdr->npkts == PKT_BLK_MAX_PKTS || len == 0)
+		return NULL;
+
+	for (n = 0; n < hdr->npkts; n++)
+		off += PKT_BLK_ALIGN_UP(hdr->len[n]);
+	if (off + len > PKT_BLK_SIZE)
+		return NULL;
+
+	hdr->len[hdr->npkts++] = len;
+
+	return (char *)blk + off;
+}
+
+/* pkt_blk_load: copy the index to DRAM, and store the offsets and the
+ * lengths of packets to ents. returns the number of packets, or -1
+ * when the block is not a packed block. */
+static inline int pkt_blk_load(void *blk, struct pkt_blk_ent *ents)
+{
+	struct pkt_blk_hdr hdr;
+	unsigned int n, off = PKT_BLK_IDXLEN;
 
-#define get_pkt_desc(buf, len)						\
-	((struct pkt_desc *)(buf + (len - (sizeof(struct pkt_desc)))))
+	/* one sequential read of the index across PCIe */
+	memcpy(&hdr, blk, sizeof(hdr));
+	if (hdr.magic != PKT_BLK_MAGIC || hdr.npkts > PKT_BLK_MAX_PKTS)
+		return -1;
 
-#define get_pktlen_from_desc(buf, len)		\
-	(get_pkt_desc(buf, len))->length
+	for (n = 0; n < hdr.npkts; n++) {
+		if (hdr.len[n] == 0 || off + hdr.len[n] > PKT_BLK_SIZE)
+			return -1;
+		ents[n].off = off;
+		ents[n].len = hdr.len[n];
+		off += PKT_BLK_ALIGN_UP(hdr.len[n]);
+	}
 
+	return n;
+}
 
 #endif /* _PKT_DESC_H_ */
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <net/ethernet.h>
 #include <netinet/ip.h>
@@ -13,6 +14,7 @@
 #include <unvme.h>
 
 #include "pkt_desc.h"
+#include "trace.h"
 
 
 void build_pkt(void *buf, int len, unsigned int id)
@@ -59,8 +61,6 @@ void build_pkt(void *buf, int len, unsigned int id)
 	udp->uh_dport   = htons(60000);
 	udp->uh_sport   = htons(id);
 	udp->uh_sum     = 0;
-
-	get_pktlen_from_desc(buf, 2048) = len;
 }
 
 void usage(void)
@@ -68,9 +68,16 @@ void usage(void)
 	printf("usage: store\n"
 	       "    -u pci               nvme slot under unvme\n"
 	       "    -l len               packet length\n"
-	       "    -b batch             # of batched packet in a write\n"
+	       "    -b batch             # of packets in a unit (a write)\n"
+	       "    -z stride            bytes per packet, 256-4096\n"
+	       "    -k                   packed blocks, -b is # of blocks\n"
 	       "    -s sltart lba (hex)  start logical block address\n"
-	       "    -e end lba (hex)     end logical block address\n"
+	       "    -e end lba (hex)     end logical block address, the drive\n"
+	       "                         by default\n"
+	       "    -t name              write a trace named name, in -s/-e,\n"
+	       "                         or after the last trace without -s\n"
+	       "    -g gap (nsec)        timestamp gap between packets (-t)\n"
+	       "    -L                   list traces on the nvme\n"
 		);
 }
 
@@ -79,13 +86,20 @@ int main(int argc, char **argv)
 	int ch, ret;
 	int pktlen = 64;
 	int batch = 512;
+	int stride = PKT_STRIDE;
+	int packed = 0;
 	char *nvme = NULL;
+	char *name = NULL;
+	int list = 0;
+	unsigned long gap = 1000;
 	unsigned long lba_start = 0, lba_end = 0, lba;
+	trace_t *tr = NULL;
+	uint64_t *ts;
 	const unvme_ns_t *unvme = NULL;
 	pop_mem_t *mem;
 	pop_buf_t *pbuf;
 
-	while ((ch = getopt(argc, argv, "u:l:b:s:e:")) != -1) {
+	while ((ch = getopt(argc, argv, "u:l:b:z:ks:e:t:g:L")) != -1) {
 		switch (ch) {
 		case 'u':
 			nvme = optarg;
@@ -99,11 +113,21 @@ int main(int argc, char **argv)
 			break;
 		case 'b':
 			batch = atoi(optarg);
-			if (batch < 0) {
+			if (batch < 1 || batch > PKT_UNIT_MAX_PKTS) {
 				printf("invalid batch size %s\n", optarg);
 				return -1;
 			}
 			break;
+		case 'z':
+			stride = atoi(optarg);
+			if (!pop_nm_stride_is_valid(stride)) {
+				printf("invalid stride %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'k':
+			packed = 1;
+			break;
 		case 's':
 			ret = sscanf(optarg, "0x%lx", &lba_start);
 			if (ret < 1) {
@@ -118,45 +142,131 @@ int main(int argc, char **argv)
 				return -1;
 			}				
 			break;
+		case 't':
+			name = optarg;
+			break;
+		case 'g':
+			gap = strtoul(optarg, NULL, 10);
+			break;
+		case 'L':
+			list = 1;
+			break;
 		default:
 			usage();
 			return -1;
 		}
 	}
+
+	if (!packed && pktlen > stride) {
+		printf("pkt len %d does not fit in stride %d\n",
+		       pktlen, stride);
+		return -1;
+	}
+	if (packed && pktlen > PKT_BLK_SIZE - PKT_BLK_IDXLEN) {
+		printf("pkt len %d does not fit in a block\n", pktlen);
+		return -1;
+	}
 	
 	unvme = unvme_open(nvme);
 	if (!unvme) {
 		printf("failed to unvme_open(%s)\n", nvme);
 		return -1;
 	}
+	if (!lba_end)
+		lba_end = unvme->blockcount;
 	mem = pop_mem_init(NULL, 0);
 	unvme_register_pop_mem(mem);
 
-	int b;
-	int buflen = 2048 * batch;
+	if (list)
+		return trace_list(unvme, mem);
+
+	int b, ppb;
+	int buflen;
 	int nblocks;
-	unsigned long npkts;
+	unsigned long npkts, nunits, u;
 	unsigned long num = 0;
+	void *pkt;
+
+	if (packed) {
+		buflen = PKT_BLK_SIZE * batch;
+		ppb = (PKT_BLK_SIZE - PKT_BLK_IDXLEN) /
+			PKT_BLK_ALIGN_UP(pktlen);
+		if (ppb > PKT_BLK_MAX_PKTS)
+			ppb = PKT_BLK_MAX_PKTS;
+	} else {
+		buflen = pkt_unit_size(batch, stride);
+		ppb = 0;
+	}
 
+	if (buflen & (unvme->blocksize - 1)) {
+		printf("unit %d bytes is not a multiple of %d-byte block\n",
+		       buflen, unvme->blocksize);
+		return -1;
+	}
 	nblocks = buflen >> unvme->blockshift;
-	npkts = ((lba_end - lba_start) << unvme->blockshift) >> 11;
+
+	if (name) {
+		tr = trace_create(unvme, mem, name, lba_start, lba_end,
+				  packed ? TRACE_FMT_PACKED : TRACE_FMT_UNIT,
+				  stride, batch);
+		if (!tr) {
+			printf("trace_create(%s): %s\n", name, strerror(errno));
+			return -1;
+		}
+		lba_start = tr->sb.data_lba;
+		nunits = tr->sb.nsegs_max;
+	} else
+		nunits = (lba_end - lba_start) / nblocks;
+
+	npkts = nunits * batch;
+	if (packed)
+		npkts *= ppb;
+
+	ts = malloc(sizeof(*ts) * (packed ? batch * ppb : batch));
+	if (!ts) {
+		perror("malloc");
+		return -1;
+	}
 
 	pbuf = pop_buf_alloc(mem, nblocks << unvme->blockshift);
 	pop_buf_put(pbuf, nblocks << unvme->blockshift);
 
 	printf("write packets from 0x%lx to 0x%lx, "
-	       "batch %d = %d blocks = %d pkts\n",
-	       lba_start, lba_end, batch, nblocks, buflen / 2048);
+	       "unit %d blocks = %d pkts\n",
+	       lba_start, lba_end, nblocks, packed ? batch * ppb : batch);
+
+	for (u = 0, lba = lba_start; u < nunits; u++, lba += nblocks) {
 
-	for (lba = lba_start; lba < lba_end; lba += nblocks) {
+		unsigned long first = num;
 
-		for (b = 0; b < batch; b++) {
-			void *pkt = pop_buf_data(pbuf) + 2048 * b;
-			build_pkt(pkt, pktlen, lba + b);
-			num++;
+		if (packed) {
+			for (b = 0; b < batch; b++) {
+				void *blk = pop_buf_data(pbuf) +
+					PKT_BLK_SIZE * b;
+				pkt_blk_init(blk);
+				while ((pkt = pkt_blk_add(blk, pktlen))) {
+					build_pkt(pkt, pktlen, num);
+					num++;
+				}
+			}
+		} else {
+			pkt_unit_init(pop_buf_data(pbuf), stride);
+			for (b = 0; b < batch; b++) {
+				pkt = pkt_unit_add(pop_buf_data(pbuf), pktlen);
+				build_pkt(pkt, pktlen, lba + b);
+				num++;
+			}
 		}
 
-		ret = unvme_write(unvme, 0, pop_buf_data(pbuf), lba, nblocks);
+		for (b = 0; b < num - first; b++)
+			ts[b] = (first + b) * gap;
+
+		if (tr)
+			ret = trace_append(tr, pop_buf_data(pbuf), num - first,
+					   ts);
+		else
+			ret = unvme_write(unvme, 0, pop_buf_data(pbuf), lba,
+					  nblocks);
 		if (ret != 0) {
 			printf("unvme_write failed on lba 0x%lx\n", lba);
 			perror("unvme_write");
@@ -167,6 +277,11 @@ int main(int argc, char **argv)
 	}
 	printf("\n");
 
+	if (tr && trace_close(tr) < 0) {
+		printf("trace_close(%s): %s\n", name, strerror(errno));
+		return -1;
+	}
+
 	printf("%d-length %ld packets written\n", pktlen, num);
 
 	return 0;
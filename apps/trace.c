@@ -0,0 +1,579 @@
+/* trace.c: self-describing packet traces on NVMe, see trace.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+#define TRACE_IOLEN	(256 * 1024)	/* staging buffer for metadata */
+#define TRACE_TSBUF	(TRACE_IOLEN / sizeof(uint64_t))
+
+#define nblocks_of(ns, len)	\
+	(((len) + (ns)->blocksize - 1) >> (ns)->blockshift)
+
+/* areas in a trace are aligned to 4KB, as well as segments */
+#define area_nblocks(ns, len)	\
+	nblocks_of(ns, ((len) + TRACE_HDRLEN - 1) & ~(TRACE_HDRLEN - 1))
+
+
+/* crc32c, table driven. the table is built once, before the first
+ * checksum on any thread */
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void crc_table_init(void)
+{
+	uint32_t n, k, c;
+
+	for (n = 0; n < 256; n++) {
+		c = n;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		crc_table[n] = c;
+	}
+}
+
+uint32_t trace_csum(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	pthread_once(&crc_table_once, crc_table_init);
+
+	crc = ~crc;
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+
+/* metadata I/O through the staging buffer on pop memory */
+
+static int trace_io(const unvme_ns_t *ns, pop_buf_t *pbuf, int write,
+		    uint64_t lba, size_t skip, void *dram, size_t len)
+{
+	/* read or write len bytes from skip bytes of lba. a write
+	 * pads the last block with zero */
+	size_t max, iolen, n;
+	uint32_t nblocks;
+	char *p = dram;
+	int ret;
+
+	max = (size_t)ns->maxbpio << ns->blockshift;
+	if (max > pop_buf_len(pbuf))
+		max = pop_buf_len(pbuf);
+
+	lba += skip >> ns->blockshift;
+	skip &= ns->blocksize - 1;
+
+	while (len) {
+		iolen = skip + len < max ? skip + len : max;
+		nblocks = nblocks_of(ns, iolen);
+		n = iolen - skip;
+
+		if (write) {
+			memset(pop_buf_data(pbuf), 0,
+			       (size_t)nblocks << ns->blockshift);
+			memcpy(pop_buf_data(pbuf) + skip, p, n);
+			ret = unvme_write(ns, 0, pop_buf_data(pbuf),
+					  lba, nblocks);
+		} else {
+			ret = unvme_read(ns, 0, pop_buf_data(pbuf),
+					 lba, nblocks);
+			if (ret == 0)
+				memcpy(p, pop_buf_data(pbuf) + skip, n);
+		}
+		if (ret != 0) {
+			errno = EIO;
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+		lba += nblocks;
+		skip = 0;
+	}
+
+	return 0;
+}
+
+static int label_read(const unvme_ns_t *ns, pop_buf_t *pbuf,
+		      struct trace_label *label)
+{
+	uint32_t csum;
+
+	if (trace_io(ns, pbuf, 0, 0, 0, label, sizeof(*label)) < 0)
+		return -1;
+
+	if (label->magic != TRACE_LABEL_MAGIC) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	csum = label->csum;
+	label->csum = 0;
+	if (trace_csum(0, label, sizeof(*label)) != csum) {
+		errno = EBADMSG;
+		return -1;
+	}
+	label->csum = csum;
+
+	return 0;
+}
+
+static int label_write(const unvme_ns_t *ns, pop_buf_t *pbuf,
+		       struct trace_label *label)
+{
+	label->csum = 0;
+	label->csum = trace_csum(0, label, sizeof(*label));
+	return trace_io(ns, pbuf, 1, 0, 0, label, sizeof(*label));
+}
+
+static struct trace_dirent *label_find(struct trace_label *label,
+				       const char *name)
+{
+	uint32_t n;
+
+	for (n = 0; n < label->ntraces; n++) {
+		if (strncmp(label->ent[n].name, name, TRACE_NAMELEN) == 0)
+			return &label->ent[n];
+	}
+
+	return NULL;
+}
+
+static trace_t *trace_alloc(const unvme_ns_t *ns, pop_mem_t *mem)
+{
+	trace_t *tr;
+
+	tr = calloc(1, sizeof(*tr));
+	if (!tr)
+		return NULL;
+
+	tr->ns = ns;
+	tr->pbuf = pop_buf_alloc(mem, TRACE_IOLEN);
+	if (!tr->pbuf) {
+		free(tr);
+		return NULL;
+	}
+	pop_buf_put(tr->pbuf, TRACE_IOLEN);
+
+	return tr;
+}
+
+static void trace_free(trace_t *tr)
+{
+	pop_buf_free(tr->pbuf);
+	free(tr->segs);
+	free(tr->ts);
+	free(tr);
+}
+
+
+/* writer */
+
+trace_t *trace_create(const unvme_ns_t *ns, pop_mem_t *mem,
+		      const char *name,
+		      unsigned long lba_start, unsigned long lba_end,
+		      int format, int stride, int upkts)
+{
+	struct trace_label label;
+	struct trace_dirent *ent;
+	struct trace_sb *sb;
+	uint64_t nblocks, hdr_nblocks, nsegs, n;
+	size_t usize, maxpkts;
+	trace_t *tr;
+
+	if (strlen(name) == 0 || strlen(name) >= TRACE_NAMELEN ||
+	    upkts < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (format == TRACE_FMT_PACKED) {
+		usize = (size_t)upkts * PKT_BLK_SIZE;
+		maxpkts = upkts * PKT_BLK_MAX_PKTS;
+	} else {
+		usize = pkt_unit_size(upkts, stride);
+		maxpkts = upkts;
+	}
+	if (usize & (ns->blocksize - 1)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	tr = trace_alloc(ns, mem);
+	if (!tr)
+		return NULL;
+
+	hdr_nblocks = nblocks_of(ns, TRACE_HDRLEN);
+
+	/* a fresh drive without a label */
+	if (label_read(ns, tr->pbuf, &label) < 0) {
+		if (errno != ENOENT)
+			goto err_out;
+		memset(&label, 0, sizeof(label));
+		label.magic = TRACE_LABEL_MAGIC;
+		label.version = TRACE_VERSION;
+		label.lba_next = hdr_nblocks;
+	}
+
+	ent = label_find(&label, name);
+	if (lba_start == 0) {
+		lba_start = ent ? ent->lba : label.lba_next;
+		if (lba_start >= lba_end) {
+			errno = ENOSPC;
+			goto err_out;
+		}
+	}
+	if (lba_start < hdr_nblocks || lba_end <= lba_start ||
+	    lba_end > ns->blockcount) {
+		errno = EINVAL;
+		goto err_out;
+	}
+
+	/* a trace must not overlap with others */
+	for (n = 0; n < label.ntraces; n++) {
+		struct trace_dirent *e = &label.ent[n];
+		if (e == ent)
+			continue;
+		if (lba_start < e->lba + e->nblocks && e->lba < lba_end) {
+			errno = EEXIST;
+			goto err_out;
+		}
+	}
+	if (!ent && label.ntraces == TRACE_MAX) {
+		errno = ENOSPC;
+		goto err_out;
+	}
+
+	/* fit the superblock, the index, the timestamps and the
+	 * segments into the extent */
+	nblocks = lba_end - lba_start;
+	nsegs = ((nblocks - hdr_nblocks) << ns->blockshift) /
+		(usize + sizeof(struct trace_seg) + maxpkts * sizeof(uint64_t));
+	while (nsegs > 0 &&
+	       hdr_nblocks +
+	       area_nblocks(ns, nsegs * sizeof(struct trace_seg)) +
+	       area_nblocks(ns, nsegs * maxpkts * sizeof(uint64_t)) +
+	       nsegs * (usize >> ns->blockshift) > nblocks)
+		nsegs--;
+	if (nsegs == 0) {
+		errno = ENOSPC;
+		goto err_out;
+	}
+
+	tr->ts = malloc(TRACE_TSBUF * sizeof(uint64_t));
+	if (!tr->ts)
+		goto err_out;
+
+	tr->writable = 1;
+	tr->lba = lba_start;
+	tr->nblocks = nblocks;
+	tr->label = label;
+
+	sb = &tr->sb;
+	sb->magic = TRACE_SB_MAGIC;
+	sb->version = TRACE_VERSION;
+	strncpy(sb->name, name, TRACE_NAMELEN - 1);
+	sb->format = format;
+	sb->stride = format == TRACE_FMT_PACKED ? PKT_BLK_SIZE : stride;
+	sb->upkts = upkts;
+	sb->unblocks = usize >> ns->blockshift;
+	sb->nsegs_max = nsegs;
+	sb->idx_lba = lba_start + hdr_nblocks;
+	sb->idx_nblocks = area_nblocks(ns, nsegs * sizeof(struct trace_seg));
+	sb->ts_lba = sb->idx_lba + sb->idx_nblocks;
+	sb->ts_nblocks = area_nblocks(ns, nsegs * maxpkts * sizeof(uint64_t));
+	sb->data_lba = sb->ts_lba + sb->ts_nblocks;
+
+	return tr;
+
+err_out:
+	trace_free(tr);
+	return NULL;
+}
+
+static int trace_flush_ts(trace_t *tr)
+{
+	/* timestamps are flushed every TRACE_TSBUF packets, so that a
+	 * flush starts at a block boundary */
+	uint64_t off = (tr->sb.npkts - tr->nts) * sizeof(uint64_t);
+
+	if (tr->nts == 0)
+		return 0;
+
+	if (trace_io(tr->ns, tr->pbuf, 1, tr->sb.ts_lba, off,
+		     tr->ts, tr->nts * sizeof(uint64_t)) < 0)
+		return -1;
+
+	tr->nts = 0;
+	return 0;
+}
+
+int trace_append_seg(trace_t *tr, unsigned int npkts, const uint64_t *ts,
+		     uint32_t csum)
+{
+	struct trace_sb *sb = &tr->sb;
+	struct trace_seg *seg;
+	unsigned int n;
+
+	if (!tr->writable || npkts > trace_seg_max_pkts(tr) ||
+	    (npkts && sb->npkts && ts[0] < sb->ts_last)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (sb->nsegs == sb->nsegs_max) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	/* the index grows on DRAM until trace_close() */
+	if (sb->nsegs == tr->nsegs_alloced) {
+		uint64_t nr = tr->nsegs_alloced ? tr->nsegs_alloced * 2 : 1024;
+		seg = realloc(tr->segs, nr * sizeof(*seg));
+		if (!seg)
+			return -1;
+		tr->segs = seg;
+		tr->nsegs_alloced = nr;
+	}
+
+	seg = &tr->segs[sb->nsegs];
+	seg->lba = trace_seg_lba(tr, sb->nsegs);
+	seg->pkt_first = sb->npkts;
+	seg->npkts = npkts;
+	seg->ts_first = npkts ? ts[0] : sb->ts_last;
+	seg->ts_last = npkts ? ts[npkts - 1] : sb->ts_last;
+	seg->csum = csum;
+
+	for (n = 0; n < npkts; n++) {
+		tr->ts[tr->nts++] = ts[n];
+		sb->npkts++;
+		if (tr->nts == TRACE_TSBUF && trace_flush_ts(tr) < 0)
+			return -1;
+	}
+
+	if (npkts && seg->pkt_first == 0)
+		sb->ts_first = seg->ts_first;
+	sb->ts_last = seg->ts_last;
+	sb->nsegs++;
+
+	return 0;
+}
+
+int trace_append(trace_t *tr, void *unit, unsigned int npkts,
+		 const uint64_t *ts)
+{
+	struct trace_sb *sb = &tr->sb;
+	uint32_t csum;
+
+	if (!tr->writable) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (sb->nsegs == sb->nsegs_max) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	csum = trace_csum(0, unit, (size_t)sb->unblocks << tr->ns->blockshift);
+
+	if (unvme_write(tr->ns, 0, unit, trace_seg_lba(tr, sb->nsegs),
+			sb->unblocks) != 0) {
+		errno = EIO;
+		return -1;
+	}
+
+	return trace_append_seg(tr, npkts, ts, csum);
+}
+
+static int trace_commit(trace_t *tr)
+{
+	struct trace_label *label = &tr->label;
+	struct trace_sb *sb = &tr->sb;
+	struct trace_dirent *ent;
+	size_t idxlen = sb->nsegs * sizeof(struct trace_seg);
+	uint32_t n;
+
+	if (trace_flush_ts(tr) < 0)
+		return -1;
+
+	if (idxlen &&
+	    trace_io(tr->ns, tr->pbuf, 1, sb->idx_lba, 0, tr->segs, idxlen) < 0)
+		return -1;
+
+	sb->idx_csum = trace_csum(0, tr->segs, idxlen);
+	sb->csum = 0;
+	sb->csum = trace_csum(0, sb, sizeof(*sb));
+	if (trace_io(tr->ns, tr->pbuf, 1, tr->lba, 0, sb, sizeof(*sb)) < 0)
+		return -1;
+
+	/* the trace becomes visible after the superblock is written */
+	ent = label_find(label, sb->name);
+	if (!ent)
+		ent = &label->ent[label->ntraces++];
+	memset(ent, 0, sizeof(*ent));
+	strncpy(ent->name, sb->name, TRACE_NAMELEN - 1);
+	ent->lba = tr->lba;
+
+	/* only the extent used, so that the next trace follows it */
+	tr->nblocks = trace_seg_lba(tr, sb->nsegs) - tr->lba;
+	ent->nblocks = tr->nblocks;
+	label->lba_next = nblocks_of(tr->ns, TRACE_HDRLEN);
+	for (n = 0; n < label->ntraces; n++) {
+		ent = &label->ent[n];
+		if (label->lba_next < ent->lba + ent->nblocks)
+			label->lba_next = ent->lba + ent->nblocks;
+	}
+
+	return label_write(tr->ns, tr->pbuf, label);
+}
+
+int trace_close(trace_t *tr)
+{
+	int ret = 0;
+
+	if (tr->writable)
+		ret = trace_commit(tr);
+
+	trace_free(tr);
+	return ret;
+}
+
+
+/* reader */
+
+trace_t *trace_open(const unvme_ns_t *ns, pop_mem_t *mem, const char *name)
+{
+	struct trace_dirent *ent;
+	struct trace_sb *sb;
+	size_t idxlen;
+	uint32_t csum;
+	trace_t *tr;
+
+	tr = trace_alloc(ns, mem);
+	if (!tr)
+		return NULL;
+
+	if (label_read(ns, tr->pbuf, &tr->label) < 0)
+		goto err_out;
+
+	ent = label_find(&tr->label, name);
+	if (!ent) {
+		errno = ENOENT;
+		goto err_out;
+	}
+	tr->lba = ent->lba;
+	tr->nblocks = ent->nblocks;
+
+	sb = &tr->sb;
+	if (trace_io(ns, tr->pbuf, 0, tr->lba, 0, sb, sizeof(*sb)) < 0)
+		goto err_out;
+
+	csum = sb->csum;
+	sb->csum = 0;
+	if (sb->magic != TRACE_SB_MAGIC || sb->version != TRACE_VERSION ||
+	    trace_csum(0, sb, sizeof(*sb)) != csum || sb->unblocks == 0) {
+		errno = EBADMSG;
+		goto err_out;
+	}
+	sb->csum = csum;
+
+	idxlen = sb->nsegs * sizeof(struct trace_seg);
+	tr->segs = malloc(idxlen ? idxlen : 1);
+	if (!tr->segs)
+		goto err_out;
+	tr->nsegs_alloced = sb->nsegs;
+
+	if (trace_io(ns, tr->pbuf, 0, sb->idx_lba, 0, tr->segs, idxlen) < 0)
+		goto err_out;
+	if (trace_csum(0, tr->segs, idxlen) != sb->idx_csum) {
+		errno = EBADMSG;
+		goto err_out;
+	}
+
+	return tr;
+
+err_out:
+	trace_free(tr);
+	return NULL;
+}
+
+uint64_t trace_seek(trace_t *tr, uint64_t ts)
+{
+	uint64_t lo = 0, hi = tr->sb.nsegs, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (tr->segs[mid].ts_last < ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+int trace_read_ts(trace_t *tr, uint64_t pkt, uint64_t *ts, unsigned int n)
+{
+	if (pkt + n > tr->sb.npkts) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return trace_io(tr->ns, tr->pbuf, 0, tr->sb.ts_lba,
+			pkt * sizeof(uint64_t), ts, n * sizeof(uint64_t));
+}
+
+int trace_seg_verify(trace_t *tr, uint64_t seg, void *unit)
+{
+	size_t len = (size_t)tr->sb.unblocks << tr->ns->blockshift;
+
+	if (seg >= tr->sb.nsegs ||
+	    trace_csum(0, unit, len) != tr->segs[seg].csum) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	return 0;
+}
+
+int trace_list(const unvme_ns_t *ns, pop_mem_t *mem)
+{
+	struct trace_dirent *ent;
+	uint32_t n;
+	trace_t *tr;
+
+	tr = trace_alloc(ns, mem);
+	if (!tr)
+		return -1;
+
+	if (label_read(ns, tr->pbuf, &tr->label) < 0) {
+		trace_free(tr);
+		return -1;
+	}
+
+	printf("%-32s %-12s %-12s %-12s %s\n",
+	       "name", "lba", "nblocks", "npkts", "duration (sec)");
+
+	for (n = 0; n < tr->label.ntraces; n++) {
+		ent = &tr->label.ent[n];
+		if (trace_io(ns, tr->pbuf, 0, ent->lba, 0,
+			     &tr->sb, sizeof(tr->sb)) < 0 ||
+		    tr->sb.magic != TRACE_SB_MAGIC) {
+			printf("%-32.32s 0x%-10lx 0x%-10lx (broken)\n",
+			       ent->name, ent->lba, ent->nblocks);
+			continue;
+		}
+		printf("%-32.32s 0x%-10lx 0x%-10lx %-12lu %.6f\n",
+		       ent->name, ent->lba, ent->nblocks, tr->sb.npkts,
+		       (double)(tr->sb.ts_last - tr->sb.ts_first) / 1e9);
+	}
+
+	trace_free(tr);
+	return 0;
+}
@@ -0,0 +1,164 @@
+/* trace.h: self-describing packet traces on NVMe */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#include <libpop.h>
+#include <unvme.h>
+
+#include "pkt_desc.h"
+
+/*
+ * A drive holds a label at LBA 0 that lists named traces. A trace
+ * occupies an extent of the drive:
+ *
+ *   | superblock | segment index | timestamps | segment 0 | 1 | ... |
+ *
+ * A segment is a unit of pkt_desc.h (strided or packed blocks), i.e.,
+ * what an NVMe command reads. The index holds, for each segment, its
+ * LBA, the number and the timestamps of its first and last packets,
+ * and a checksum of the segment. The timestamps area holds a
+ * nanosecond timestamp for each packet, in the order of packets.
+ *
+ * The superblock and the index are loaded to DRAM by trace_open(),
+ * so that trace_seek() finds a time window by binary search on the
+ * index without reading the drive.
+ */
+
+#define TRACE_LABEL_MAGIC	0x4c425254	/* "TRBL" */
+#define TRACE_SB_MAGIC		0x42535254	/* "TRSB" */
+#define TRACE_VERSION		1
+
+#define TRACE_HDRLEN	4096	/* label and superblock */
+#define TRACE_NAMELEN	32
+#define TRACE_MAX	64	/* traces on a drive */
+
+#define TRACE_FMT_UNIT		0	/* strided unit, pkt_unit_hdr */
+#define TRACE_FMT_PACKED	1	/* packed blocks, pkt_blk_hdr */
+
+struct trace_dirent {
+	char		name[TRACE_NAMELEN];
+	uint64_t	lba;		/* start of the extent */
+	uint64_t	nblocks;	/* length of the extent */
+} __attribute__((__packed__));
+
+struct trace_label {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	ntraces;
+	uint32_t	csum;
+	uint64_t	lba_next;	/* free space starts here */
+	struct trace_dirent	ent[TRACE_MAX];
+} __attribute__((__packed__));
+
+struct trace_sb {
+	uint32_t	magic;
+	uint32_t	version;
+	char		name[TRACE_NAMELEN];
+
+	/* format of segments */
+	uint32_t	format;		/* TRACE_FMT_* */
+	uint32_t	stride;		/* TRACE_FMT_UNIT only */
+	uint32_t	upkts;		/* packets (packed: blocks) per unit */
+	uint32_t	unblocks;	/* blocks per segment */
+
+	uint64_t	npkts;
+	uint64_t	nsegs;
+	uint64_t	ts_first, ts_last;	/* nsec */
+
+	/* LBAs of the areas. *_nblocks are allocated sizes */
+	uint64_t	idx_lba, idx_nblocks;
+	uint64_t	ts_lba, ts_nblocks;
+	uint64_t	data_lba;
+	uint64_t	nsegs_max;
+
+	uint32_t	idx_csum;	/* of nsegs entries of the index */
+	uint32_t	csum;		/* of the superblock, with csum 0 */
+} __attribute__((__packed__));
+
+struct trace_seg {
+	uint64_t	lba;
+	uint64_t	pkt_first;	/* # of packets before this segment */
+	uint64_t	ts_first, ts_last;
+	uint32_t	npkts;
+	uint32_t	csum;		/* of unblocks of the segment */
+} __attribute__((__packed__));
+
+typedef struct trace {
+	const unvme_ns_t	*ns;
+	pop_buf_t	*pbuf;	/* staging buffer for metadata I/O */
+	int		writable;
+
+	uint64_t		lba, nblocks;	/* the extent */
+	struct trace_label	label;
+	struct trace_sb		sb;
+	struct trace_seg	*segs;	/* index on DRAM */
+	uint64_t		nsegs_alloced;
+
+	uint64_t		*ts;	/* timestamps to be written */
+	unsigned int		nts;
+} trace_t;
+
+/* trace_create: create a trace named name in [lba_start, lba_end). If
+ * lba_start is 0, the trace starts at the end of the last trace on the
+ * drive. A trace of the same name is replaced. trace_close() shrinks
+ * the extent to the segments written, so that lba_end may be the end
+ * of the drive. */
+trace_t *trace_create(const unvme_ns_t *ns, pop_mem_t *mem,
+		      const char *name,
+		      unsigned long lba_start, unsigned long lba_end,
+		      int format, int stride, int upkts);
+
+/* trace_append: write a unit of npkts packets as the next segment. ts
+ * is timestamps of the packets in nsec. returns 0, or -1 with errno
+ * ENOSPC when the trace is full */
+int trace_append(trace_t *tr, void *unit, unsigned int npkts,
+		 const uint64_t *ts);
+
+/* trace_append_seg: record the next segment, whose unit of npkts
+ * packets is written at trace_seg_lba(tr, tr->sb.nsegs) by the caller.
+ * csum is trace_csum() of the unit. Writers that issue units in
+ * parallel record them in order by this. */
+int trace_append_seg(trace_t *tr, unsigned int npkts, const uint64_t *ts,
+		     uint32_t csum);
+
+static inline uint64_t trace_seg_lba(trace_t *tr, uint64_t seg)
+{
+	return tr->sb.data_lba + seg * tr->sb.unblocks;
+}
+
+/* trace_seg_max_pkts: max # of packets in a segment */
+static inline unsigned int trace_seg_max_pkts(trace_t *tr)
+{
+	if (tr->sb.format == TRACE_FMT_PACKED)
+		return tr->sb.upkts * PKT_BLK_MAX_PKTS;
+	return tr->sb.upkts;
+}
+
+/* trace_open: open a trace named name, verify its superblock and
+ * index, and load them to DRAM */
+trace_t *trace_open(const unvme_ns_t *ns, pop_mem_t *mem, const char *name);
+
+/* trace_close: write the timestamps, the index, the superblock and the
+ * label when the trace is created by trace_create, and free tr */
+int trace_close(trace_t *tr);
+
+/* trace_seek: return the first segment whose last packet is sent at
+ * or after ts, or nsegs when no such segment exists */
+uint64_t trace_seek(trace_t *tr, uint64_t ts);
+
+/* trace_read_ts: read timestamps of n packets from pkt to ts */
+int trace_read_ts(trace_t *tr, uint64_t pkt, uint64_t *ts, unsigned int n);
+
+/* trace_seg_verify: returns 0 when unit matches the checksum of
+ * segment seg, or -1 with errno EBADMSG */
+int trace_seg_verify(trace_t *tr, uint64_t seg, void *unit);
+
+/* trace_list: print traces on the drive */
+int trace_list(const unvme_ns_t *ns, pop_mem_t *mem);
+
+uint32_t trace_csum(uint32_t crc, const void *buf, size_t len);
+
+#endif /* _TRACE_H_ */
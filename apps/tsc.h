@@ -0,0 +1,42 @@
+/* tsc.h: TSC clock for scheduling packet departures */
+
+#ifndef _TSC_H_
+#define _TSC_H_
+
+#include <stdint.h>
+#include <time.h>
+
+static inline uint64_t tsc_read(void)
+{
+	return __builtin_ia32_rdtsc();
+}
+
+/* tsc_calibrate: TSC cycles per nsec, measured against the monotonic
+ * clock for msec. This assumes an invariant TSC. */
+static inline double tsc_calibrate(unsigned int msec)
+{
+	struct timespec b, a, d = { msec / 1000, (msec % 1000) * 1000000 };
+	uint64_t tb, ta;
+	double ns;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &b);
+	tb = tsc_read();
+	nanosleep(&d, NULL);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &a);
+	ta = tsc_read();
+
+	ns = (a.tv_sec - b.tv_sec) * 1e9 + (a.tv_nsec - b.tv_nsec);
+	return (ta - tb) / ns;
+}
+
+/* log2 histogram of nsec */
+#define TSC_HIST_NBUCKETS	32
+
+static inline void tsc_hist_add(unsigned long *hist, uint64_t ns)
+{
+	int n = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	hist[n < TSC_HIST_NBUCKETS ? n : TSC_HIST_NBUCKETS - 1]++;
+}
+
+#endif /* _TSC_H_ */
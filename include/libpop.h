@@ -45,7 +45,14 @@ void libpop_verbose_disable(void);
 
 /* structure describing pop p2pmem context */
 #define POP_PCI_DEVNAME_MAX	16
+struct pop_buddy;
+struct pop_mem_ops;
+struct pop_mem_shared;
+#define POP_MEM_NAME_MAX	32
+#define POP_MEM_PATH_MAX	128
 typedef struct pop_mem {
+	const struct pop_mem_ops *ops;	/* backend of this mem	*/
+
 	int	fd;			/* fd for ioctl and mmap	*/
 	char	devname[POP_PCI_DEVNAME_MAX];	/* '\0' means hugepage	*/
 	struct pop_p2pmem_reg reg;	/* reg for ioctl		*/
@@ -53,11 +60,34 @@ typedef struct pop_mem {
 	void		*mem;		/* mmaped region		*/
 	uintptr_t	paddr;		/* physical addr of mem		*/
 
+	/* physical address of each physically contiguous page of the
+	 * region (e.g., hugepage) for pop_virt_to_phys() */
+	uintptr_t	*paddrs;	/* paddr table			*/
+	unsigned int	page_shift;	/* shift of a contiguous page	*/
+	uintptr_t	page_mask;	/* (1 << page_shift) - 1	*/
+
 	size_t	size;			/* size of allocated region	*/
+	size_t	pagesize;		/* size of mmaped pages		*/
 	size_t	num_pages;		/* # of pages this mem has	*/
 	size_t	alloced_pages;       	/* # of allocated pages	from this */
 
+	/* a region can be committed from its head on demand */
+	size_t	committed;		/* mapped and locked bytes	*/
+	size_t	grow_chunk;		/* bytes committed at a time	*/
+	unsigned int watermark;		/* % of committed to grow at	*/
+
+	unsigned int prefault_threads;	/* threads faulting pages in	*/
+	int	numa_node;		/* node of the memory, or -1	*/
+
+	struct pop_buddy *buddy;	/* page allocator for this mem	*/
 	pthread_mutex_t	mutex;		/* mutex for alloc/free pop buf	*/
+	pthread_mutex_t	*lock;		/* &mutex, or the shared one	*/
+
+	/* a named region shared by processes */
+	char	name[POP_MEM_NAME_MAX];	/* '\0' means private		*/
+	char	path[POP_MEM_PATH_MAX];	/* file mapped, if any		*/
+	struct pop_mem_shared *shared;	/* metadata, or NULL		*/
+	size_t	shared_size;		/* size of the metadata		*/
 } pop_mem_t;
 
 
@@ -69,17 +99,120 @@ typedef struct pop_mem {
  * returned, and errno is set appropriately.
  *
  * dev:  string for PCI slot num, or NULL means hugepages.
+ *       "hugepage" is equal to NULL. "hugepage:2M" and "hugepage:1G"
+ *       specify the hugepage size. Otherwise, 1GB hugepages are used
+ *       if size >= 1GB and enough 1GB hugepages are free.
+ *       "hugetlbfs" or "hugetlbfs:DIR" maps a file on hugetlbfs
+ *       (default /mnt/hugepages). "memfd" and "anon" map 4KB pages
+ *       without hugepages nor p2pmem, for development and tests.
  * size: size of allocated memory in byte, 0 means all
+ *       (a quarter of reserved hugepages for hugepage and hugetlbfs,
+ *       and 64MB for memfd and anon)
  */
 pop_mem_t *pop_mem_init(char *dev, size_t size);
 int pop_mem_exit(pop_mem_t *mem);
 
+/*
+ * pop_mem_init_attr()
+ *
+ * pop_mem_init() with attributes. When attr->initial is not 0,
+ * pop_mem_init_attr() reserves address space for size bytes (0 means
+ * all reserved hugepages for hugepage and hugetlbfs), and maps and
+ * locks only the first attr->initial bytes. Then, pop_buf_alloc()
+ * commits attr->grow_chunk bytes more when allocated pages exceed
+ * attr->watermark % of the committed region, or when no pages are
+ * available. p2pmem is always committed at once.
+ *
+ * Note that drivers registering the whole region to IOMMU (e.g.,
+ * unvme_register_pop_mem()) see only the committed region.
+ *
+ * When attr->prefault_threads is more than 1, pages are faulted in
+ * and locked by the threads in parallel, instead of MAP_LOCKED or
+ * MAP_POPULATE on the calling thread. The threads run on the NUMA
+ * node of the memory (the node of the caller for hugepages).
+ *
+ * attr->numa_node places pages on POP_MEM_NUMA_NODE(node) (preferred,
+ * not bound). POP_MEM_NUMA_ANY, the value of a zeroed attr, leaves
+ * placement to the faulting thread. POP_MEM_NUMA_AUTO takes the node
+ * of attr->numa_dev, a PCI slot or an interface name of the device
+ * doing DMA on the memory. p2pmem is always on the node of its device.
+ *
+ * attr->shared_name makes a named region that other processes attach
+ * to by pop_mem_attach(). Its allocator metadata is placed on
+ * /dev/shm/libpop-NAME.meta, and all processes map the region at the same
+ * vaddr. Only "hugetlbfs[:dir]" and p2pmem can be shared, and a shared
+ * region is committed at once. If NAME already exists,
+ * pop_mem_init_attr() attaches to it (warm restart). A hugetlbfs file
+ * of NAME left without its metadata, e.g., by a crashed creator, fails
+ * pop_mem_init_attr() with EEXIST until it is removed.
+ *
+ * Initialize attr by pop_mem_attr_init() before setting fields.
+ */
+#define POP_MEM_NUMA_ANY	0	/* wherever the caller faults	*/
+#define POP_MEM_NUMA_AUTO	-1	/* node of attr->numa_dev	*/
+#define POP_MEM_NUMA_NODE(n)	((n) + 1)	/* node n		*/
+
+typedef struct pop_mem_attr {
+	size_t		initial;	/* bytes committed at init, 0 means all	*/
+	size_t		grow_chunk;	/* bytes per growth, 0 means initial	*/
+	unsigned int	watermark;	/* %, 0 means growing only on shortage	*/
+	unsigned int	prefault_threads; /* 0 or 1 means the caller	*/
+
+	int		numa_node;	/* POP_MEM_NUMA_NODE/ANY/AUTO	*/
+	const char	*numa_dev;	/* device for POP_MEM_NUMA_AUTO		*/
+
+	const char	*shared_name;	/* name of a shared region, or NULL	*/
+} pop_mem_attr_t;
+
+void pop_mem_attr_init(pop_mem_attr_t *attr);
+pop_mem_t *pop_mem_init_attr(char *dev, size_t size, pop_mem_attr_t *attr);
+
+/* pop_mem_attach: attach to a shared region. pop_mem_exit() detaches
+ * from it, and pop_mem_unlink() releases the region and its name */
+pop_mem_t *pop_mem_attach(const char *name);
+int pop_mem_unlink(const char *name);
+
+/* pop_mem_grow: commit len bytes more. 0 on success, -1 on error */
+int pop_mem_grow(pop_mem_t *mem, size_t len);
+
 size_t pop_mem_size(pop_mem_t *mem);
+size_t pop_mem_committed(pop_mem_t *mem);
+int pop_mem_numa_node(pop_mem_t *mem);		/* -1 means unknown */
+
+/* pop_numa_node: NUMA node of a PCI slot or a (netmap) interface
+ * from sysfs, or -1. pop_numa_current_node: node of this thread */
+int pop_numa_node(const char *dev);
+int pop_numa_current_node(void);
+
+
+/*
+ * pop_mem_pool: a pop_mem per NUMA node, so that threads allocate
+ * pop_bufs local to their cores. pop_mem_pool_create() initializes
+ * size bytes of pop_mem on each online node with attr (numa_node is
+ * overwritten). A pool on p2pmem has only the mem of the device.
+ */
+#define POP_MEM_MAX_NODES	64
+
+typedef struct pop_mem_pool {
+	int		nr_mems;
+	pop_mem_t	*mems[POP_MEM_MAX_NODES];	/* created mems	*/
+	pop_mem_t	*node_mem[POP_MEM_MAX_NODES];	/* mem for node	*/
+} pop_mem_pool_t;
+
+pop_mem_pool_t *pop_mem_pool_create(char *dev, size_t size,
+				    pop_mem_attr_t *attr);
+void pop_mem_pool_destroy(pop_mem_pool_t *pool);
+
+/* pop_mem_pool_get: mem on node. -1 means the node of this thread */
+pop_mem_t *pop_mem_pool_get(pop_mem_pool_t *pool, int node);
+size_t pop_mem_page_size(pop_mem_t *mem);	/* 2MB, 1GB, or 4KB */
 
 
 /* structure describing pop buffer on p2pmem */
+struct pop_pktpool;
 typedef struct pop_buf {
 	pop_mem_t	*mem;	/* parent pop context  */
+	struct pop_pktpool *pool;	/* pool, or NULL from pop_buf_alloc */
 
 	void		*vaddr;	/* virtual address on mmap region	*/
 	uintptr_t	paddr;	/* physical addres of the vaddr		*/
@@ -87,22 +220,205 @@ typedef struct pop_buf {
 
 	size_t		offset;	/* offset of data	*/
 	size_t		length;	/* length of data	*/
+
+	struct pop_buf	*next;	/* next segment in a chain */
+	struct pop_buf	*head;	/* pop_buf owning the data, for a clone */
+	unsigned int	refcnt;	/* # of references to this pop_buf */
 } pop_buf_t;
 
 /* operating pop_buf like sk_buff */
 pop_buf_t *pop_buf_alloc(pop_mem_t *mem, size_t size);
+
+/* pop_buf_free: drop a reference to pbuf. pbuf is released when the
+ * last reference is dropped, and its data is released when pbuf and
+ * all its clones are released. */
 void pop_buf_free(pop_buf_t *pbuf);
 
-void *pop_buf_data(pop_buf_t *pbuf);
-size_t pop_buf_len(pop_buf_t *pbuf);
-uintptr_t pop_buf_paddr(pop_buf_t *pbuf);
-uintptr_t pop_virt_to_phys(pop_mem_t *mem, void *vaddr);
+/* pop_buf_alloc_bulk: allocate n pop_bufs of size bytes under a
+ * single lock of mem. All or nothing; -1 is returned and errno is set
+ * when any of them cannot be allocated. */
+int pop_buf_alloc_bulk(pop_mem_t *mem, size_t size, pop_buf_t **bufs,
+		       unsigned int n);
+
+/* pop_buf_free_bulk: pop_buf_free() n pop_bufs, taking the lock of
+ * the mem once per 64 pop_bufs. */
+void pop_buf_free_bulk(pop_buf_t **bufs, unsigned int n);
+
+/* pop_buf_get: take a reference to pbuf, e.g., for each netmap ring
+ * that transmits it, and return pbuf. */
+pop_buf_t *pop_buf_get(pop_buf_t *pbuf);
+
+/* pop_buf_clone: return a new pop_buf sharing the data of pbuf. The
+ * clone has its own offset and length, which start from those of
+ * pbuf, and holds a reference to the data until it is freed. */
+pop_buf_t *pop_buf_clone(pop_buf_t *pbuf);
+
+/*
+ * pop_buf chain: pop_bufs linked by next, e.g., segments of a jumbo
+ * frame or a large NVMe block transmitted on consecutive netmap
+ * slots. The first pop_buf represents the chain.
+ */
+#define pop_buf_chain_for_each(pos, chain)		\
+	for ((pos) = (chain); (pos); (pos) = (pos)->next)
+
+/* pop_buf_chain_append: link pbuf (and its chain) at the tail */
+void pop_buf_chain_append(pop_buf_t *chain, pop_buf_t *pbuf);
+size_t pop_buf_chain_len(pop_buf_t *chain);
+unsigned int pop_buf_chain_count(pop_buf_t *chain);
+
+/* pop_buf_chain_free: pop_buf_free() all pop_bufs in the chain */
+void pop_buf_chain_free(pop_buf_t *chain);
+
+/* pop_buf_segment: return a chain of clones covering the data of
+ * pbuf. Each segment is up to seglen bytes and does not cross a page
+ * of the mem, so that it is physically contiguous. */
+pop_buf_t *pop_buf_segment(pop_buf_t *pbuf, size_t seglen);
+
+/* pop_buf_export: hand pbuf over to another process attached to the
+ * same shared region. pbuf is released except its pages, and the
+ * returned offset of the pages in the region, or (size_t)-1 for a
+ * pop_buf from pktpool or with other references, is passed to
+ * pop_buf_import() with its size */
+size_t pop_buf_export(pop_buf_t *pbuf);
+pop_buf_t *pop_buf_import(pop_mem_t *mem, size_t offset, size_t size);
+
+/* pop_buf_data(), pop_buf_len(), pop_buf_refcnt(), pop_buf_paddr(),
+ * pop_virt_to_phys(), pop_buf_put(), pop_buf_trim(), pop_buf_pull(),
+ * and pop_buf_push() */
+#include <libpop_inline.h>
+
+
+/*
+ * pop_arena: per-thread sub-regions split from a pop_mem_t.
+ *
+ * pop_mem_split() allocates n contiguous arenas of size bytes (rounded
+ * up to PAGE_SIZE) from mem by a single pop_buf_alloc(), and returns
+ * an array of n pop_arena_t. An arena belongs to one thread, and
+ * pop_arena_alloc() is a bump allocator that takes neither mem->mutex
+ * nor malloc(). Memory on an arena is released all together by
+ * pop_arena_reset() or pop_mem_unsplit(). To split memory on each NUMA
+ * node, call pop_mem_split() on pop_mem_pool_get(pool, node).
+ *
+ * When libpop is built with -DPOP_DEBUG, an arena is bound to the
+ * thread that allocates from it first (or calls pop_arena_bind()),
+ * and allocations from other threads abort.
+ */
+#define POP_ARENA_ALIGN	64	/* default alignment, a cache line */
+
+struct pop_arena_stat {
+	unsigned long	allocs;	/* # of successful allocations */
+	unsigned long	fails;	/* # of failed allocations */
+	unsigned long	resets;	/* # of pop_arena_reset() */
+	size_t		used;	/* bytes in use including padding */
+	size_t		peak;	/* high watermark of used */
+};
+
+typedef struct pop_arena {
+	pop_mem_t	*mem;	/* parent pop context */
+	pop_buf_t	*pbuf;	/* pop_buf holding all arenas, on [0] */
+	unsigned int	nr_arenas;
+	unsigned int	index;	/* index in the array */
+
+	char		*base;	/* start of this arena on mem */
+	size_t		size;	/* size of this arena */
+	size_t		used;	/* bump pointer offset from base */
+
+	struct pop_arena_stat	stat;
+
+	pthread_t	owner;	/* checked only with POP_DEBUG */
+	int		owned;
+} __attribute__((aligned(POP_ARENA_ALIGN))) pop_arena_t;
+
+pop_arena_t *pop_mem_split(pop_mem_t *mem, unsigned int n, size_t size);
+void pop_mem_unsplit(pop_arena_t *arenas);
+
+/* pop_arena_alloc: allocate size bytes aligned to POP_ARENA_ALIGN.
+ * NULL is returned and errno is set to ENOBUFS when the arena is
+ * exhausted. align must be a power of two. */
+void *pop_arena_alloc(pop_arena_t *a, size_t size);
+void *pop_arena_alloc_align(pop_arena_t *a, size_t size, size_t align);
+void pop_arena_reset(pop_arena_t *a);
+void pop_arena_bind(pop_arena_t *a);
+void pop_arena_stat(pop_arena_t *a, struct pop_arena_stat *stat);
+
+
+
+
+/*
+ * pop_pktpool: fixed-size packet buffer pool on pop_mem_t.
+ *
+ * All objects are carved from a single pop_buf at creation time, and
+ * their pop_buf_t descriptors are preallocated. pop_pktpool_get() and
+ * pop_pktpool_put() never take mem->mutex nor call malloc(). Each
+ * thread has its own cache of objects, and the caches are refilled
+ * from and drained to a lock-free ring shared by all threads in
+ * POP_PKTPOOL_BULK objects. Note that objects in a cache of a thread
+ * are not available for other threads until the thread exits.
+ *
+ * objsize is rounded up to a power of two (>= 64) when it is smaller
+ * than PAGE_SIZE, or to a multiple of PAGE_SIZE, so that an object
+ * never spans a page boundary. 0 means POP_PKTPOOL_OBJSIZE.
+ */
+#define POP_PKTPOOL_OBJSIZE	2048	/* netmap slot size */
+#define POP_PKTPOOL_CACHE_SIZE	256	/* # of objects in a thread cache */
+#define POP_PKTPOOL_BULK	32	/* # of objects to refill/drain */
+#define POP_PKTPOOL_MAX_THREADS	64	/* # of live threads with a cache */
+
+typedef struct pop_pktpool pop_pktpool_t;
+
+pop_pktpool_t *pop_pktpool_create(pop_mem_t *mem, size_t objsize,
+				  unsigned int count);
+void pop_pktpool_destroy(pop_pktpool_t *pool);
+
+/* pop_pktpool_get: obtain an object with offset=0 and length=0. NULL
+ * is returned and errno is set to ENOBUFS when the pool is empty. */
+pop_buf_t *pop_pktpool_get(pop_pktpool_t *pool);
 
-void *pop_buf_put(pop_buf_t *pbuf, size_t len);
-void *pop_buf_trim(pop_buf_t *pbuf, size_t len);
-void *pop_buf_pull(pop_buf_t *pbuf, size_t len);
-void *pop_buf_push(pop_buf_t *pbuf, size_t len);
+/* pop_pktpool_put: return the object to its pool regardless of its
+ * references. pop_buf_free() on an object from a pool calls this when
+ * the last reference to the object is dropped. */
+void pop_pktpool_put(pop_buf_t *pbuf);
 
+/* pop_pktpool_get_bulk: obtain n objects, e.g., to refill a whole
+ * netmap ring. All or nothing; -1 is returned and errno is set to
+ * ENOBUFS when the pool has less than n objects. */
+int pop_pktpool_get_bulk(pop_pktpool_t *pool, pop_buf_t **bufs,
+			 unsigned int n);
+
+/* pop_pktpool_put_bulk: return n objects of the same pool */
+void pop_pktpool_put_bulk(pop_buf_t **bufs, unsigned int n);
+
+size_t pop_pktpool_objsize(pop_pktpool_t *pool);
+unsigned int pop_pktpool_count(pop_pktpool_t *pool);
+
+/*
+ * pop_pkt_t: a compact handle for an object of a pktpool.
+ *
+ * A handle is the 32-bit index of the object in the pool. The data
+ * is at the pool base + objsize * index, and the offset and length
+ * are kept in an 8-byte entry per object in an array of the pool,
+ * so that rings and queues pass 4-byte handles instead of pointers to
+ * 80-byte pop_buf_t. Handles have no reference count. pop_pkt_buf()
+ * and pop_buf_pkt() convert an object between the two forms.
+ */
+typedef uint32_t pop_pkt_t;
+#define POP_PKT_NONE	((pop_pkt_t)-1)
+
+/* pop_pkt_alloc: POP_PKT_NONE is returned and errno is set to ENOBUFS
+ * when the pool is empty. */
+pop_pkt_t pop_pkt_alloc(pop_pktpool_t *pool);
+void pop_pkt_free(pop_pktpool_t *pool, pop_pkt_t h);
+int pop_pkt_alloc_bulk(pop_pktpool_t *pool, pop_pkt_t *hs, unsigned int n);
+void pop_pkt_free_bulk(pop_pktpool_t *pool, pop_pkt_t *hs, unsigned int n);
+
+void *pop_pkt_data(pop_pktpool_t *pool, pop_pkt_t h);
+uintptr_t pop_pkt_paddr(pop_pktpool_t *pool, pop_pkt_t h);
+size_t pop_pkt_len(pop_pktpool_t *pool, pop_pkt_t h);
+void *pop_pkt_append(pop_pktpool_t *pool, pop_pkt_t h, size_t len);
+void *pop_pkt_adj(pop_pktpool_t *pool, pop_pkt_t h, size_t len);
+
+pop_buf_t *pop_pkt_buf(pop_pktpool_t *pool, pop_pkt_t h);
+pop_pkt_t pop_buf_pkt(pop_buf_t *pbuf);
 
 
 /* debug use */
@@ -116,9 +432,31 @@ uintptr_t virt_to_phys(void *addr);
 
 /*** For RX packets through netmap to p2p memory ***/
 
+/*
+ * Buffer strides. A NIC writes a received frame up to its MTU, so
+ * that a buffer per slot can be smaller than nr_buf_size of netmap
+ * and save p2pmem, e.g., 256 bytes for 64-byte packets instead of
+ * 2048. pop_nm_stride() returns the smallest stride of 256, 512,
+ * 1024, 2048 or 4096 for pktlen, or 0 with errno EINVAL when pktlen is
+ * larger than 4096. pop_nm_port_stride() returns the stride for the
+ * MTU of the interface of a netmap port (with the Ethernet and a VLAN
+ * header), or 0 when the MTU is unknown. pop_nm_stride_is_valid()
+ * returns 1 if stride is one of them.
+ */
+#define POP_NM_STRIDE_MIN	256
+#define POP_NM_STRIDE_MAX	4096
+#define POP_NM_L2_HLEN		18
+
+size_t pop_nm_stride(size_t pktlen);
+size_t pop_nm_port_stride(const char *port);
+int pop_nm_stride_is_valid(size_t stride);
+
 struct pop_nm_rxring {
 	pop_buf_t		*pbuf;	/* p2pmem for this rxring */
 	struct netmap_ring	*ring;
+	size_t			stride;	/* buffer size of a slot */
+	pop_pktpool_t		*pool;	/* swap mode */
+	pop_buf_t		**bufs;	/* pktpool object on each slot */
 };
 
 /* pop_nm_rxring_init: correlating netmap rx ring with p2p memory */
@@ -126,6 +464,31 @@ struct pop_nm_rxring *pop_nm_rxring_init(int fd, struct netmap_ring *ring,
 					 pop_mem_t *mem);
 void pop_nm_rxring_exit(struct pop_nm_rxring *prxring);
 
+/* pop_nm_rxring_init_stride: stride bytes instead of nr_buf_size per
+ * slot. The stride must cover the largest frame the NIC accepts. */
+struct pop_nm_rxring *pop_nm_rxring_init_stride(int fd,
+						struct netmap_ring *ring,
+						pop_mem_t *mem, size_t stride);
+
+/*
+ * pop_nm_rxring_init_pool: swap mode. Each slot has an object of the
+ * pktpool instead of a fixed part of one pop_buf (the objsize is the
+ * stride and must be one of the strides above), and
+ * pop_nm_rxring_swap() hands the object on a received slot over to
+ * the caller and puts a new one from the pool on the slot with
+ * NS_BUF_CHANGED. Received packets can be held, e.g., until they are
+ * written to NVMe, without copying them nor stalling the ring. The
+ * caller frees them by pop_buf_free().
+ */
+struct pop_nm_rxring *pop_nm_rxring_init_pool(int fd, struct netmap_ring *ring,
+					      pop_pktpool_t *pool);
+
+/* pop_nm_rxring_swap: take the packet on the slot at idx as a pop_buf
+ * whose length is slot->len. NULL is returned and errno is set to
+ * ENOBUFS when the pool is empty; then the slot keeps the packet, and
+ * the caller may copy it with pop_nm_rxring_buf() or drop it. */
+pop_buf_t *pop_nm_rxring_swap(struct pop_nm_rxring *prxring, uint32_t idx);
+
 /* pop_nm_rx_ring_buf: obtain packet buffer from rxring correlated to
  * the p2p memory. note that 'idx' is not buf_idx in
  * netmap_slot. index for the ring (usually, ring->head).
@@ -141,6 +504,86 @@ struct netmap_ring *pop_nm_ring(struct pop_nm_rxring *prxring);
 /* pop_nm_set_buf: set p2p memory to specified netmap slot for TX */
 void pop_nm_set_buf(struct netmap_slot *slot, pop_buf_t *pbuf);
 
+/*
+ * pop_nm_tx_burst: set up to n pop_bufs to the slots from ring->head
+ * with NS_PHY_INDIRECT, advance head and cur once, and return the
+ * number of pop_bufs set, which is limited by nm_ring_space().
+ * pop_nm_tx_burst_paddr() takes physical addresses and lengths of
+ * packets instead.
+ */
+unsigned int pop_nm_tx_burst(struct netmap_ring *ring, pop_buf_t **bufs,
+			     unsigned int n);
+unsigned int pop_nm_tx_burst_paddr(struct netmap_ring *ring,
+				   const uintptr_t *paddr,
+				   const uint16_t *len, unsigned int n);
+
+/* pop_nm_tx_sync: NIOCTXSYNC only when free slots are fewer than
+ * threshold (always when 0). returns 0 when skipped, or ioctl()'s. */
+int pop_nm_tx_sync(int fd, struct netmap_ring *ring, unsigned int threshold);
+
+/*
+ * pop_nm_txring: TX completion tracking for NS_PHY_INDIRECT slots.
+ *
+ * A pop_buf on a TX slot must not be reused until the NIC has sent
+ * it. pop_nm_txring records the pop_buf on each slot, and after
+ * NIOCTXSYNC, pop_nm_txring_complete() returns the pop_bufs on slots
+ * that ring->tail has passed since the last call, in the order they
+ * were queued. A slot may be tracked with NULL when the caller maps
+ * slots to its own buffers, e.g., positions of a pop_ring, and needs
+ * only the number of completions.
+ */
+struct pop_nm_txring {
+	struct netmap_ring	*ring;
+	uint32_t		done;	/* next slot to complete */
+	pop_buf_t		**bufs;	/* pop_buf on each slot */
+	uint8_t			*used;	/* slot is tracked */
+};
+
+struct pop_nm_txring *pop_nm_txring_init(struct netmap_ring *ring);
+
+/* pop_nm_txring_exit: pop_buf_free() tracked pop_bufs. call it after
+ * the pending slots are sent (see nm_tx_pending()). */
+void pop_nm_txring_exit(struct pop_nm_txring *ptx);
+
+/* pop_nm_txring_track: record pbuf (or NULL) on the slot at idx */
+void pop_nm_txring_track(struct pop_nm_txring *ptx, unsigned int idx,
+			 pop_buf_t *pbuf);
+
+/* pop_nm_txring_set_buf/chain: pop_nm_set_buf/chain() and track */
+void pop_nm_txring_set_buf(struct pop_nm_txring *ptx, unsigned int idx,
+			   pop_buf_t *pbuf);
+int pop_nm_txring_set_chain(struct pop_nm_txring *ptx, unsigned int idx,
+			    pop_buf_t *chain);
+
+/* pop_nm_txring_burst/burst_paddr: pop_nm_tx_burst/burst_paddr() and
+ * track bufs[i] (or NULLs when bufs is NULL) on the slots */
+unsigned int pop_nm_txring_burst(struct pop_nm_txring *ptx, pop_buf_t **bufs,
+				 unsigned int n);
+unsigned int pop_nm_txring_burst_paddr(struct pop_nm_txring *ptx,
+				       const uintptr_t *paddr,
+				       const uint16_t *len, pop_buf_t **bufs,
+				       unsigned int n);
+
+/* pop_nm_txring_complete: store up to n completed pop_bufs (or NULLs)
+ * to bufs when bufs is not NULL, and return the number of them. */
+unsigned int pop_nm_txring_complete(struct pop_nm_txring *ptx,
+				    pop_buf_t **bufs, unsigned int n);
+
+/* pop_nm_txring_reclaim: pop_buf_free() all completed pop_bufs, and
+ * return the number of completed slots. */
+unsigned int pop_nm_txring_reclaim(struct pop_nm_txring *ptx);
+
+/* pop_nm_set_pkt: set a pktpool object by handle to the slot for TX */
+void pop_nm_set_pkt(struct netmap_slot *slot, pop_pktpool_t *pool,
+		    pop_pkt_t h);
+
+/* pop_nm_set_chain: set a pop_buf chain to consecutive slots from
+ * idx with NS_MOREFRAG on all but the last. It returns the index next
+ * to the last slot, or -1 when a segment is larger than a slot or the
+ * slots before ring->tail are not enough. */
+int pop_nm_set_chain(struct netmap_ring *ring, unsigned int idx,
+		     pop_buf_t *chain);
+
 
 
 
@@ -0,0 +1,119 @@
+/*
+ * libpop_inline.h: inline accessors of pop_buf, included by libpop.h.
+ *
+ * These run several times per packet, so that they are inline in the
+ * callers. lib/libpop.c emits their external definitions for callers
+ * that are not inlined. Building with -DPOP_NO_CHECKS drops the
+ * bounds checks and the logging on error.
+ */
+
+#ifndef _LIBPOP_INLINE_H_
+#define _LIBPOP_INLINE_H_
+
+#ifndef _LIBPOP_H_
+#error "include libpop.h instead of libpop_inline.h"
+#endif
+
+#define pop_likely(x)	__builtin_expect(!!(x), 1)
+#define pop_unlikely(x)	__builtin_expect(!!(x), 0)
+
+/* error paths, out of line */
+void __pop_buf_check_failed(const char *op, pop_buf_t *pbuf, size_t len)
+	__attribute__((cold));
+void __pop_virt_check_failed(pop_mem_t *mem, void *vaddr)
+	__attribute__((cold));
+
+inline void *pop_buf_data(pop_buf_t *pbuf)
+{
+	return (char *)pbuf->vaddr + pbuf->offset;
+}
+
+inline size_t pop_buf_len(pop_buf_t *pbuf)
+{
+	return pbuf->length;
+}
+
+/* pop_buf_refcnt: 1 means no one else, e.g., a TX slot, refers to it */
+inline unsigned int pop_buf_refcnt(pop_buf_t *pbuf)
+{
+	return __atomic_load_n(&pbuf->refcnt, __ATOMIC_ACQUIRE);
+}
+
+/* pop_virt_to_phys: translate vaddr in the mem to its physical
+ * address. It costs a shift and a table lookup. Note that a pop_buf
+ * larger than a page of the mem (e.g., 2MB hugepage) is not
+ * physically contiguous. Translate each packet on it. */
+inline uintptr_t pop_virt_to_phys(pop_mem_t *mem, void *vaddr)
+{
+	uintptr_t off = (char *)vaddr - (char *)mem->mem;
+
+#ifndef POP_NO_CHECKS
+	if (pop_unlikely(off >= mem->size)) {
+		__pop_virt_check_failed(mem, vaddr);
+		return 0;
+	}
+#endif
+
+	return mem->paddrs[off >> mem->page_shift] + (off & mem->page_mask);
+}
+
+inline uintptr_t pop_buf_paddr(pop_buf_t *pbuf)
+{
+	return pop_virt_to_phys(pbuf->mem, pop_buf_data(pbuf));
+}
+
+inline void *pop_buf_put(pop_buf_t *pbuf, size_t len)
+{
+#ifndef POP_NO_CHECKS
+	if (pop_unlikely(pbuf->offset + pbuf->length + len > pbuf->size)) {
+		__pop_buf_check_failed("put", pbuf, len);
+		return NULL;
+	}
+#endif
+
+	pbuf->length += len;
+	return pop_buf_data(pbuf);
+}
+
+inline void *pop_buf_trim(pop_buf_t *pbuf, size_t len)
+{
+#ifndef POP_NO_CHECKS
+	if (pop_unlikely(pbuf->length < len)) {
+		__pop_buf_check_failed("trim", pbuf, len);
+		return NULL;
+	}
+#endif
+
+	pbuf->length -= len;
+	return pop_buf_data(pbuf);
+}
+
+inline void *pop_buf_pull(pop_buf_t *pbuf, size_t len)
+{
+#ifndef POP_NO_CHECKS
+	if (pop_unlikely(pbuf->length < len)) {
+		__pop_buf_check_failed("pull", pbuf, len);
+		return NULL;
+	}
+#endif
+
+	pbuf->length -= len;
+	pbuf->offset += len;
+	return pop_buf_data(pbuf);
+}
+
+inline void *pop_buf_push(pop_buf_t *pbuf, size_t len)
+{
+#ifndef POP_NO_CHECKS
+	if (pop_unlikely(pbuf->offset < len)) {
+		__pop_buf_check_failed("push", pbuf, len);
+		return NULL;
+	}
+#endif
+
+	pbuf->length += len;
+	pbuf->offset -= len;
+	return pop_buf_data(pbuf);
+}
+
+#endif /* _LIBPOP_INLINE_H_ */
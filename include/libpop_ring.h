@@ -0,0 +1,254 @@
+/*
+ * libpop_ring.h: lock-free rings between pipeline stages.
+ *
+ * A pop_ring is a power-of-two array of 32-bit entries, e.g., pop_pkt_t
+ * handles or indexes of slots on a pop_buf. The producer and the
+ * consumer indexes live on separate cache lines, and both are
+ * free-running 32-bit counters, so that all size entries are usable.
+ *
+ * Each side is single or multi threaded:
+ *  - SPSC: POP_RING_SP_ENQ | POP_RING_SC_DEQ
+ *  - MPSC: POP_RING_SC_DEQ
+ *  - MPMC: 0
+ * A single producer (consumer) caches the last consumer (producer)
+ * index it has seen, and reads the remote cache line only when the
+ * cached one does not show enough room (entries). Multi producers
+ * (consumers) reserve entries by moving head with CAS, fill (or read)
+ * them, and publish them by moving tail after the preceding
+ * reservations are published.
+ *
+ * pop_ring_sp_reserve()/commit() and pop_ring_sc_peek()/release()
+ * pass positions instead of entries for an SPSC ring whose positions
+ * map to buffers, e.g., packet slots that the producer fills in place.
+ */
+
+#ifndef _LIBPOP_RING_H_
+#define _LIBPOP_RING_H_
+
+#include <stdint.h>
+
+#define POP_RING_SP_ENQ	0x01	/* single producer */
+#define POP_RING_SC_DEQ	0x02	/* single consumer */
+
+#define POP_RING_CACHE_LINE	64
+
+typedef struct pop_ring {
+	uint32_t	size;
+	uint32_t	mask;
+	int		flags;
+
+	struct {
+		uint32_t	head;	/* next to reserve */
+		uint32_t	tail;	/* next to publish */
+		uint32_t	cache;	/* cons.tail seen by single producer */
+	} prod __attribute__((aligned(POP_RING_CACHE_LINE)));
+
+	struct {
+		uint32_t	head;
+		uint32_t	tail;
+		uint32_t	cache;	/* prod.tail seen by single consumer */
+	} cons __attribute__((aligned(POP_RING_CACHE_LINE)));
+
+	uint32_t	objs[0] __attribute__((aligned(POP_RING_CACHE_LINE)));
+} pop_ring_t;
+
+/* pop_ring_create: count is rounded up to a power of two */
+pop_ring_t *pop_ring_create(unsigned int count, int flags);
+void pop_ring_free(pop_ring_t *r);
+
+static inline void pop_cpu_relax(void)
+{
+	__builtin_ia32_pause();
+}
+
+static inline unsigned int pop_ring_count(pop_ring_t *r)
+{
+	return __atomic_load_n(&r->prod.tail, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&r->cons.tail, __ATOMIC_ACQUIRE);
+}
+
+static inline unsigned int pop_ring_free_count(pop_ring_t *r)
+{
+	return r->size - pop_ring_count(r);
+}
+
+
+/* single producer */
+
+static inline unsigned int pop_ring_sp_reserve(pop_ring_t *r, uint32_t *pos,
+					       unsigned int n)
+{
+	/* returns free entries, which may be less than n, and the
+	 * position of the first one */
+	uint32_t head = r->prod.head;
+
+	if (r->size - (head - r->prod.cache) < n)
+		r->prod.cache = __atomic_load_n(&r->cons.tail,
+						__ATOMIC_ACQUIRE);
+	*pos = head & r->mask;
+	return r->size - (head - r->prod.cache);
+}
+
+static inline void pop_ring_sp_commit(pop_ring_t *r, unsigned int n)
+{
+	r->prod.head += n;
+	__atomic_store_n(&r->prod.tail, r->prod.head, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int pop_ring_sp_enqueue_burst(pop_ring_t *r,
+						     const uint32_t *objs,
+						     unsigned int n)
+{
+	uint32_t head = r->prod.head, free, i;
+
+	free = r->size - (head - r->prod.cache);
+	if (free < n) {
+		r->prod.cache = __atomic_load_n(&r->cons.tail,
+						__ATOMIC_ACQUIRE);
+		free = r->size - (head - r->prod.cache);
+		if (n > free)
+			n = free;
+		if (n == 0)
+			return 0;
+	}
+
+	for (i = 0; i < n; i++)
+		r->objs[(head + i) & r->mask] = objs[i];
+
+	pop_ring_sp_commit(r, n);
+	return n;
+}
+
+
+/* multi producers */
+
+static inline unsigned int pop_ring_mp_enqueue_burst(pop_ring_t *r,
+						     const uint32_t *objs,
+						     unsigned int n)
+{
+	uint32_t head, ctail, free, i;
+
+	head = __atomic_load_n(&r->prod.head, __ATOMIC_RELAXED);
+	do {
+		ctail = __atomic_load_n(&r->cons.tail, __ATOMIC_ACQUIRE);
+		free = r->size - (head - ctail);
+		if (n > free)
+			n = free;
+		if (n == 0)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&r->prod.head, &head, head + n,
+					      0, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	for (i = 0; i < n; i++)
+		r->objs[(head + i) & r->mask] = objs[i];
+
+	/* wait for preceding producers, then publish */
+	while (__atomic_load_n(&r->prod.tail, __ATOMIC_RELAXED) != head)
+		pop_cpu_relax();
+	__atomic_store_n(&r->prod.tail, head + n, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+
+/* single consumer */
+
+static inline unsigned int pop_ring_sc_peek(pop_ring_t *r, uint32_t *pos,
+					    unsigned int n)
+{
+	/* returns available entries, which may be less than n, and the
+	 * position of the first one */
+	uint32_t head = r->cons.head;
+
+	if (r->cons.cache - head < n)
+		r->cons.cache = __atomic_load_n(&r->prod.tail,
+						__ATOMIC_ACQUIRE);
+	*pos = head & r->mask;
+	return r->cons.cache - head;
+}
+
+static inline void pop_ring_sc_release(pop_ring_t *r, unsigned int n)
+{
+	r->cons.head += n;
+	__atomic_store_n(&r->cons.tail, r->cons.head, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int pop_ring_sc_dequeue_burst(pop_ring_t *r,
+						     uint32_t *objs,
+						     unsigned int n)
+{
+	uint32_t head = r->cons.head, entries, i;
+
+	entries = r->cons.cache - head;
+	if (entries < n) {
+		r->cons.cache = __atomic_load_n(&r->prod.tail,
+						__ATOMIC_ACQUIRE);
+		entries = r->cons.cache - head;
+		if (n > entries)
+			n = entries;
+		if (n == 0)
+			return 0;
+	}
+
+	for (i = 0; i < n; i++)
+		objs[i] = r->objs[(head + i) & r->mask];
+
+	pop_ring_sc_release(r, n);
+	return n;
+}
+
+
+/* multi consumers */
+
+static inline unsigned int pop_ring_mc_dequeue_burst(pop_ring_t *r,
+						     uint32_t *objs,
+						     unsigned int n)
+{
+	uint32_t head, ptail, entries, i;
+
+	head = __atomic_load_n(&r->cons.head, __ATOMIC_RELAXED);
+	do {
+		ptail = __atomic_load_n(&r->prod.tail, __ATOMIC_ACQUIRE);
+		entries = ptail - head;
+		if (n > entries)
+			n = entries;
+		if (n == 0)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&r->cons.head, &head, head + n,
+					      0, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	for (i = 0; i < n; i++)
+		objs[i] = r->objs[(head + i) & r->mask];
+
+	/* wait for preceding consumers, then release the entries */
+	while (__atomic_load_n(&r->cons.tail, __ATOMIC_RELAXED) != head)
+		pop_cpu_relax();
+	__atomic_store_n(&r->cons.tail, head + n, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+
+/* by the flags of the ring */
+
+static inline unsigned int pop_ring_enqueue_burst(pop_ring_t *r,
+						  const uint32_t *objs,
+						  unsigned int n)
+{
+	if (r->flags & POP_RING_SP_ENQ)
+		return pop_ring_sp_enqueue_burst(r, objs, n);
+	return pop_ring_mp_enqueue_burst(r, objs, n);
+}
+
+static inline unsigned int pop_ring_dequeue_burst(pop_ring_t *r,
+						  uint32_t *objs,
+						  unsigned int n)
+{
+	if (r->flags & POP_RING_SC_DEQ)
+		return pop_ring_sc_dequeue_burst(r, objs, n);
+	return pop_ring_mc_dequeue_burst(r, objs, n);
+}
+
+#endif /* _LIBPOP_RING_H_ */
@@ -17,9 +17,10 @@
 
 #include <libpop.h>
 #include <libpop_util.h>
+#include <pop_buddy.h>
+#include <pop_mem.h>
 
 #define PROGNAME	"libpop"
-#define DEVPOP		"/dev/boogiepop"
 
 int libpop_verbose = 0;	/* global in libpop */
 
@@ -31,39 +32,83 @@ void libpop_verbose_disable(void) {
 	libpop_verbose = 0;
 }
 
-/* prototypes for internal uses */
-
-#define NR_HUGEPAGES \
-	"/sys/kernel/mm/hugepages/hugepages-2048kB/nr_hugepages"
-#define HUGEPAGE_SIZE (2 * 1024 * 1024)
-	
+/* memory operations  */
 
-static int get_nr_hugepages(void)
+static int pop_mem_commit(pop_mem_t *mem, size_t len)
 {
-	int fd;
-	char buf[16];
+	/* map [committed, committed + len), and give its pages to the
+	 * buddy. called with the lock held except in init. */
 
-	fd = open(NR_HUGEPAGES, O_RDONLY);
-	if (fd < 0) {
-		pr_ve("failed to open %s", NR_HUGEPAGES);
+	size_t off = mem->committed;
+	unsigned long t0, t1, t2;
+
+	len = (len + mem->pagesize - 1) & ~(mem->pagesize - 1);
+	if (len > mem->size - off)
+		len = mem->size - off;
+	if (len == 0) {
+		errno = ENOMEM;
 		return -1;
 	}
 
-	read(fd, buf, sizeof(buf));
-	return atoi(buf);
+	t0 = libpop_usec();
+	if (mem->ops->grow(mem, off, len) < 0)
+		return -1;
+
+	t1 = libpop_usec();
+	if (mem->ops->translate(mem, off, len) < 0) {
+		/* the range stays mapped, but never used */
+		pr_ve("failed to translate %lu bytes at %lu on %s",
+		      len, off, mem->devname);
+		return -1;
+	}
+
+	t2 = libpop_usec();
+	pop_buddy_free(mem->buddy, off >> PAGE_SHIFT, len >> PAGE_SHIFT);
+	mem->committed += len;
+
+	pr_vs("%lu bytes committed on %s, %lu of %lu bytes: "
+	      "map %lu usec, translate %lu usec, buddy %lu usec",
+	      len, mem->devname, mem->committed, mem->size,
+	      t1 - t0, t2 - t1, libpop_usec() - t2);
+
+	return 0;
 }
 
-/* memory operations  */
+void pop_mem_attr_init(pop_mem_attr_t *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->numa_node = POP_MEM_NUMA_ANY;
+}
 
 pop_mem_t *pop_mem_init(char *dev, size_t size)
+{
+	return pop_mem_init_attr(dev, size, NULL);
+}
+
+pop_mem_t *pop_mem_init_attr(char *dev, size_t size, pop_mem_attr_t *attr)
 {
 	/*
-	 * register dev and its p2pmem through /dev/pop/pop
+	 * reserve a region through the backend for dev, build the
+	 * physical address table and the buddy for the region, and
+	 * commit the region at once or its first chunk.
 	 */
 
-	int ret, fd ,flags;
-	char popdev[32];
+	size_t nr_pages, initial;
 	pop_mem_t *mem;
+	unsigned long start;
+	char path[64];
+
+	if (attr && attr->shared_name) {
+		if (strlen(attr->shared_name) >= POP_MEM_NAME_MAX) {
+			errno = ENAMETOOLONG;
+			return NULL;
+		}
+
+		/* attach to the region that exists */
+		snprintf(path, sizeof(path), POP_SHM_PATH, attr->shared_name);
+		if (access(path, F_OK) == 0)
+			return pop_mem_attach(attr->shared_name);
+	}
 
 	/* validation */
 	mem = malloc(sizeof(*mem));
@@ -71,129 +116,143 @@ pop_mem_t *pop_mem_init(char *dev, size_t size)
 		return NULL;
 	memset(mem, 0, sizeof(*mem));
 	pthread_mutex_init(&mem->mutex, NULL);
+	mem->lock = &mem->mutex;
+	mem->fd = -1;
+	mem->numa_node = -1;
+
+	mem->ops = pop_mem_ops_lookup(dev);
+	if (attr && attr->shared_name) {
+		if (!mem->ops->attach) {
+			pr_ve("%s memory cannot be shared", mem->ops->name);
+			errno = EINVAL;
+			goto err_free_mem;
+		}
+		strncpy(mem->name, attr->shared_name, POP_MEM_NAME_MAX - 1);
+	}
 
-	if (dev == NULL) {
-		/* allocate hugepages  */
-		int nr_pages;
+	/* a shared region is committed at once */
+	if (attr && attr->initial && mem->ops->grow && !mem->name[0]) {
+		initial = attr->initial;
+		mem->grow_chunk = attr->grow_chunk ? : attr->initial;
+		mem->watermark = attr->watermark;
+	} else
+		initial = 0;
+	if (attr) {
+		mem->prefault_threads = attr->prefault_threads;
+		/* POP_MEM_NUMA_ANY becomes -1 */
+		mem->numa_node = attr->numa_node - 1;
+		if (attr->numa_node == POP_MEM_NUMA_AUTO)
+			mem->numa_node = attr->numa_dev ?
+				pop_numa_node(attr->numa_dev) : -1;
+		if (mem->numa_node < 0)
+			mem->numa_node = -1;
+	}
 
-		strncpy(mem->devname, "hugepage", POP_PCI_DEVNAME_MAX);
+	start = libpop_usec();
+	if (mem->ops->init(mem, dev, size) < 0) {
+		pr_ve("failed to init %s memory", mem->ops->name);
+		goto err_free_mem;
+	}
+	mem->num_pages = mem->size >> PAGE_SHIFT;
+	pr_vs("init %s: %lu usec", mem->ops->name, libpop_usec() - start);
+
+	/* a backend maps pages physically contiguous in 1 << page_shift.
+	 * the table covers the whole reserved region */
+	mem->page_mask = (1UL << mem->page_shift) - 1;
+	nr_pages = (mem->size + mem->page_mask) >> mem->page_shift;
+	mem->paddrs = calloc(nr_pages, sizeof(uintptr_t));
+	if (!mem->paddrs) {
+		pr_ve("failed to allocate paddr table for %lu pages",
+		      nr_pages);
+		goto err_exit_ops;
+	}
 
-		nr_pages  = get_nr_hugepages();
-		if (nr_pages < 0) {
-			pr_ve("failed to get num of hugepages");
-			return NULL;
-		}
+	/* pages become free when they are committed */
+	mem->buddy = malloc(pop_buddy_size(mem->num_pages));
+	if (!mem->buddy) {
+		pr_ve("failed to allocate buddy for %lu pages",
+		      mem->num_pages);
+		goto err_free_paddrs;
+	}
+	pop_buddy_init(mem->buddy, mem->num_pages);
 
-		flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_LOCKED | MAP_HUGETLB;
+	if (mem->ops->grow) {
+		if (pop_mem_commit(mem, initial ? : mem->size) < 0)
+			goto err_free_buddy;
+	} else {
+		if (mem->ops->translate(mem, 0, mem->size) < 0)
+			goto err_free_buddy;
+		pop_buddy_free(mem->buddy, 0, mem->num_pages);
+		mem->committed = mem->size;
+	}
+	mem->paddr = mem->paddrs[0];
 
-		/* use size if size is not 0, or 2MB * # of pages / 4 */
-		mem->fd = -1;
-		mem->size = (size != 0) ? size : 2097152 * (nr_pages / 4);
-		mem->num_pages = ((mem->size + (1 << PAGE_SHIFT) - 1)
-				  >> PAGE_SHIFT); /* aligne to PAGE_SIZE(4k) */
+	/* move the paddr table and the buddy to /dev/shm */
+	if (mem->name[0] && pop_mem_share(mem, mem->name) < 0)
+		goto err_free_buddy;
 
-	} else {
-		/* pop device. register it through /dev/pop/pop */
-		strncpy(mem->devname, dev, POP_PCI_DEVNAME_MAX);
-		ret = sscanf(dev, "%x:%x:%x.%x",
-			     &mem->reg.domain, &mem->reg.bus,
-			     &mem->reg.slot, &mem->reg.func);
-		if (ret < 4) {
-			mem->reg.domain = 0;
-			ret = sscanf(dev, "%x:%x.%x",
-				     &mem->reg.bus,
-				     &mem->reg.slot, &mem->reg.func);
-		}
-		if (ret < 3) {
-			pr_ve("invalid pci slot %s", dev);
-			errno = EINVAL;
-			return NULL;
-		}
+	pr_vs("%lu-byte mmaped on %s (%s) with %lu-byte pages on node %d, "
+	      "%lu bytes committed, vaddr=%p paddr=0x%lx, %lu usec",
+	      mem->size, mem->devname, mem->ops->name, mem->pagesize,
+	      mem->numa_node, mem->committed, mem->mem, mem->paddr,
+	      libpop_usec() - start);
 
-		fd = open(DEVPOP, O_RDWR);
-		if (fd < 0) {
-			pr_ve("failed to open %s", DEVPOP);
-			return NULL;
-		}
+	return mem;
 
-		mem->reg.size = size;
-		ret = ioctl(fd, POP_P2PMEM_REG, &mem->reg);
-		if (ret != 0) {
-			pr_ve("failed to register p2pmem on %s", dev);
-			close(fd);
-			return NULL;
-		}
-		close(fd);
-
-		/* open /dev/pop/PCI_DEV for mmap() */
-		snprintf(popdev, sizeof(popdev), "/dev/pop/%04x:%02x:%02x.%x",
-			 mem->reg.domain, mem->reg.bus,
-			 mem->reg.slot, mem->reg.func);
-		mem->fd = open(popdev, O_RDWR);
-		if (mem->fd < 0) {
-			pr_ve("failed to open %s", popdev);
-			return NULL;
-		}
+err_free_buddy:
+	free(mem->buddy);
+err_free_paddrs:
+	free(mem->paddrs);
+err_exit_ops:
+	mem->ops->exit(mem);
+	if (mem->name[0] && mem->path[0] && mem->ops != &pop_mem_p2pmem_ops)
+		unlink(mem->path);
+err_free_mem:
+	free(mem);
+	return NULL;
+}
 
-		flags = MAP_LOCKED | MAP_SHARED;
-		mem->size = mem->reg.size;		
-		mem->num_pages = mem->size >> PAGE_SHIFT;
+int pop_mem_grow(pop_mem_t *mem, size_t len)
+{
+	int ret;
+
+	if (!mem->ops->grow) {
+		errno = EOPNOTSUPP;
+		return -1;
 	}
-	
-	/* XXX: handle offset */
-	mem->mem = mmap(0, mem->size, PROT_READ | PROT_WRITE,
-			flags, mem->fd, 0);
-	if (mem->mem == MAP_FAILED) {
-		pr_ve("failed to mmap on %s", mem->devname);
-		if (mem->fd != -1)
-			close(mem->fd);
-		return NULL;
+
+	if (mem->shared) {
+		/* other processes would not see the new pages */
+		errno = EOPNOTSUPP;
+		return -1;
 	}
-	mem->paddr = virt_to_phys(mem->mem);
 
-	pr_vs("%lu-byte mmaped on %s, vaddr=%p paddr=0x%lx",
-	      mem->size, mem->devname, mem->mem, mem->paddr);
+	pop_mem_lock(mem);
+	ret = pop_mem_commit(mem, len);
+	pop_mem_unlock(mem);
 
-	return mem;
+	return ret;
 }
 
 
 int pop_mem_exit(pop_mem_t *mem)
 {
-	/* unregister dev and its p2pmem through /dev/pop/pop */
-	
-	int ret, fd;
-
-	if (mem->fd == -1) {
-		/* hugepage */
-#if 0
-		/* XXX: should munmap, but it fails... */
-		ret = munmap(mem->mem, mem->size);
-		if (ret != 0) {
-			pr_ve("failed to munmap on %s", mem->devname);
-			return -1;
-		}
-#endif
-	} else {
-		/* pop device. unregister it through /dev/pop/pop */
-
-		fd = open(DEVPOP, O_RDWR);
-		if (fd < 0) {
-			pr_ve("failed to open %s", DEVPOP);
-			return -1;
-		}
+	int ret;
 
-		ret = ioctl(fd, POP_P2PMEM_UNREG, &mem->reg);
-		if (ret != 0) {
-			pr_ve("failed to unregister %s", mem->devname);
-			return -1;
-		}
-		return close(mem->fd);
+	if (mem->shared) {
+		/* just detach. the region remains until pop_mem_unlink() */
+		pop_mem_unshare(mem);
+		free(mem);
+		return 0;
 	}
 
+	ret = mem->ops->exit(mem);
+
+	free(mem->buddy);
+	free(mem->paddrs);
 	free(mem);
 
-	return 0;
+	return ret;
 }
 
 size_t pop_mem_size(pop_mem_t *mem)
@@ -201,135 +260,383 @@ size_t pop_mem_size(pop_mem_t *mem)
 	return mem->size;
 }
 
+size_t pop_mem_committed(pop_mem_t *mem)
+{
+	return mem->committed;
+}
 
-/* pop_buf operations */
+int pop_mem_numa_node(pop_mem_t *mem)
+{
+	return mem->numa_node;
+}
 
-pop_buf_t *pop_buf_alloc(pop_mem_t *mem, size_t size)
+size_t pop_mem_page_size(pop_mem_t *mem)
 {
-	pop_buf_t *pbuf = NULL;
-	size_t nr_pages;
+	return mem->pagesize;
+}
 
-	pthread_mutex_lock(&mem->mutex);
 
+/* pop_buf operations */
 
-	for (nr_pages = 0; (nr_pages << PAGE_SHIFT) < size; nr_pages++);
-	pr_vs("try to allocate %lu bytes, %lu pages", size, nr_pages);
+static long pop_buf_alloc_pages(pop_mem_t *mem, size_t nr_pages)
+{
+	/* called with the lock held */
+	long pgoff;
+
+	/* commit the next chunk in advance when crossing watermark */
+	if (mem->watermark && mem->committed < mem->size &&
+	    (mem->alloced_pages + nr_pages) * 100 >
+	    (mem->committed >> PAGE_SHIFT) * mem->watermark)
+		pop_mem_commit(mem, mem->grow_chunk);
+
+	/* or, commit chunks until the allocation succeeds */
+	while ((pgoff = pop_buddy_alloc(mem->buddy, nr_pages)) < 0) {
+		if (mem->committed == mem->size ||
+		    pop_mem_commit(mem, mem->grow_chunk) < 0)
+			break;
+	}
 
-	if ((mem->num_pages - mem->alloced_pages) < nr_pages) {
+	if (pgoff < 0) {
 		pr_ve("no page available on %s, "
 		      "num_pages=%lu alloced_pages=%lu nr_pages=%lu",
-		      mem->devname, mem->num_pages,mem->alloced_pages,
+		      mem->devname, mem->num_pages, mem->alloced_pages,
 		      nr_pages);
+		return -1;
+	}
+	mem->alloced_pages += nr_pages;
+
+	return pgoff;
+}
+
+int pop_buf_alloc_bulk(pop_mem_t *mem, size_t size, pop_buf_t **bufs,
+		       unsigned int n)
+{
+	pop_buf_t *pbuf;
+	size_t nr_pages;
+	unsigned int i;
+	void *vaddr;
+	long pgoff;
+
+	nr_pages = (size + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+	if (nr_pages == 0)
+		nr_pages = 1;
+	pr_vs("try to allocate %u x %lu bytes, %lu pages",
+	      n, size, nr_pages);
+
+	/* descriptors are allocated outside the lock */
+	for (i = 0; i < n; i++) {
+		bufs[i] = malloc(sizeof(*pbuf));
+		if (!bufs[i]) {
+			pr_ve("failed to allocate pop_buf structure");
+			goto err_free_bufs;
+		}
+	}
+
+	pop_mem_lock(mem);
+	for (i = 0; i < n; i++) {
+		pgoff = pop_buf_alloc_pages(mem, nr_pages);
+		if (pgoff < 0)
+			break;
+		bufs[i]->vaddr = mem->mem + (pgoff << PAGE_SHIFT);
+	}
+
+	if (i < n) {
+		/* all or nothing */
+		while (i-- > 0) {
+			pgoff = (bufs[i]->vaddr - mem->mem) >> PAGE_SHIFT;
+			pop_buddy_free(mem->buddy, pgoff, nr_pages);
+			mem->alloced_pages -= nr_pages;
+		}
+		pop_mem_unlock(mem);
+		i = n;
 		errno = ENOBUFS;
-		goto out;
+		goto err_free_bufs;
+	}
+	pop_mem_unlock(mem);
+
+	for (i = 0; i < n; i++) {
+		pbuf = bufs[i];
+		vaddr = pbuf->vaddr;
+		memset(pbuf, 0, sizeof(*pbuf));
+		pbuf->mem	= mem;
+		pbuf->vaddr	= vaddr;
+		pbuf->paddr	= pop_virt_to_phys(mem, pbuf->vaddr);
+		pbuf->size	= nr_pages << PAGE_SHIFT;
+		pbuf->offset	= 0;
+		pbuf->length	= 0;
+		pbuf->refcnt	= 1;
 	}
 
-	pbuf = malloc(sizeof(*pbuf));
-	if (!pbuf) {
+	return 0;
+
+err_free_bufs:
+	while (i-- > 0)
+		free(bufs[i]);
+	return -1;
+}
+
+pop_buf_t *pop_buf_alloc(pop_mem_t *mem, size_t size)
+{
+	pop_buf_t *pbuf;
+
+	if (pop_buf_alloc_bulk(mem, size, &pbuf, 1) < 0)
+		return NULL;
+
+	return pbuf;
+}
+
+pop_buf_t *pop_buf_get(pop_buf_t *pbuf)
+{
+	__atomic_add_fetch(&pbuf->refcnt, 1, __ATOMIC_RELAXED);
+	return pbuf;
+}
+
+pop_buf_t *pop_buf_clone(pop_buf_t *pbuf)
+{
+	pop_buf_t *clone;
+
+	clone = malloc(sizeof(*clone));
+	if (!clone) {
 		pr_ve("failed to allocate pop_buf structure");
-		goto out;
+		return NULL;
 	}
 
-	memset(pbuf, 0, sizeof(*pbuf));
-	pbuf->mem	= mem;
-	pbuf->vaddr	= mem->mem + ((mem->alloced_pages << PAGE_SHIFT));
-	pbuf->paddr	= mem->paddr + ((mem->alloced_pages << PAGE_SHIFT));
-	pbuf->size	= nr_pages << PAGE_SHIFT;
-	pbuf->offset	= 0;
-	pbuf->length	= 0;
+	/* a clone of a clone refers to the owner of the data */
+	*clone = *pbuf;
+	clone->head = pop_buf_get(pbuf->head ? pbuf->head : pbuf);
+	clone->pool = NULL;
+	clone->next = NULL;
+	clone->refcnt = 1;
 
-	mem->alloced_pages += nr_pages;
+	return clone;
+}
 
-out:
-	pthread_mutex_unlock(&mem->mutex);
-	return pbuf;
+void pop_buf_chain_append(pop_buf_t *chain, pop_buf_t *pbuf)
+{
+	while (chain->next)
+		chain = chain->next;
+	chain->next = pbuf;
 }
 
-void pop_buf_free(pop_buf_t *pbuf)
+size_t pop_buf_chain_len(pop_buf_t *chain)
 {
-	/* ToDo: hehe... */
+	pop_buf_t *pos;
+	size_t len = 0;
 
-	free(pbuf);
+	pop_buf_chain_for_each(pos, chain)
+		len += pos->length;
+
+	return len;
 }
 
-inline void *pop_buf_data(pop_buf_t *pbuf)
+unsigned int pop_buf_chain_count(pop_buf_t *chain)
 {
-	return pbuf->vaddr + pbuf->offset;
+	pop_buf_t *pos;
+	unsigned int count = 0;
+
+	pop_buf_chain_for_each(pos, chain)
+		count++;
+
+	return count;
 }
 
-inline uintptr_t pop_buf_paddr(pop_buf_t *pbuf)
+void pop_buf_chain_free(pop_buf_t *chain)
 {
-	return pbuf->paddr + pbuf->offset;
+	pop_buf_t *next;
+
+	while (chain) {
+		next = chain->next;
+		pop_buf_free(chain);
+		chain = next;
+	}
 }
 
-inline void *pop_buf_put(pop_buf_t *pbuf, size_t len)
+pop_buf_t *pop_buf_segment(pop_buf_t *pbuf, size_t seglen)
 {
-	if (pbuf->offset + pbuf->length + len > pbuf->size) {
-		pr_ve("failed to put: size=%lu off=%lu length=%lu putlen=%lu",
-		      pbuf->size, pbuf->offset, pbuf->length, len);
-		return NULL;
+	pop_mem_t *mem = pbuf->mem;
+	pop_buf_t *chain = NULL, *seg;
+	size_t off, len, end;
+
+	for (off = 0; off < pbuf->length; off += len) {
+		/* stop at the end of a page of the mem */
+		len = pbuf->length - off;
+		if (len > seglen)
+			len = seglen;
+		end = (pbuf->vaddr - mem->mem) + pbuf->offset + off;
+		end = ((end + mem->page_mask + 1) & ~mem->page_mask) - end;
+		if (len > end)
+			len = end;
+
+		seg = pop_buf_clone(pbuf);
+		if (!seg) {
+			if (chain)
+				pop_buf_chain_free(chain);
+			return NULL;
+		}
+		seg->offset = pbuf->offset + off;
+		seg->length = len;
+
+		if (chain)
+			pop_buf_chain_append(chain, seg);
+		else
+			chain = seg;
 	}
 
-	pbuf->length += len;
-	return pop_buf_data(pbuf);
+	return chain;
 }
 
-inline void *pop_buf_trim(pop_buf_t *pbuf, size_t len)
+void pop_buf_free(pop_buf_t *pbuf)
 {
-	if (pbuf->length < len) {
-		pr_ve("failed to trim: size=%lu off=%lu length=%lu putlen=%lu",
-		      pbuf->size, pbuf->offset, pbuf->length, len);
-		return NULL;
+	pop_mem_t *mem = pbuf->mem;
+	pop_buf_t *head;
+	size_t pgoff, nr_pages;
+
+	/* the last reference releases, as other holders are done */
+	if (__atomic_sub_fetch(&pbuf->refcnt, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	if (pbuf->head) {
+		head = pbuf->head;
+		free(pbuf);
+		pop_buf_free(head);
+		return;
+	}
+
+	if (pbuf->pool) {
+		pop_pktpool_put(pbuf);
+		return;
 	}
 
-	pbuf->length -= len;
-	return pop_buf_data(pbuf);
+	pgoff = (pbuf->vaddr - mem->mem) >> PAGE_SHIFT;
+	nr_pages = pbuf->size >> PAGE_SHIFT;
+
+	pop_mem_lock(mem);
+	pop_buddy_free(mem->buddy, pgoff, nr_pages);
+	mem->alloced_pages -= nr_pages;
+	pop_mem_unlock(mem);
+
+	free(pbuf);
 }
 
-inline void *pop_buf_pull(pop_buf_t *pbuf, size_t len)
+void pop_buf_free_bulk(pop_buf_t **bufs, unsigned int n)
 {
-	if (pbuf->length < len) {
-		pr_ve("failed to pull: size=%lu off=%lu length=%lu putlen=%lu",
-		      pbuf->size, pbuf->offset, pbuf->length, len);
-		return NULL;
+	/*
+	 * release up to 64 pop_bufs of the first mem under one lock.
+	 * pop_bufs from pools, clones, and ones on other mems are
+	 * released one by one.
+	 */
+
+	pop_mem_t *mem;
+	unsigned int i, base, nr;
+	pop_buf_t *pbuf;
+	uint64_t mask;
+
+	if (n == 0)
+		return;
+
+	mem = bufs[0]->mem;
+	for (base = 0; base < n; base += 64) {
+		nr = n - base < 64 ? n - base : 64;
+		mask = 0;
+
+		for (i = 0; i < nr; i++) {
+			pbuf = bufs[base + i];
+			if (pbuf->pool || pbuf->head || pbuf->mem != mem) {
+				pop_buf_free(pbuf);
+				continue;
+			}
+			if (__atomic_sub_fetch(&pbuf->refcnt, 1,
+					       __ATOMIC_ACQ_REL) == 0)
+				mask |= 1UL << i;
+		}
+
+		if (!mask)
+			continue;
+
+		pop_mem_lock(mem);
+		for (i = 0; i < nr; i++) {
+			if (!(mask & (1UL << i)))
+				continue;
+			pbuf = bufs[base + i];
+			pop_buddy_free(mem->buddy,
+				       (pbuf->vaddr - mem->mem) >> PAGE_SHIFT,
+				       pbuf->size >> PAGE_SHIFT);
+			mem->alloced_pages -= pbuf->size >> PAGE_SHIFT;
+		}
+		pop_mem_unlock(mem);
+
+		for (i = 0; i < nr; i++) {
+			if (mask & (1UL << i))
+				free(bufs[base + i]);
+		}
+	}
+}
+
+size_t pop_buf_export(pop_buf_t *pbuf)
+{
+	size_t offset;
+
+	if (pbuf->pool || pbuf->head || pbuf->refcnt > 1) {
+		errno = EINVAL;
+		return (size_t)-1;
 	}
 
-	pbuf->length -= len;
-	pbuf->offset += len;
-	return pop_buf_data(pbuf);
+	/* the pages stay allocated until an importer frees them */
+	offset = pbuf->vaddr - pbuf->mem->mem;
+	free(pbuf);
+
+	return offset;
 }
 
-inline void *pop_buf_push(pop_buf_t *pbuf, size_t len)
+pop_buf_t *pop_buf_import(pop_mem_t *mem, size_t offset, size_t size)
 {
-	if (pbuf->offset < len) {
-		pr_ve("failed to push: size=%lu off=%lu length=%lu putlen=%lu",
-		      pbuf->size, pbuf->offset, pbuf->length, len);
+	pop_buf_t *pbuf;
+
+	if ((offset & ~PAGE_MASK) || offset + size > mem->size) {
+		pr_ve("invalid pop_buf at %lu, %lu bytes on %s",
+		      offset, size, mem->devname);
+		errno = EINVAL;
 		return NULL;
 	}
 
-	pbuf->length += len;
-	pbuf->offset -= len;
-	return pop_buf_data(pbuf);
+	pbuf = malloc(sizeof(*pbuf));
+	if (!pbuf) {
+		pr_ve("failed to allocate pop_buf structure");
+		return NULL;
+	}
+
+	memset(pbuf, 0, sizeof(*pbuf));
+	pbuf->mem	= mem;
+	pbuf->vaddr	= mem->mem + offset;
+	pbuf->paddr	= pop_virt_to_phys(mem, pbuf->vaddr);
+	pbuf->size	= (size + PAGE_SIZE - 1) & PAGE_MASK;
+	pbuf->offset	= 0;
+	pbuf->length	= 0;
+	pbuf->refcnt	= 1;
+
+	return pbuf;
 }
 
-inline size_t pop_buf_len(pop_buf_t *pbuf)
+/* external definitions of the accessors in libpop_inline.h */
+extern void *pop_buf_data(pop_buf_t *pbuf);
+extern size_t pop_buf_len(pop_buf_t *pbuf);
+extern unsigned int pop_buf_refcnt(pop_buf_t *pbuf);
+extern uintptr_t pop_virt_to_phys(pop_mem_t *mem, void *vaddr);
+extern uintptr_t pop_buf_paddr(pop_buf_t *pbuf);
+extern void *pop_buf_put(pop_buf_t *pbuf, size_t len);
+extern void *pop_buf_trim(pop_buf_t *pbuf, size_t len);
+extern void *pop_buf_pull(pop_buf_t *pbuf, size_t len);
+extern void *pop_buf_push(pop_buf_t *pbuf, size_t len);
+
+void __pop_buf_check_failed(const char *op, pop_buf_t *pbuf, size_t len)
 {
-	return pbuf->length - pbuf->offset;
+	pr_ve("failed to %s: size=%lu off=%lu length=%lu len=%lu",
+	      op, pbuf->size, pbuf->offset, pbuf->length, len);
 }
 
-inline uintptr_t pop_virt_to_phys(pop_mem_t *mem, void *vaddr)
+void __pop_virt_check_failed(pop_mem_t *mem, void *vaddr)
 {
-	/*
-	 * pop_virt_to_phys() returns physical addr of vaddr in
-	 * pop memory region without heavy calculation.
-	 */
-
-	if (vaddr < mem->mem || vaddr > (mem->mem + mem->size)) {
-		pr_ve("not a pop memory region!");
-		return 0;
-	}
-
-	return mem->paddr + (vaddr - mem->mem);
+	pr_ve("%p is not in pop memory region %s", vaddr, mem->devname);
 }
 
 /* for debaug use */
@@ -343,6 +650,8 @@ void print_pop_buf(pop_buf_t *pbuf)
 	fprintf(stderr, "size:             %lu\n", pbuf->size);
 	fprintf(stderr, "offset:           %lu\n", pbuf->offset);
 	fprintf(stderr, "length:           %lu\n", pbuf->length);
+	fprintf(stderr, "refcnt:           %u%s\n", pbuf->refcnt,
+		pbuf->head ? " (clone)" : "");
 }
 
 
@@ -3,6 +3,7 @@
 #define _LIBPOP_UTIL_H_
 
 #include <stdio.h>
+#include <time.h>
 
 extern int libpop_verbose;
 
@@ -26,5 +27,13 @@ extern int libpop_verbose;
 #define pr_ve(fmt, ...)					\
 	if (libpop_verbose) { pr_e(fmt, ##__VA_ARGS__); }
 
+/* monotonic clock in usec for measuring phases */
+static inline unsigned long libpop_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
 
 #endif /* _LIBPOP_UTIL_H_ */
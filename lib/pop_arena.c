@@ -0,0 +1,140 @@
+/* pop_arena.c: per-thread sub-regions split from a pop_mem_t */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <x86_64-linux-gnu/sys/user.h>
+
+#define PROGNAME "libpop-arena"
+
+#include <libpop.h>
+#include <libpop_util.h>
+
+#define ALIGN_UP(x, a)	(((x) + (a) - 1) & ~((a) - 1))
+
+pop_arena_t *pop_mem_split(pop_mem_t *mem, unsigned int n, size_t size)
+{
+	/*
+	 * arenas are page-aligned slices of one pop_buf, so that an
+	 * arena never shares a page (and a cache line) with others.
+	 */
+
+	pop_arena_t *arenas;
+	pop_buf_t *pbuf;
+	unsigned int i;
+
+	if (n == 0 || size == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	size = ALIGN_UP(size, PAGE_SIZE);
+
+	if (posix_memalign((void **)&arenas, POP_ARENA_ALIGN,
+			   sizeof(*arenas) * n) != 0) {
+		pr_ve("failed to allocate %u arenas", n);
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(arenas, 0, sizeof(*arenas) * n);
+
+	pbuf = pop_buf_alloc(mem, size * n);
+	if (!pbuf) {
+		pr_ve("failed to allocate %u x %lu bytes on %s",
+		      n, size, mem->devname);
+		free(arenas);
+		return NULL;
+	}
+	pop_buf_put(pbuf, size * n);
+
+	for (i = 0; i < n; i++) {
+		arenas[i].mem = mem;
+		arenas[i].pbuf = pbuf;
+		arenas[i].nr_arenas = n;
+		arenas[i].index = i;
+		arenas[i].base = (char *)pop_buf_data(pbuf) + size * i;
+		arenas[i].size = size;
+	}
+
+	pr_vs("split %u x %lu-byte arenas from %s at %p",
+	      n, size, mem->devname, pop_buf_data(pbuf));
+
+	return arenas;
+}
+
+void pop_mem_unsplit(pop_arena_t *arenas)
+{
+	pop_buf_free(arenas[0].pbuf);
+	free(arenas);
+}
+
+static void arena_check_owner(pop_arena_t *a)
+{
+#ifdef POP_DEBUG
+	if (!a->owned) {
+		pop_arena_bind(a);
+		return;
+	}
+
+	if (!pthread_equal(a->owner, pthread_self())) {
+		pr_e("arena %u on %s is owned by another thread",
+		     a->index, a->mem->devname);
+		abort();
+	}
+#endif
+}
+
+void *pop_arena_alloc_align(pop_arena_t *a, size_t size, size_t align)
+{
+	size_t off;
+
+	arena_check_owner(a);
+
+	off = ALIGN_UP(a->used, align);
+	if (size > a->size || off > a->size - size) {
+		a->stat.fails++;
+		errno = ENOBUFS;
+		return NULL;
+	}
+
+	a->used = off + size;
+	a->stat.allocs++;
+	a->stat.used = a->used;
+	if (a->used > a->stat.peak)
+		a->stat.peak = a->used;
+
+	return a->base + off;
+}
+
+void *pop_arena_alloc(pop_arena_t *a, size_t size)
+{
+	return pop_arena_alloc_align(a, size, POP_ARENA_ALIGN);
+}
+
+void pop_arena_reset(pop_arena_t *a)
+{
+	arena_check_owner(a);
+
+	a->used = 0;
+	a->stat.used = 0;
+	a->stat.resets++;
+}
+
+void pop_arena_bind(pop_arena_t *a)
+{
+	/* hand the arena over to the calling thread */
+	a->owner = pthread_self();
+	a->owned = 1;
+}
+
+void pop_arena_stat(pop_arena_t *a, struct pop_arena_stat *stat)
+{
+	/* the owner updates stat without atomics; values may be stale */
+	stat->allocs = __atomic_load_n(&a->stat.allocs, __ATOMIC_RELAXED);
+	stat->fails = __atomic_load_n(&a->stat.fails, __ATOMIC_RELAXED);
+	stat->resets = __atomic_load_n(&a->stat.resets, __ATOMIC_RELAXED);
+	stat->used = __atomic_load_n(&a->stat.used, __ATOMIC_RELAXED);
+	stat->peak = __atomic_load_n(&a->stat.peak, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,186 @@
+/* pop_buddy.c: page-granular buddy allocator */
+
+#include <string.h>
+
+#include <pop_buddy.h>
+
+#define BUDDY_FREE	0x80	/* state of the head page of a free block */
+
+static inline uint32_t *buddy_next(struct pop_buddy *b)
+{
+	return (uint32_t *)(b + 1);
+}
+
+static inline uint32_t *buddy_prev(struct pop_buddy *b)
+{
+	return buddy_next(b) + b->nr_pages;
+}
+
+static inline uint8_t *buddy_state(struct pop_buddy *b)
+{
+	return (uint8_t *)(buddy_prev(b) + b->nr_pages);
+}
+
+static void buddy_list_add(struct pop_buddy *b, uint32_t pg, unsigned int o)
+{
+	uint32_t *next = buddy_next(b), *prev = buddy_prev(b);
+	uint32_t head = b->free_head[o];
+
+	next[pg] = head;
+	prev[pg] = POP_BUDDY_NIL;
+	if (head != POP_BUDDY_NIL)
+		prev[head] = pg;
+	b->free_head[o] = pg;
+	buddy_state(b)[pg] = BUDDY_FREE | o;
+}
+
+static void buddy_list_del(struct pop_buddy *b, uint32_t pg, unsigned int o)
+{
+	uint32_t *next = buddy_next(b), *prev = buddy_prev(b);
+
+	if (prev[pg] != POP_BUDDY_NIL)
+		next[prev[pg]] = next[pg];
+	else
+		b->free_head[o] = next[pg];
+
+	if (next[pg] != POP_BUDDY_NIL)
+		prev[next[pg]] = prev[pg];
+
+	buddy_state(b)[pg] = 0;
+}
+
+size_t pop_buddy_size(size_t nr_pages)
+{
+	return sizeof(struct pop_buddy) +
+		nr_pages * (sizeof(uint32_t) * 2 + sizeof(uint8_t));
+}
+
+void pop_buddy_init(struct pop_buddy *b, size_t nr_pages)
+{
+	unsigned int o;
+
+	memset(b, 0, pop_buddy_size(nr_pages));
+	b->nr_pages = nr_pages;
+	b->nr_free = 0;
+
+	for (o = 0; o < POP_BUDDY_MAX_ORDER &&
+		     ((size_t)1 << (o + 1)) <= nr_pages; o++);
+	b->max_order = o;
+
+	for (o = 0; o <= POP_BUDDY_MAX_ORDER; o++)
+		b->free_head[o] = POP_BUDDY_NIL;
+}
+
+static void buddy_free_block(struct pop_buddy *b, uint32_t pg, unsigned int o)
+{
+	uint8_t *state = buddy_state(b);
+	uint32_t buddy;
+
+	b->nr_free += (size_t)1 << o;
+
+	/* merge with the buddy as long as it is free at the same order */
+	while (o < b->max_order) {
+		buddy = pg ^ ((uint32_t)1 << o);
+		if (buddy >= b->nr_pages || state[buddy] != (BUDDY_FREE | o))
+			break;
+
+		buddy_list_del(b, buddy, o);
+		pg &= buddy;
+		o++;
+	}
+
+	buddy_list_add(b, pg, o);
+}
+
+void pop_buddy_free(struct pop_buddy *b, size_t pgoff, size_t nr_pages)
+{
+	unsigned int o;
+
+	/* split the range into naturally aligned power-of-two blocks */
+	while (nr_pages > 0) {
+		for (o = 0; o < b->max_order; o++) {
+			if (pgoff & ((size_t)1 << o) ||
+			    ((size_t)1 << (o + 1)) > nr_pages)
+				break;
+		}
+
+		buddy_free_block(b, pgoff, o);
+		pgoff += (size_t)1 << o;
+		nr_pages -= (size_t)1 << o;
+	}
+}
+
+static long buddy_alloc_run(struct pop_buddy *b, size_t nr_pages)
+{
+	/*
+	 * no free block of the order covers nr_pages, e.g., on a region
+	 * whose size is not a power of two. find a run of adjacent free
+	 * blocks instead. free blocks are naturally aligned, so walking
+	 * allocated pages one by one lands on the head of the next one.
+	 */
+	uint8_t *state = buddy_state(b);
+	size_t pg, start = 0, run = 0;
+	unsigned int o;
+
+	for (pg = 0; pg < b->nr_pages && run < nr_pages; ) {
+		if (!(state[pg] & BUDDY_FREE)) {
+			start = ++pg;
+			run = 0;
+			continue;
+		}
+		o = state[pg] & ~BUDDY_FREE;
+		run += (size_t)1 << o;
+		pg += (size_t)1 << o;
+	}
+	if (run < nr_pages)
+		return -1;
+
+	for (pg = start; pg < start + run; pg += (size_t)1 << o) {
+		o = state[pg] & ~BUDDY_FREE;
+		buddy_list_del(b, pg, o);
+		b->nr_free -= (size_t)1 << o;
+	}
+
+	/* give back the tail of the last block */
+	if (run > nr_pages)
+		pop_buddy_free(b, start + nr_pages, run - nr_pages);
+
+	return start;
+}
+
+long pop_buddy_alloc(struct pop_buddy *b, size_t nr_pages)
+{
+	unsigned int o, k;
+	uint32_t pg;
+
+	if (nr_pages == 0 || nr_pages > b->nr_free)
+		return -1;
+
+	for (o = 0; ((size_t)1 << o) < nr_pages; o++);
+	if (o > b->max_order)
+		return buddy_alloc_run(b, nr_pages);
+
+	for (k = o; k <= b->max_order; k++) {
+		if (b->free_head[k] != POP_BUDDY_NIL)
+			break;
+	}
+	if (k > b->max_order)
+		return buddy_alloc_run(b, nr_pages);
+
+	pg = b->free_head[k];
+	buddy_list_del(b, pg, k);
+	b->nr_free -= (size_t)1 << k;
+
+	/* split the block, and put the upper halves back */
+	while (k > o) {
+		k--;
+		buddy_list_add(b, pg + ((uint32_t)1 << k), k);
+		b->nr_free += (size_t)1 << k;
+	}
+
+	/* give back the tail pages that the caller does not need */
+	if (nr_pages < ((size_t)1 << o))
+		pop_buddy_free(b, pg + nr_pages, ((size_t)1 << o) - nr_pages);
+
+	return pg;
+}
@@ -0,0 +1,51 @@
+/*
+ * pop_buddy.h: page-granular buddy allocator for pop memory regions.
+ *
+ * This is internal to libpop. pop_mem_t manages its mmaped region
+ * in PAGE_SIZE units through struct pop_buddy, so that pop_buf_free()
+ * returns pages to the region and freed neighbors are coalesced.
+ */
+
+#ifndef _POP_BUDDY_H_
+#define _POP_BUDDY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define POP_BUDDY_MAX_ORDER	31
+#define POP_BUDDY_NIL		((uint32_t)-1)
+
+/*
+ * struct pop_buddy is followed by per-page arrays (next, prev and
+ * state). They are addressed by offsets from the structure, not
+ * pointers, so the whole allocator is a single position-independent
+ * block of memory of pop_buddy_size() bytes.
+ */
+struct pop_buddy {
+	size_t		nr_pages;	/* # of pages managed by this	*/
+	size_t		nr_free;	/* # of free pages		*/
+	unsigned int	max_order;	/* largest order fits nr_pages	*/
+
+	/* head page of free list for each order */
+	uint32_t	free_head[POP_BUDDY_MAX_ORDER + 1];
+};
+
+size_t pop_buddy_size(size_t nr_pages);
+
+/* pop_buddy_init: initialize the allocator on a pop_buddy_size()
+ * bytes of memory. All pages are initially allocated. Pages are given
+ * to the allocator by pop_buddy_free(). */
+void pop_buddy_init(struct pop_buddy *b, size_t nr_pages);
+
+/* pop_buddy_alloc: allocate nr_pages contiguous pages. The returned
+ * page offset is aligned to the power of two equal to or larger than
+ * nr_pages if a free block of that order exists. Otherwise, a run of
+ * adjacent free blocks is taken without the alignment, so that a
+ * region of any size can be allocated at once. -1 is returned when
+ * there is no enough contiguous free pages. */
+long pop_buddy_alloc(struct pop_buddy *b, size_t nr_pages);
+
+/* pop_buddy_free: return nr_pages pages from pgoff to the allocator */
+void pop_buddy_free(struct pop_buddy *b, size_t pgoff, size_t nr_pages);
+
+#endif /* _POP_BUDDY_H_ */
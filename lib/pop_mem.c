@@ -0,0 +1,966 @@
+/* pop_mem.c: memory backends for pop_mem_t */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <x86_64-linux-gnu/sys/user.h>
+
+#define PROGNAME "libpop-mem"
+
+#include <libpop.h>
+#include <libpop_util.h>
+#include <pop_mem.h>
+
+#define DEVPOP		"/dev/boogiepop"
+
+#define HUGEPAGES_SYSFS	"/sys/kernel/mm/hugepages/hugepages-%lukB/%s"
+#define HUGEPAGE_SHIFT_2MB	21
+#define HUGEPAGE_SHIFT_1GB	30
+
+#define HUGETLBFS_MOUNT	"/mnt/hugepages"
+
+#define NODE_CPULIST	"/sys/devices/system/node/node%d/cpulist"
+#define NODE_ONLINE	"/sys/devices/system/node/online"
+#define NET_NUMA_NODE	"/sys/class/net/%s/device/numa_node"
+#define PCI_NUMA_NODE	"/sys/bus/pci/devices/%04x:%02x:%02x.%x/numa_node"
+
+/* default size for memfd and anon, which have no notion of 'all' */
+#define POP_MEM_DEFAULT_SIZE	(64 * 1024 * 1024)
+
+#define PAGEMAP_PFN_MASK	0x7fffffffffffffULL
+#define PAGEMAP_PRESENT		(1ULL << 63)
+#define PAGEMAP_BATCH		512	/* entries per pread() */
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE	0x100000
+#endif
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED	1	/* from linux/mempolicy.h */
+#endif
+
+#define ALIGN_UP(x, a)	(((x) + (a) - 1) & ~((a) - 1))
+
+
+/* helpers shared by backends */
+
+static void *reserve_region(size_t size, size_t align)
+{
+	/* reserve virtual address space aligned to align. backends
+	 * map pages on it with MAP_FIXED */
+
+	uintptr_t p, aligned;
+
+	p = (uintptr_t)mmap(0, size + align, PROT_NONE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			    -1, 0);
+	if ((void *)p == MAP_FAILED)
+		return MAP_FAILED;
+
+	aligned = ALIGN_UP(p, align);
+	if (aligned > p)
+		munmap((void *)p, aligned - p);
+	munmap((void *)(aligned + size), p + align - aligned);
+
+	return (void *)aligned;
+}
+
+static void unreserve_region(pop_mem_t *mem, size_t off, size_t len)
+{
+	/* put back a range that failed to be mapped to the reservation */
+	mmap(mem->mem + off, len, PROT_NONE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+}
+
+static int translate_pagemap(pop_mem_t *mem, size_t off, size_t len)
+{
+	/*
+	 * fill the physical addresses of pages whose size is 1 <<
+	 * mem->page_shift in [off, off + len). pagemap has an entry per
+	 * 4KB, and only the first entry of each page is read: batches of
+	 * consecutive entries for 4KB pages, one entry per hugepage.
+	 */
+
+	int fd;
+	size_t n, i, nr, first, last, stride, missing = 0;
+	uint64_t entries[PAGEMAP_BATCH], e;
+	ssize_t ret;
+
+	first = off >> mem->page_shift;
+	last = (off + len - 1) >> mem->page_shift;
+	stride = 1 << (mem->page_shift - PAGE_SHIFT);
+
+	fd = open("/proc/self/pagemap", O_RDONLY);
+	if (fd < 0) {
+		pr_ve("open /proc/self/pagemap: %s", strerror(errno));
+		return -1;
+	}
+
+	for (n = first; n <= last; n += nr) {
+		nr = 1;
+		if (stride == 1)
+			nr = last - n + 1 < PAGEMAP_BATCH ?
+				last - n + 1 : PAGEMAP_BATCH;
+
+		ret = pread(fd, entries, nr * sizeof(uint64_t),
+			    (((uintptr_t)mem->mem + (n << mem->page_shift)) >>
+			     PAGE_SHIFT) * sizeof(uint64_t));
+		if (ret < (ssize_t)(nr * sizeof(uint64_t))) {
+			pr_ve("pread for /proc/self/pagemap: %s",
+			      strerror(errno));
+			close(fd);
+			return -1;
+		}
+
+		for (i = 0; i < nr; i++) {
+			e = entries[i];
+			if (!(e & PAGEMAP_PRESENT) || !(e & PAGEMAP_PFN_MASK)) {
+				mem->paddrs[n + i] = 0;
+				missing++;
+				continue;
+			}
+			mem->paddrs[n + i] =
+				(e & PAGEMAP_PFN_MASK) << PAGE_SHIFT;
+		}
+	}
+	close(fd);
+
+	/* pfn is 0 without CAP_SYS_ADMIN. it is ok for stand-ins */
+	if (missing)
+		pr_ve("no pfn for %lu of %lu pages on %s", missing,
+		      last - first + 1, mem->devname);
+
+	return 0;
+}
+
+/* NUMA */
+
+static int parse_list(const char *path, cpu_set_t *set)
+{
+	/* parse a list of cpus or nodes, e.g., "0-7,16-23" */
+	FILE *fp;
+	int first, last, n, ret = -1;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		pr_ve("failed to open %s", path);
+		return -1;
+	}
+
+	CPU_ZERO(set);
+	while (fscanf(fp, "%d", &first) == 1) {
+		last = first;
+		if (fscanf(fp, "-%d", &last) < 0)
+			break;
+		for (n = first; n <= last && n < CPU_SETSIZE; n++)
+			CPU_SET(n, set);
+		ret = 0;
+		if (fgetc(fp) != ',')
+			break;
+	}
+	fclose(fp);
+
+	return ret;
+}
+
+static int node_cpuset(int node, cpu_set_t *set)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), NODE_CPULIST, node);
+	return parse_list(path, set);
+}
+
+static int current_node(void)
+{
+	unsigned int cpu, node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+		return -1;
+	return node;
+}
+
+static int read_numa_node(const char *path)
+{
+	/* -1 when the platform does not tell */
+	FILE *fp;
+	int node = -1;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	if (fscanf(fp, "%d", &node) != 1)
+		node = -1;
+	fclose(fp);
+
+	return node;
+}
+
+static int pci_numa_node(int domain, int bus, int slot, int func)
+{
+	char path[128];
+
+	snprintf(path, sizeof(path), PCI_NUMA_NODE, domain, bus, slot, func);
+	return read_numa_node(path);
+}
+
+int pop_numa_node(const char *dev)
+{
+	/* dev is a PCI slot, or a (netmap) interface name */
+
+	int domain = 0, bus, slot, func;
+	char ifname[32], path[128];
+	size_t len;
+
+	if (sscanf(dev, "%x:%x:%x.%x", &domain, &bus, &slot, &func) == 4 ||
+	    sscanf(dev, "%x:%x.%x", &bus, &slot, &func) == 3)
+		return pci_numa_node(domain, bus, slot, func);
+
+	/* netmap:eth0-1, netmap:eth0@conf, and so on */
+	if (strncmp(dev, "netmap:", 7) == 0)
+		dev += 7;
+	len = strcspn(dev, "-*^{}/@");
+	if (len == 0 || len >= sizeof(ifname))
+		return -1;
+	memcpy(ifname, dev, len);
+	ifname[len] = '\0';
+
+	snprintf(path, sizeof(path), NET_NUMA_NODE, ifname);
+	return read_numa_node(path);
+}
+
+int pop_numa_current_node(void)
+{
+	return current_node();
+}
+
+
+/* parallel prefault */
+
+struct prefault_arg {
+	pthread_t	tid;
+	char		*start;
+	size_t		len;
+	size_t		stride;
+	cpu_set_t	*cpuset;	/* NULL means no binding	*/
+};
+
+static void *prefault_thread(void *arg)
+{
+	struct prefault_arg *pa = arg;
+	volatile char *p;
+
+	if (pa->cpuset)
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+				       pa->cpuset);
+
+	/* write back what we read, so that p2pmem keeps its content */
+	for (p = pa->start; p < pa->start + pa->len; p += pa->stride)
+		*p = *p;
+
+	return NULL;
+}
+
+static int prefault_region(pop_mem_t *mem, size_t off, size_t len)
+{
+	/*
+	 * fault pages of [off, off + len) in on mem->prefault_threads
+	 * threads bound to the node of the memory, and then lock
+	 * them. hugepages are allocated on the node of the faulting
+	 * thread, so that threads run on the node of the caller when
+	 * the node of the memory is unknown.
+	 */
+
+	struct prefault_arg *args;
+	cpu_set_t cpuset, *pcpuset = NULL;
+	size_t nr_pages, per_thread;
+	unsigned int n, nthreads;
+	int node;
+	unsigned long start = libpop_usec();
+
+	nr_pages = len / mem->pagesize;
+	nthreads = mem->prefault_threads;
+	if (nthreads > nr_pages)
+		nthreads = nr_pages;
+	if (nthreads == 0)
+		nthreads = 1;
+
+	args = calloc(nthreads, sizeof(*args));
+	if (!args) {
+		pr_ve("failed to allocate args for %u threads", nthreads);
+		return -1;
+	}
+
+	node = mem->numa_node >= 0 ? mem->numa_node : current_node();
+	if (node >= 0 && node_cpuset(node, &cpuset) == 0)
+		pcpuset = &cpuset;
+
+	per_thread = nr_pages / nthreads;
+	for (n = 0; n < nthreads; n++) {
+		args[n].start = (char *)mem->mem + off +
+			n * per_thread * mem->pagesize;
+		args[n].len = (n == nthreads - 1 ?
+			       nr_pages - n * per_thread : per_thread) *
+			mem->pagesize;
+		args[n].stride = mem->pagesize;
+		args[n].cpuset = pcpuset;
+
+		/* fault in on this thread if no thread is available */
+		if (pthread_create(&args[n].tid, NULL,
+				   prefault_thread, &args[n]) != 0) {
+			prefault_thread(&args[n]);
+			args[n].tid = 0;
+		}
+	}
+
+	for (n = 0; n < nthreads; n++) {
+		if (args[n].tid)
+			pthread_join(args[n].tid, NULL);
+	}
+	free(args);
+
+	/* all pages are present. mlock just pins them */
+	if (mlock(mem->mem + off, len) < 0)
+		pr_ve("failed to mlock %lu bytes on %s: %s",
+		      len, mem->devname, strerror(errno));
+
+	pr_vs("prefault %lu bytes on %u threads on node %d: %lu usec",
+	      len, nthreads, node, libpop_usec() - start);
+
+	return 0;
+}
+
+static int populate_region(pop_mem_t *mem, size_t off, size_t len)
+{
+	/*
+	 * fault [off, off + len) in on mem->numa_node, and lock it so
+	 * that physical addresses do not change. MPOL_PREFERRED falls
+	 * back to other nodes instead of SIGBUS on hugepage shortage.
+	 */
+
+	unsigned long nodemask;
+	struct prefault_arg pa;
+
+	if (mem->numa_node >= 0 && mem->numa_node < 64) {
+		/* maxnode counts the bits of nodemask plus one */
+		nodemask = 1UL << mem->numa_node;
+		if (syscall(SYS_mbind, mem->mem + off, len, MPOL_PREFERRED,
+			    &nodemask, mem->numa_node + 2, 0) < 0)
+			pr_ve("failed to bind %lu bytes to node %d: %s",
+			      len, mem->numa_node, strerror(errno));
+	}
+
+	if (mem->prefault_threads > 1)
+		return prefault_region(mem, off, len);
+
+	/* mlock faults pages in like MAP_LOCKED */
+	if (mlock(mem->mem + off, len) < 0) {
+		pr_ve("failed to mlock %lu bytes on %s: %s",
+		      len, mem->devname, strerror(errno));
+		pa.start = (char *)mem->mem + off;
+		pa.len = len;
+		pa.stride = mem->pagesize;
+		pa.cpuset = NULL;
+		prefault_thread(&pa);
+	}
+
+	return 0;
+}
+
+static int attach_file(pop_mem_t *mem)
+{
+	/* map mem->path at mem->mem. the pages already exist */
+	void *p;
+
+	mem->fd = open(mem->path, O_RDWR);
+	if (mem->fd < 0) {
+		pr_ve("failed to open %s: %s", mem->path, strerror(errno));
+		return -1;
+	}
+
+	p = mmap(mem->mem, mem->size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED_NOREPLACE | MAP_POPULATE | MAP_LOCKED,
+		 mem->fd, 0);
+	if (p != mem->mem) {
+		/* a kernel without MAP_FIXED_NOREPLACE maps elsewhere */
+		pr_ve("failed to mmap %s at %p: %s", mem->path, mem->mem,
+		      p == MAP_FAILED ? strerror(errno) : "address in use");
+		if (p != MAP_FAILED)
+			munmap(p, mem->size);
+		close(mem->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int exit_region(pop_mem_t *mem)
+{
+	int ret;
+
+	ret = munmap(mem->mem, mem->size);
+	if (ret != 0)
+		pr_ve("failed to munmap on %s", mem->devname);
+
+	if (mem->fd != -1)
+		close(mem->fd);
+
+	return ret;
+}
+
+
+/* hugepage: anonymous hugepages, 2MB or 1GB */
+
+static long get_hugepages(unsigned int shift, const char *param)
+{
+	/* param is nr_hugepages or free_hugepages */
+	int fd;
+	char path[128], buf[16];
+	ssize_t ret;
+
+	snprintf(path, sizeof(path), HUGEPAGES_SYSFS,
+		 (1UL << shift) >> 10, param);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		pr_ve("failed to open %s", path);
+		return -1;
+	}
+
+	ret = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (ret < 0) {
+		pr_ve("failed to read %s", path);
+		return -1;
+	}
+	buf[ret] = '\0';
+
+	return atol(buf);
+}
+
+static unsigned int select_hugepage_shift(char *dev, size_t size)
+{
+	/*
+	 * "hugepage:2M" and "hugepage:1G" specify the hugepage size.
+	 * Otherwise, 1GB pages are used when size is at least 1GB and
+	 * enough free 1GB pages exist, or 2MB pages. When size is 0,
+	 * 2MB pages are used unless no 2MB hugepage is reserved.
+	 */
+
+	long nr_2m, nr_1g;
+
+	if (dev && strcmp(dev, "hugepage:2M") == 0)
+		return HUGEPAGE_SHIFT_2MB;
+	if (dev && strcmp(dev, "hugepage:1G") == 0)
+		return HUGEPAGE_SHIFT_1GB;
+
+	if (size == 0) {
+		nr_2m = get_hugepages(HUGEPAGE_SHIFT_2MB, "nr_hugepages");
+		nr_1g = get_hugepages(HUGEPAGE_SHIFT_1GB, "nr_hugepages");
+		return (nr_2m <= 0 && nr_1g > 0) ?
+			HUGEPAGE_SHIFT_1GB : HUGEPAGE_SHIFT_2MB;
+	}
+
+	nr_2m = get_hugepages(HUGEPAGE_SHIFT_2MB, "free_hugepages");
+	nr_1g = get_hugepages(HUGEPAGE_SHIFT_1GB, "free_hugepages");
+
+	if (size >= (1UL << HUGEPAGE_SHIFT_1GB) &&
+	    nr_1g >= (long)((size + (1UL << HUGEPAGE_SHIFT_1GB) - 1) >>
+			    HUGEPAGE_SHIFT_1GB))
+		return HUGEPAGE_SHIFT_1GB;
+
+	if (nr_2m < (long)((size + (1UL << HUGEPAGE_SHIFT_2MB) - 1) >>
+			   HUGEPAGE_SHIFT_2MB) && nr_1g > 0 &&
+	    nr_1g >= (long)((size + (1UL << HUGEPAGE_SHIFT_1GB) - 1) >>
+			    HUGEPAGE_SHIFT_1GB))
+		return HUGEPAGE_SHIFT_1GB;
+
+	return HUGEPAGE_SHIFT_2MB;
+}
+
+static int hugepage_grow(pop_mem_t *mem, size_t off, size_t len)
+{
+	void *p;
+	int flags;
+
+	/* hugepages are reserved at mmap, and allocated at fault */
+	flags = (MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_FIXED |
+		 (mem->page_shift << MAP_HUGE_SHIFT));
+
+	p = mmap(mem->mem + off, len, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (p == MAP_FAILED) {
+		pr_ve("failed to mmap %lu-byte hugepages: %s",
+		      len, strerror(errno));
+		unreserve_region(mem, off, len);
+		return -1;
+	}
+
+	return populate_region(mem, off, len);
+}
+
+static int hugepage_init(pop_mem_t *mem, char *dev, size_t size)
+{
+	long nr_pages;
+	unsigned int shift;
+
+	strncpy(mem->devname, "hugepage", POP_PCI_DEVNAME_MAX);
+
+	shift = select_hugepage_shift(dev, size);
+	nr_pages  = get_hugepages(shift, "nr_hugepages");
+	if (nr_pages < 0) {
+		pr_ve("failed to get num of hugepages");
+		return -1;
+	}
+
+	/* use size if size is not 0, or hugepages / 4. a growable
+	 * region reserves address space for all hugepages */
+	mem->pagesize = 1UL << shift;
+	mem->page_shift = shift;
+	if (size == 0 && mem->grow_chunk)
+		size = (nr_pages > 0 ? nr_pages : 1) << shift;
+	else if (size == 0)
+		size = (nr_pages > 4 ? nr_pages / 4 : 1) << shift;
+	mem->size = ALIGN_UP(size, mem->pagesize);
+
+	mem->mem = reserve_region(mem->size, mem->pagesize);
+	if (mem->mem == MAP_FAILED) {
+		pr_ve("failed to reserve %lu bytes", mem->size);
+		return -1;
+	}
+
+	return 0;
+}
+
+const struct pop_mem_ops pop_mem_hugepage_ops = {
+	.name		= "hugepage",
+	.init		= hugepage_init,
+	.exit		= exit_region,
+	.translate	= translate_pagemap,
+	.grow		= hugepage_grow,
+};
+
+
+/* p2pmem: /dev/pop/PCI_DEV registered through /dev/boogiepop */
+
+static int p2pmem_init(pop_mem_t *mem, char *dev, size_t size)
+{
+	int ret, fd;
+
+	/* pop device. register it through /dev/pop/pop */
+	strncpy(mem->devname, dev, POP_PCI_DEVNAME_MAX);
+	ret = sscanf(dev, "%x:%x:%x.%x",
+		     &mem->reg.domain, &mem->reg.bus,
+		     &mem->reg.slot, &mem->reg.func);
+	if (ret < 4) {
+		mem->reg.domain = 0;
+		ret = sscanf(dev, "%x:%x.%x",
+			     &mem->reg.bus,
+			     &mem->reg.slot, &mem->reg.func);
+	}
+	if (ret < 3) {
+		pr_ve("invalid pci slot %s", dev);
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = open(DEVPOP, O_RDWR);
+	if (fd < 0) {
+		pr_ve("failed to open %s", DEVPOP);
+		return -1;
+	}
+
+	mem->reg.size = size;
+	ret = ioctl(fd, POP_P2PMEM_REG, &mem->reg);
+	if (ret != 0) {
+		pr_ve("failed to register p2pmem on %s", dev);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	/* open /dev/pop/PCI_DEV for mmap() */
+	snprintf(mem->path, sizeof(mem->path), "/dev/pop/%04x:%02x:%02x.%x",
+		 mem->reg.domain, mem->reg.bus,
+		 mem->reg.slot, mem->reg.func);
+	mem->fd = open(mem->path, O_RDWR);
+	if (mem->fd < 0) {
+		pr_ve("failed to open %s", mem->path);
+		return -1;
+	}
+
+	/* p2pmem is a physically contiguous region */
+	mem->pagesize = PAGE_SIZE;
+	mem->page_shift = 63;
+	mem->size = mem->reg.size;
+
+	mem->numa_node = pci_numa_node(mem->reg.domain, mem->reg.bus,
+				       mem->reg.slot, mem->reg.func);
+
+	/* XXX: handle offset */
+	mem->mem = mmap(0, mem->size, PROT_READ | PROT_WRITE,
+			(mem->prefault_threads > 1 ? 0 : MAP_LOCKED) |
+			MAP_SHARED, mem->fd, 0);
+	if (mem->mem == MAP_FAILED) {
+		pr_ve("failed to mmap on %s", mem->devname);
+		close(mem->fd);
+		return -1;
+	}
+
+	/* each 4KB page faults through the driver */
+	if (mem->prefault_threads > 1)
+		return prefault_region(mem, 0, mem->size);
+
+	return 0;
+}
+
+static int p2pmem_exit(pop_mem_t *mem)
+{
+	/* unregister dev and its p2pmem through /dev/pop/pop */
+
+	int ret, fd;
+
+	munmap(mem->mem, mem->size);
+
+	fd = open(DEVPOP, O_RDWR);
+	if (fd < 0) {
+		pr_ve("failed to open %s", DEVPOP);
+		return -1;
+	}
+
+	ret = ioctl(fd, POP_P2PMEM_UNREG, &mem->reg);
+	close(fd);
+	if (ret != 0) {
+		pr_ve("failed to unregister %s", mem->devname);
+		return -1;
+	}
+
+	return close(mem->fd);
+}
+
+static int p2pmem_translate(pop_mem_t *mem, size_t off, size_t len)
+{
+	mem->paddrs[0] = virt_to_phys(mem->mem);
+	return mem->paddrs[0] ? 0 : -1;
+}
+
+const struct pop_mem_ops pop_mem_p2pmem_ops = {
+	.name		= "p2pmem",
+	.init		= p2pmem_init,
+	.exit		= p2pmem_exit,
+	.translate	= p2pmem_translate,
+	.grow		= NULL,
+	.attach		= attach_file,
+};
+
+
+/*
+ * memfd, anon, and hugetlbfs: stand-ins for p2pmem and hugepage.
+ * memfd and anon need neither hugepages nor root. Their pages are 4KB,
+ * and physical addresses are valid only with CAP_SYS_ADMIN.
+ */
+
+static int file_grow(pop_mem_t *mem, size_t off, size_t len)
+{
+	void *p;
+
+	if (ftruncate(mem->fd, off + len) < 0) {
+		pr_ve("failed to extend %s to %lu bytes: %s",
+		      mem->devname, off + len, strerror(errno));
+		return -1;
+	}
+
+	p = mmap(mem->mem + off, len, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, mem->fd, off);
+	if (p == MAP_FAILED) {
+		pr_ve("failed to mmap %lu bytes on %s: %s",
+		      len, mem->devname, strerror(errno));
+		unreserve_region(mem, off, len);
+		return -1;
+	}
+
+	return populate_region(mem, off, len);
+}
+
+static int file_reserve(pop_mem_t *mem, size_t size)
+{
+	mem->size = ALIGN_UP(size, mem->pagesize);
+
+	mem->mem = reserve_region(mem->size, mem->pagesize);
+	if (mem->mem == MAP_FAILED) {
+		pr_ve("failed to reserve %lu bytes", mem->size);
+		close(mem->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int memfd_init(pop_mem_t *mem, char *dev, size_t size)
+{
+	strncpy(mem->devname, "memfd", POP_PCI_DEVNAME_MAX);
+
+	mem->fd = memfd_create("libpop", MFD_CLOEXEC);
+	if (mem->fd < 0) {
+		pr_ve("memfd_create: %s", strerror(errno));
+		return -1;
+	}
+
+	mem->pagesize = PAGE_SIZE;
+	mem->page_shift = PAGE_SHIFT;
+
+	return file_reserve(mem, size ? size : POP_MEM_DEFAULT_SIZE);
+}
+
+const struct pop_mem_ops pop_mem_memfd_ops = {
+	.name		= "memfd",
+	.init		= memfd_init,
+	.exit		= exit_region,
+	.translate	= translate_pagemap,
+	.grow		= file_grow,
+};
+
+static int anon_grow(pop_mem_t *mem, size_t off, size_t len)
+{
+	void *p;
+
+	p = mmap(mem->mem + off, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	if (p == MAP_FAILED) {
+		pr_ve("failed to mmap %lu bytes: %s", len, strerror(errno));
+		unreserve_region(mem, off, len);
+		return -1;
+	}
+
+	return populate_region(mem, off, len);
+}
+
+static int anon_init(pop_mem_t *mem, char *dev, size_t size)
+{
+	strncpy(mem->devname, "anon", POP_PCI_DEVNAME_MAX);
+
+	mem->pagesize = PAGE_SIZE;
+	mem->page_shift = PAGE_SHIFT;
+	mem->size = ALIGN_UP(size ? size : POP_MEM_DEFAULT_SIZE, PAGE_SIZE);
+
+	mem->mem = reserve_region(mem->size, mem->pagesize);
+	if (mem->mem == MAP_FAILED) {
+		pr_ve("failed to reserve %lu bytes", mem->size);
+		return -1;
+	}
+
+	return 0;
+}
+
+const struct pop_mem_ops pop_mem_anon_ops = {
+	.name		= "anon",
+	.init		= anon_init,
+	.exit		= exit_region,
+	.translate	= translate_pagemap,
+	.grow		= anon_grow,
+};
+
+static int hugetlbfs_init(pop_mem_t *mem, char *dev, size_t size)
+{
+	/* dev is "hugetlbfs" or "hugetlbfs:MOUNT_POINT" */
+
+	char path[256];
+	struct statfs sfs;
+	const char *dir = HUGETLBFS_MOUNT;
+	long nr_pages;
+
+	if (dev[9] == ':')
+		dir = dev + 10;
+
+	strncpy(mem->devname, "hugetlbfs", POP_PCI_DEVNAME_MAX);
+
+	if (statfs(dir, &sfs) < 0) {
+		pr_ve("statfs %s: %s", dir, strerror(errno));
+		return -1;
+	}
+
+	mem->pagesize = sfs.f_bsize;
+	mem->page_shift = __builtin_ctzl(mem->pagesize);
+
+	if (size == 0) {
+		nr_pages = get_hugepages(mem->page_shift, "nr_hugepages");
+		if (nr_pages < 0)
+			return -1;
+		if (mem->grow_chunk)
+			size = (nr_pages > 0 ? nr_pages : 1) << mem->page_shift;
+		else
+			size = (nr_pages > 4 ? nr_pages / 4 : 1) <<
+				mem->page_shift;
+	}
+
+	if (mem->name[0]) {
+		/* a named file for a shared region, created exclusively
+		 * so that a process racing for the same name does not
+		 * truncate the file of the winner. a stale one left by
+		 * a crashed process must be removed explicitly */
+		snprintf(mem->path, sizeof(mem->path), "%s/libpop-%s",
+			 dir, mem->name);
+		mem->fd = open(mem->path, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (mem->fd < 0) {
+			pr_ve("failed to create %s: %s",
+			      mem->path, strerror(errno));
+			/* not ours, keep it on the error path */
+			mem->path[0] = '\0';
+			return -1;
+		}
+	} else {
+		/* an unlinked file is private to this process */
+		snprintf(path, sizeof(path), "%s/libpop-XXXXXX", dir);
+		mem->fd = mkstemp(path);
+		if (mem->fd < 0) {
+			pr_ve("failed to create %s: %s",
+			      path, strerror(errno));
+			return -1;
+		}
+		unlink(path);
+	}
+
+	return file_reserve(mem, size);
+}
+
+const struct pop_mem_ops pop_mem_hugetlbfs_ops = {
+	.name		= "hugetlbfs",
+	.init		= hugetlbfs_init,
+	.exit		= exit_region,
+	.translate	= translate_pagemap,
+	.grow		= file_grow,
+	.attach		= attach_file,
+};
+
+
+const struct pop_mem_ops *pop_mem_ops_lookup(char *dev)
+{
+	if (dev == NULL || strncmp(dev, "hugepage", 8) == 0)
+		return &pop_mem_hugepage_ops;
+	if (strcmp(dev, "memfd") == 0)
+		return &pop_mem_memfd_ops;
+	if (strcmp(dev, "anon") == 0)
+		return &pop_mem_anon_ops;
+	if (strncmp(dev, "hugetlbfs", 9) == 0 &&
+	    (dev[9] == '\0' || dev[9] == ':'))
+		return &pop_mem_hugetlbfs_ops;
+
+	/* otherwise, PCI slot of a p2pmem device */
+	return &pop_mem_p2pmem_ops;
+}
+
+const struct pop_mem_ops *pop_mem_ops_by_name(const char *name)
+{
+	const struct pop_mem_ops *ops[] = {
+		&pop_mem_hugepage_ops, &pop_mem_p2pmem_ops,
+		&pop_mem_memfd_ops, &pop_mem_anon_ops,
+		&pop_mem_hugetlbfs_ops,
+	};
+	unsigned int n;
+
+	for (n = 0; n < sizeof(ops) / sizeof(ops[0]); n++) {
+		if (strcmp(ops[n]->name, name) == 0)
+			return ops[n];
+	}
+
+	return NULL;
+}
+
+
+/* per-node pools of pop_mem */
+
+pop_mem_pool_t *pop_mem_pool_create(char *dev, size_t size,
+				    pop_mem_attr_t *attr)
+{
+	pop_mem_pool_t *pool;
+	pop_mem_attr_t a;
+	cpu_set_t nodes;
+	pop_mem_t *mem;
+	int node;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	if (attr)
+		a = *attr;
+	else
+		pop_mem_attr_init(&a);
+
+	/* p2pmem sits on its device, shared by all nodes */
+	if (pop_mem_ops_lookup(dev) == &pop_mem_p2pmem_ops) {
+		mem = pop_mem_init_attr(dev, size, &a);
+		if (!mem)
+			goto err_out;
+		pool->mems[0] = mem;
+		pool->nr_mems = 1;
+		for (node = 0; node < POP_MEM_MAX_NODES; node++)
+			pool->node_mem[node] = mem;
+		return pool;
+	}
+
+	if (parse_list(NODE_ONLINE, &nodes) < 0) {
+		CPU_ZERO(&nodes);
+		CPU_SET(0, &nodes);
+	}
+
+	for (node = 0; node < POP_MEM_MAX_NODES; node++) {
+		if (!CPU_ISSET(node, &nodes))
+			continue;
+
+		a.numa_node = POP_MEM_NUMA_NODE(node);
+		mem = pop_mem_init_attr(dev, size, &a);
+		if (!mem) {
+			/* e.g., no hugepages on a memory-less node */
+			pr_ve("failed to init pop_mem on node %d", node);
+			continue;
+		}
+		pool->mems[pool->nr_mems++] = mem;
+		pool->node_mem[node] = mem;
+	}
+
+	if (pool->nr_mems == 0)
+		goto err_out;
+
+	/* nodes without memory use the first one */
+	for (node = 0; node < POP_MEM_MAX_NODES; node++) {
+		if (!pool->node_mem[node])
+			pool->node_mem[node] = pool->mems[0];
+	}
+
+	return pool;
+
+err_out:
+	free(pool);
+	return NULL;
+}
+
+void pop_mem_pool_destroy(pop_mem_pool_t *pool)
+{
+	int n;
+
+	for (n = 0; n < pool->nr_mems; n++)
+		pop_mem_exit(pool->mems[n]);
+	free(pool);
+}
+
+pop_mem_t *pop_mem_pool_get(pop_mem_pool_t *pool, int node)
+{
+	if (node < 0)
+		node = current_node();
+	if (node < 0 || node >= POP_MEM_MAX_NODES)
+		return pool->mems[0];
+	return pool->node_mem[node];
+}
@@ -0,0 +1,111 @@
+/*
+ * pop_mem.h: memory backends for pop_mem_t. internal to libpop.
+ *
+ * A backend reserves a region at mem->mem, maps pages on it, and
+ * tells libpop how to translate it to physical addresses.
+ * pop_mem_init() selects a backend by the dev string, and commits
+ * the region from its head through grow, at once or on demand.
+ */
+
+#ifndef _POP_MEM_H_
+#define _POP_MEM_H_
+
+#include <errno.h>
+#include <libpop.h>
+
+struct pop_mem_ops {
+	const char	*name;
+
+	/* init: set up the backend for dev and reserve size bytes (0
+	 * means the default size of the backend) at mem->mem. A
+	 * backend without grow maps the whole region here. init sets
+	 * mem->size, mem->pagesize, and mem->page_shift, which is the
+	 * shift of a physically contiguous page. mem->grow_chunk is
+	 * non-zero when the region is committed on demand. */
+	int (*init)(pop_mem_t *mem, char *dev, size_t size);
+
+	/* exit: unmap and release the region */
+	int (*exit)(pop_mem_t *mem);
+
+	/* translate: fill mem->paddrs for [off, off + len) */
+	int (*translate)(pop_mem_t *mem, size_t off, size_t len);
+
+	/* grow: map, populate, and lock [off, off + len) of the
+	 * reserved region. On failure, the range is left reserved.
+	 * NULL means init maps the whole region. */
+	int (*grow)(pop_mem_t *mem, size_t off, size_t len);
+
+	/* attach: map mem->path of a shared region at mem->mem that
+	 * another process created. NULL means it cannot be shared. */
+	int (*attach)(pop_mem_t *mem);
+};
+
+extern const struct pop_mem_ops pop_mem_hugepage_ops;
+extern const struct pop_mem_ops pop_mem_p2pmem_ops;
+extern const struct pop_mem_ops pop_mem_memfd_ops;
+extern const struct pop_mem_ops pop_mem_anon_ops;
+extern const struct pop_mem_ops pop_mem_hugetlbfs_ops;
+
+/* pop_mem_ops_lookup: return the backend for dev */
+const struct pop_mem_ops *pop_mem_ops_lookup(char *dev);
+const struct pop_mem_ops *pop_mem_ops_by_name(const char *name);
+
+
+/*
+ * Metadata of a shared region on /dev/shm/libpop-NAME.meta. The header
+ * is followed by the paddr table and the buddy, which are addressed
+ * by offsets from the header. Processes map the region at the same
+ * vaddr, so that pointers in the region are valid in all of them.
+ */
+#define POP_SHM_PATH		"/dev/shm/libpop-%s.meta"
+#define POP_SHM_MAGIC		0x6873706f706f6c70ULL	/* "plopopsh" */
+#define POP_SHM_VERSION		1
+
+struct pop_mem_shared {
+	uint64_t	magic;
+	uint32_t	version;
+	uint32_t	ready;		/* set after initialized	*/
+
+	char		ops_name[16];	/* backend of the region	*/
+	char		devname[POP_PCI_DEVNAME_MAX];
+	char		path[POP_MEM_PATH_MAX];	/* file to be mapped	*/
+	struct pop_p2pmem_reg reg;
+
+	uintptr_t	vaddr;		/* where all processes map	*/
+	size_t		size;
+	size_t		pagesize;
+	unsigned int	page_shift;
+	int		numa_node;
+
+	size_t		alloced_pages;	/* synced under mutex		*/
+	pthread_mutex_t	mutex;		/* robust and process-shared	*/
+
+	size_t		paddrs_off;
+	size_t		buddy_off;
+};
+
+int pop_mem_share(pop_mem_t *mem, const char *name);
+void pop_mem_unshare(pop_mem_t *mem);
+
+/* lock the allocator of mem. alloced_pages of a shared region is
+ * synced with the metadata while locked */
+static inline void pop_mem_lock(pop_mem_t *mem)
+{
+	/* the owner died. the buddy is consistent unless it died in
+	 * the middle of pop_buddy_alloc/free; nothing else to do */
+	if (pthread_mutex_lock(mem->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(mem->lock);
+
+	if (mem->shared)
+		mem->alloced_pages = mem->shared->alloced_pages;
+}
+
+static inline void pop_mem_unlock(pop_mem_t *mem)
+{
+	if (mem->shared)
+		mem->shared->alloced_pages = mem->alloced_pages;
+
+	pthread_mutex_unlock(mem->lock);
+}
+
+#endif /* _POP_MEM_H_ */
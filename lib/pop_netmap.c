@@ -1,7 +1,10 @@
 /* pop_netmap.c */
 
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <sys/ioctl.h>
 
 #define PROGNAME "libpop-netmap"
@@ -11,57 +14,192 @@
 
 #include <net/netmap_user.h>
 
-struct pop_nm_rxring *pop_nm_rxring_init(int fd, struct netmap_ring *ring,
-					 pop_mem_t *mem)
+static void rxring_flush(int fd, struct netmap_ring *ring)
+{
+	unsigned int idx;
+
+	/* XXX
+	 *
+	 * Flush the rx rings by invloking netma_ring_reinit. netmap
+	 * native drivers allocate netmap krings and fill descriptor
+	 * rings with the packet buffers in the netmap
+	 * krings. However, the buffers exist on DRAM. Here makes cur
+	 * and head go around the ring. As a result, the physical
+	 * addresses in the ptr fields are going to be filled in the
+	 * descriptor rings.
+	 */
+	ring->cur = ring->num_slots - 1;
+	ring->head = ring->num_slots -1;
+	ioctl(fd, NIOCRXSYNC, NULL);
+
+	/* flush empty slots */
+	while(!nm_ring_empty(ring)) {
+		idx = nm_ring_next(ring, ring->head);
+		ring->head = ring->cur = idx;
+	}
+	ioctl(fd, NIOCRXSYNC, NULL);
+}
+
+size_t pop_nm_stride(size_t pktlen)
+{
+	size_t stride;
+
+	if (pktlen > POP_NM_STRIDE_MAX) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	for (stride = POP_NM_STRIDE_MIN; stride < pktlen; stride <<= 1);
+
+	return stride;
+}
+
+size_t pop_nm_port_stride(const char *port)
+{
+	/* netmap:eth0-1, netmap:eth0@conf, and so on */
+	char ifname[IFNAMSIZ], path[128];
+	unsigned int mtu;
+	size_t len;
+	FILE *fp;
+
+	if (strncmp(port, "netmap:", 7) == 0)
+		port += 7;
+	len = strcspn(port, "-*^{}/@");
+	if (len == 0 || len >= sizeof(ifname)) {
+		errno = EINVAL;
+		return 0;
+	}
+	memcpy(ifname, port, len);
+	ifname[len] = '\0';
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/mtu", ifname);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	if (fscanf(fp, "%u", &mtu) != 1) {
+		fclose(fp);
+		errno = EINVAL;
+		return 0;
+	}
+	fclose(fp);
+
+	return pop_nm_stride(mtu + POP_NM_L2_HLEN);
+}
+
+int pop_nm_stride_is_valid(size_t stride)
+{
+	return (stride >= POP_NM_STRIDE_MIN && stride <= POP_NM_STRIDE_MAX &&
+		(stride & (stride - 1)) == 0);
+}
+
+static struct pop_nm_rxring *rxring_init(int fd, struct netmap_ring *ring,
+					 pop_mem_t *mem, size_t stride)
 {
 	unsigned int idx, size;
 	pop_buf_t *pbuf;
 	struct pop_nm_rxring *prxring;
 	struct netmap_slot *slot;
 
-	size = ring->num_slots * ring->nr_buf_size;
+	size = ring->num_slots * stride;
 	pbuf = pop_buf_alloc(mem, size);
-	pop_buf_put(pbuf, size);
 	if (!pbuf) {
 		pr_ve("failed to allocate pbuf for rxring %u", ring->ringid);
 		return NULL;
 	}
+	pop_buf_put(pbuf, size);
+
+	prxring = malloc(sizeof(*prxring));
+	if (!prxring) {
+		pop_buf_free(pbuf);
+		return NULL;
+	}
+
+	prxring->pbuf = pbuf;
+	prxring->ring = ring;
+	prxring->stride = stride;
+	prxring->pool = NULL;
+	prxring->bufs = NULL;
 
 	for (idx = 0; idx < ring->num_slots; idx++) {
 		slot = &ring->slot[idx];
 		slot->flags |= NS_PHY_INDIRECT;
-		slot->ptr = pop_buf_paddr(pbuf) + ring->nr_buf_size * idx;
+		slot->ptr = pop_virt_to_phys(mem, pop_buf_data(pbuf) +
+					     stride * idx);
 	}
 
-	/* XXX
-	 *
-	 * Flush the rx rings by invloking netma_ring_reinit. netmap
-	 * native drivers allocate netmap krings and fill descriptor
-	 * rings with the packet buffers in the netmap
-	 * krings. However, the buffers exist on DRAM. Here makes cur
-	 * and head go around the ring. As a result, the physical
-	 * addresses in the ptr fields are going to be filled in the
-	 * descriptor rings.
-	 */
-	ring->cur = ring->num_slots - 1;
-	ring->head = ring->num_slots -1;
-	ioctl(fd, NIOCRXSYNC, NULL);
+	rxring_flush(fd, ring);
+
+	return prxring;
+}
+
+struct pop_nm_rxring *pop_nm_rxring_init(int fd, struct netmap_ring *ring,
+					 pop_mem_t *mem)
+{
+	/* nr_buf_size of any netmap port, as before strides */
+	return rxring_init(fd, ring, mem, ring->nr_buf_size);
+}
+
+struct pop_nm_rxring *pop_nm_rxring_init_stride(int fd,
+						struct netmap_ring *ring,
+						pop_mem_t *mem, size_t stride)
+{
+	if (!pop_nm_stride_is_valid(stride)) {
+		pr_ve("invalid stride %lu for rxring %u", stride, ring->ringid);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return rxring_init(fd, ring, mem, stride);
+}
+
+struct pop_nm_rxring *pop_nm_rxring_init_pool(int fd, struct netmap_ring *ring,
+					      pop_pktpool_t *pool)
+{
+	unsigned int idx;
+	struct pop_nm_rxring *prxring;
+	struct netmap_slot *slot;
+
+	if (!pop_nm_stride_is_valid(pop_pktpool_objsize(pool))) {
+		pr_ve("invalid %lu-byte objects for rxring %u",
+		      pop_pktpool_objsize(pool), ring->ringid);
+		errno = EINVAL;
+		return NULL;
+	}
 
 	prxring = malloc(sizeof(*prxring));
 	if (!prxring)
-		return NULL;
+		goto err_out;
 
-	prxring->pbuf = pbuf;
+	prxring->bufs = calloc(ring->num_slots, sizeof(pop_buf_t *));
+	if (!prxring->bufs)
+		goto err_free_prxring;
+
+	if (pop_pktpool_get_bulk(pool, prxring->bufs, ring->num_slots) < 0)
+		goto err_free_bufs;
+
+	prxring->pbuf = NULL;
 	prxring->ring = ring;
+	prxring->stride = pop_pktpool_objsize(pool);
+	prxring->pool = pool;
 
-	/* flush empty slots */
-	while(!nm_ring_empty(ring)) {
-		idx = nm_ring_next(ring, ring->head);
-		ring->head = ring->cur = idx;
+	for (idx = 0; idx < ring->num_slots; idx++) {
+		slot = &ring->slot[idx];
+		slot->flags |= NS_PHY_INDIRECT | NS_BUF_CHANGED;
+		slot->ptr = pop_buf_paddr(prxring->bufs[idx]);
 	}
-	ioctl(fd, NIOCRXSYNC, NULL);
+
+	rxring_flush(fd, ring);
 
 	return prxring;
+
+err_free_bufs:
+	free(prxring->bufs);
+err_free_prxring:
+	free(prxring);
+err_out:
+	pr_ve("failed to allocate pktpool objects for rxring %u",
+	      ring->ringid);
+	return NULL;
 }
 
 void pop_nm_rxring_exit(struct pop_nm_rxring *prxring)
@@ -76,14 +214,40 @@ void pop_nm_rxring_exit(struct pop_nm_rxring *prxring)
 		slot->ptr = 0;
 	}
 
-	pop_buf_free(prxring->pbuf);
+	if (prxring->pool) {
+		pop_pktpool_put_bulk(prxring->bufs, ring->num_slots);
+		free(prxring->bufs);
+	} else
+		pop_buf_free(prxring->pbuf);
 	free(prxring);
 }
 
-inline void *pop_nm_rxring_buf(struct pop_nm_rxring *prxring, uint32_t idx)
+pop_buf_t *pop_nm_rxring_swap(struct pop_nm_rxring *prxring, uint32_t idx)
 {
 	struct netmap_ring *ring = prxring->ring;
-	return (pop_buf_data(prxring->pbuf) + (ring->nr_buf_size * idx));
+	struct netmap_slot *slot = &ring->slot[idx];
+	pop_buf_t *pbuf, *fresh;
+
+	fresh = pop_pktpool_get(prxring->pool);
+	if (!fresh)
+		return NULL;	/* the slot keeps the packet */
+
+	pbuf = prxring->bufs[idx];
+	pop_buf_put(pbuf, slot->len);
+
+	/* the driver loads the new buffer when the slot is refilled */
+	prxring->bufs[idx] = fresh;
+	slot->ptr = pop_buf_paddr(fresh);
+	slot->flags |= NS_BUF_CHANGED;
+
+	return pbuf;
+}
+
+inline void *pop_nm_rxring_buf(struct pop_nm_rxring *prxring, uint32_t idx)
+{
+	if (prxring->pool)
+		return pop_buf_data(prxring->bufs[idx]);
+	return (pop_buf_data(prxring->pbuf) + (prxring->stride * idx));
 		
 }
 
@@ -95,8 +259,282 @@ inline struct netmap_ring *pop_nm_ring(struct pop_nm_rxring *prxring)
 
 void pop_nm_set_buf(struct netmap_slot *slot, pop_buf_t *pbuf)
 {
-	slot->flags |= NS_PHY_INDIRECT;
+	/* the slot may be a fragment of the previous packet */
+	slot->flags = (slot->flags & ~NS_MOREFRAG) | NS_PHY_INDIRECT;
 	slot->ptr = pop_buf_paddr(pbuf);
 	slot->len = pop_buf_len(pbuf);
 }
 
+void pop_nm_set_pkt(struct netmap_slot *slot, pop_pktpool_t *pool,
+		    pop_pkt_t h)
+{
+	slot->flags = (slot->flags & ~NS_MOREFRAG) | NS_PHY_INDIRECT;
+	slot->ptr = pop_pkt_paddr(pool, h);
+	slot->len = pop_pkt_len(pool, h);
+}
+
+int pop_nm_set_chain(struct netmap_ring *ring, unsigned int idx,
+		     pop_buf_t *chain)
+{
+	struct netmap_slot *slot = NULL;
+	pop_buf_t *pos;
+	unsigned int space;
+
+	/* nm_ring_space() from idx instead of ring->head */
+	space = ring->tail >= idx ? ring->tail - idx :
+		ring->tail + ring->num_slots - idx;
+
+	if (pop_buf_chain_count(chain) > space) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	pop_buf_chain_for_each(pos, chain) {
+		if (pop_buf_len(pos) > ring->nr_buf_size) {
+			pr_ve("%lu-byte segment is larger than a slot",
+			      pop_buf_len(pos));
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	pop_buf_chain_for_each(pos, chain) {
+		slot = &ring->slot[idx];
+		pop_nm_set_buf(slot, pos);
+		slot->flags |= NS_MOREFRAG;
+		idx = nm_ring_next(ring, idx);
+	}
+	slot->flags &= ~NS_MOREFRAG;
+
+	return idx;
+}
+
+
+/* slots to prefetch ahead in the burst loops; 4 slots per cache line */
+#define TX_PREFETCH	4
+
+static inline unsigned int tx_burst_space(struct netmap_ring *ring,
+					  unsigned int n)
+{
+	unsigned int space = nm_ring_space(ring);
+	return n > space ? space : n;
+}
+
+static inline void tx_burst_prefetch(struct netmap_ring *ring,
+				     unsigned int idx)
+{
+	idx += TX_PREFETCH;
+	if (idx >= ring->num_slots)
+		idx -= ring->num_slots;
+	__builtin_prefetch(&ring->slot[idx], 1);
+}
+
+unsigned int pop_nm_tx_burst(struct netmap_ring *ring, pop_buf_t **bufs,
+			     unsigned int n)
+{
+	struct netmap_slot *slot;
+	unsigned int i, idx = ring->head;
+
+	n = tx_burst_space(ring, n);
+
+	for (i = 0; i < n; i++) {
+		if (i + TX_PREFETCH < n) {
+			__builtin_prefetch(bufs[i + TX_PREFETCH], 0);
+			tx_burst_prefetch(ring, idx);
+		}
+		slot = &ring->slot[idx];
+		slot->flags = (slot->flags & ~NS_MOREFRAG) | NS_PHY_INDIRECT;
+		slot->ptr = pop_buf_paddr(bufs[i]);
+		slot->len = pop_buf_len(bufs[i]);
+		idx = nm_ring_next(ring, idx);
+	}
+
+	ring->head = ring->cur = idx;
+
+	return n;
+}
+
+unsigned int pop_nm_tx_burst_paddr(struct netmap_ring *ring,
+				   const uintptr_t *paddr,
+				   const uint16_t *len, unsigned int n)
+{
+	struct netmap_slot *slot;
+	unsigned int i, idx = ring->head;
+
+	n = tx_burst_space(ring, n);
+
+	for (i = 0; i < n; i++) {
+		if (i + TX_PREFETCH < n)
+			tx_burst_prefetch(ring, idx);
+		slot = &ring->slot[idx];
+		slot->flags = (slot->flags & ~NS_MOREFRAG) | NS_PHY_INDIRECT;
+		slot->ptr = paddr[i];
+		slot->len = len[i];
+		idx = nm_ring_next(ring, idx);
+	}
+
+	ring->head = ring->cur = idx;
+
+	return n;
+}
+
+int pop_nm_tx_sync(int fd, struct netmap_ring *ring, unsigned int threshold)
+{
+	/* the NIC starts to send queued slots on TXSYNC, so that a
+	 * large threshold saves syscalls at the cost of latency */
+	if (threshold && nm_ring_space(ring) >= threshold)
+		return 0;
+
+	return ioctl(fd, NIOCTXSYNC, NULL);
+}
+
+
+struct pop_nm_txring *pop_nm_txring_init(struct netmap_ring *ring)
+{
+	struct pop_nm_txring *ptx;
+
+	ptx = malloc(sizeof(*ptx));
+	if (!ptx)
+		goto err_out;
+
+	ptx->bufs = calloc(ring->num_slots, sizeof(pop_buf_t *));
+	if (!ptx->bufs)
+		goto err_free_ptx;
+
+	ptx->used = calloc(ring->num_slots, sizeof(uint8_t));
+	if (!ptx->used)
+		goto err_free_bufs;
+
+	/* slots from tail to head are owned by the kernel */
+	ptx->ring = ring;
+	ptx->done = ring->tail;
+
+	return ptx;
+
+err_free_bufs:
+	free(ptx->bufs);
+err_free_ptx:
+	free(ptx);
+err_out:
+	pr_ve("failed to allocate txring for ring %u", ring->ringid);
+	return NULL;
+}
+
+void pop_nm_txring_exit(struct pop_nm_txring *ptx)
+{
+	unsigned int idx;
+
+	for (idx = 0; idx < ptx->ring->num_slots; idx++) {
+		if (ptx->used[idx] && ptx->bufs[idx])
+			pop_buf_free(ptx->bufs[idx]);
+	}
+
+	free(ptx->used);
+	free(ptx->bufs);
+	free(ptx);
+}
+
+void pop_nm_txring_track(struct pop_nm_txring *ptx, unsigned int idx,
+			 pop_buf_t *pbuf)
+{
+	ptx->bufs[idx] = pbuf;
+	ptx->used[idx] = 1;
+}
+
+void pop_nm_txring_set_buf(struct pop_nm_txring *ptx, unsigned int idx,
+			   pop_buf_t *pbuf)
+{
+	pop_nm_set_buf(&ptx->ring->slot[idx], pbuf);
+	pop_nm_txring_track(ptx, idx, pbuf);
+}
+
+int pop_nm_txring_set_chain(struct pop_nm_txring *ptx, unsigned int idx,
+			    pop_buf_t *chain)
+{
+	pop_buf_t *pos;
+	int ret;
+
+	ret = pop_nm_set_chain(ptx->ring, idx, chain);
+	if (ret < 0)
+		return ret;
+
+	pop_buf_chain_for_each(pos, chain) {
+		pop_nm_txring_track(ptx, idx, pos);
+		idx = nm_ring_next(ptx->ring, idx);
+	}
+
+	return ret;
+}
+
+unsigned int pop_nm_txring_burst(struct pop_nm_txring *ptx, pop_buf_t **bufs,
+				 unsigned int n)
+{
+	unsigned int i, idx = ptx->ring->head;
+
+	n = pop_nm_tx_burst(ptx->ring, bufs, n);
+	for (i = 0; i < n; i++) {
+		pop_nm_txring_track(ptx, idx, bufs[i]);
+		idx = nm_ring_next(ptx->ring, idx);
+	}
+
+	return n;
+}
+
+unsigned int pop_nm_txring_burst_paddr(struct pop_nm_txring *ptx,
+				       const uintptr_t *paddr,
+				       const uint16_t *len, pop_buf_t **bufs,
+				       unsigned int n)
+{
+	unsigned int i, idx = ptx->ring->head;
+
+	n = pop_nm_tx_burst_paddr(ptx->ring, paddr, len, n);
+	for (i = 0; i < n; i++) {
+		pop_nm_txring_track(ptx, idx, bufs ? bufs[i] : NULL);
+		idx = nm_ring_next(ptx->ring, idx);
+	}
+
+	return n;
+}
+
+unsigned int pop_nm_txring_complete(struct pop_nm_txring *ptx,
+				    pop_buf_t **bufs, unsigned int n)
+{
+	struct netmap_ring *ring = ptx->ring;
+	uint32_t idx = ptx->done, tail;
+	unsigned int count = 0;
+
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	while (idx != tail && count < n) {
+		if (ptx->used[idx]) {
+			if (bufs)
+				bufs[count] = ptx->bufs[idx];
+			ptx->used[idx] = 0;
+			ptx->bufs[idx] = NULL;
+			count++;
+		}
+		idx = nm_ring_next(ring, idx);
+	}
+	ptx->done = idx;
+
+	return count;
+}
+
+unsigned int pop_nm_txring_reclaim(struct pop_nm_txring *ptx)
+{
+	pop_buf_t *bufs[64], *pbufs[64];
+	unsigned int n, i, nr, total = 0;
+
+	do {
+		n = pop_nm_txring_complete(ptx, bufs, 64);
+		for (i = 0, nr = 0; i < n; i++) {
+			if (bufs[i])
+				pbufs[nr++] = bufs[i];
+		}
+		if (nr)
+			pop_buf_free_bulk(pbufs, nr);
+		total += n;
+	} while (n == 64);
+
+	return total;
+}
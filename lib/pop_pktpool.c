@@ -0,0 +1,517 @@
+/* pop_pktpool.c: fixed-size packet buffer pool with per-thread caches */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <x86_64-linux-gnu/sys/user.h>
+
+#define PROGNAME "libpop-pktpool"
+
+#include <libpop.h>
+#include <libpop_ring.h>
+#include <libpop_util.h>
+
+#define CACHE_LINE_SIZE	64
+
+#if POP_PKTPOOL_MAX_THREADS > 64
+#error "thread ids of pktpool are on a 64-bit bitmap"
+#endif
+
+struct pop_pkt_meta {
+	uint32_t	offset;
+	uint32_t	length;
+};
+
+struct pktpool_cache {
+	unsigned int	len;
+	uint32_t	objs[POP_PKTPOOL_CACHE_SIZE];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct pop_pktpool {
+	pop_mem_t	*mem;
+	pop_buf_t	*region;	/* pop_buf holding all objects	*/
+	pop_buf_t	*bufs;		/* descriptors of objects	*/
+
+	/* for pop_pkt_t handles: data of object idx is at
+	 * base + objsize * idx, and its offset and length are meta[idx] */
+	char		*base;
+	struct pop_pkt_meta	*meta;
+
+	size_t		objsize;
+	unsigned int	count;
+
+	struct pktpool_cache	caches[POP_PKTPOOL_MAX_THREADS];
+	pop_ring_t		*ring;	/* MPMC ring shared by threads */
+
+	struct pop_pktpool	*next;	/* on pktpool_list */
+};
+
+
+/* thread id for indexing caches. assigned at the first get/put, and
+ * released when the thread exits, after its caches in all pools are
+ * drained to the rings. threads beyond POP_PKTPOOL_MAX_THREADS at a
+ * time have no cache */
+static __thread int pktpool_thread_id = -1;
+static uint64_t pktpool_tids_used = 0;	/* bitmap of assigned ids */
+
+static pthread_mutex_t pktpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pop_pktpool_t *pktpool_list = NULL;	/* live pools */
+
+static pthread_once_t pktpool_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t pktpool_key;
+
+static void pktpool_thread_exit(void *arg)
+{
+	int tid = (uintptr_t)arg - 1;
+	struct pktpool_cache *c;
+	pop_pktpool_t *pool;
+
+	pthread_mutex_lock(&pktpool_lock);
+	for (pool = pktpool_list; pool; pool = pool->next) {
+		c = &pool->caches[tid];
+		if (c->len)
+			pop_ring_mp_enqueue_burst(pool->ring, c->objs, c->len);
+		c->len = 0;
+	}
+	pktpool_tids_used &= ~(1ULL << tid);
+	pthread_mutex_unlock(&pktpool_lock);
+}
+
+static void pktpool_key_init(void)
+{
+	pthread_key_create(&pktpool_key, pktpool_thread_exit);
+}
+
+static int pktpool_tid_alloc(void)
+{
+	int tid = POP_PKTPOOL_MAX_THREADS;
+
+	pthread_once(&pktpool_key_once, pktpool_key_init);
+
+	pthread_mutex_lock(&pktpool_lock);
+	if (~pktpool_tids_used) {
+		tid = __builtin_ctzll(~pktpool_tids_used);
+		pktpool_tids_used |= 1ULL << tid;
+	}
+	pthread_mutex_unlock(&pktpool_lock);
+
+	if (tid < POP_PKTPOOL_MAX_THREADS)
+		pthread_setspecific(pktpool_key, (void *)(uintptr_t)(tid + 1));
+
+	return tid;
+}
+
+static inline int pktpool_tid(void)
+{
+	if (__builtin_expect(pktpool_thread_id < 0, 0))
+		pktpool_thread_id = pktpool_tid_alloc();
+	return pktpool_thread_id;
+}
+
+pop_pktpool_t *pop_pktpool_create(pop_mem_t *mem, size_t objsize,
+				  unsigned int count)
+{
+	pop_pktpool_t *pool;
+	uint32_t idx;
+	void *vaddr;
+
+	if (count == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (objsize == 0)
+		objsize = POP_PKTPOOL_OBJSIZE;
+
+	if (objsize < PAGE_SIZE) {
+		size_t s;
+		for (s = CACHE_LINE_SIZE; s < objsize; s <<= 1);
+		objsize = s;
+	} else
+		objsize = (objsize + PAGE_SIZE - 1) & PAGE_MASK;
+
+	if (posix_memalign((void **)&pool, CACHE_LINE_SIZE, sizeof(*pool))) {
+		pr_ve("failed to allocate pktpool");
+		return NULL;
+	}
+	memset(pool, 0, sizeof(*pool));
+	pool->mem = mem;
+	pool->objsize = objsize;
+	pool->count = count;
+
+	pool->ring = pop_ring_create(count, 0);
+	if (!pool->ring) {
+		pr_ve("failed to allocate ring for %u objects", count);
+		goto err_free_pool;
+	}
+
+	pool->bufs = calloc(count, sizeof(pop_buf_t));
+	if (!pool->bufs) {
+		pr_ve("failed to allocate %u descriptors", count);
+		goto err_free_ring;
+	}
+
+	pool->meta = calloc(count, sizeof(*pool->meta));
+	if (!pool->meta) {
+		pr_ve("failed to allocate %u handle metadata", count);
+		goto err_free_bufs;
+	}
+
+	pool->region = pop_buf_alloc(mem, objsize * count);
+	if (!pool->region) {
+		pr_ve("failed to allocate %lu-byte region for %u objects",
+		      objsize * count, count);
+		goto err_free_meta;
+	}
+	pool->base = pool->region->vaddr;
+
+	for (idx = 0; idx < count; idx++) {
+		vaddr = pool->region->vaddr + objsize * idx;
+		pool->bufs[idx].mem	= mem;
+		pool->bufs[idx].pool	= pool;
+		pool->bufs[idx].vaddr	= vaddr;
+		pool->bufs[idx].paddr	= pop_virt_to_phys(mem, vaddr);
+		pool->bufs[idx].size	= objsize;
+		pop_ring_mp_enqueue_burst(pool->ring, &idx, 1);
+	}
+
+	pthread_mutex_lock(&pktpool_lock);
+	pool->next = pktpool_list;
+	pktpool_list = pool;
+	pthread_mutex_unlock(&pktpool_lock);
+
+	pr_vs("pktpool with %u %lu-byte objects created on %s",
+	      count, objsize, mem->devname);
+
+	return pool;
+
+err_free_meta:
+	free(pool->meta);
+err_free_bufs:
+	free(pool->bufs);
+err_free_ring:
+	pop_ring_free(pool->ring);
+err_free_pool:
+	free(pool);
+	return NULL;
+}
+
+void pop_pktpool_destroy(pop_pktpool_t *pool)
+{
+	pop_pktpool_t **p;
+
+	pthread_mutex_lock(&pktpool_lock);
+	for (p = &pktpool_list; *p; p = &(*p)->next) {
+		if (*p == pool) {
+			*p = pool->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pktpool_lock);
+
+	pop_buf_free(pool->region);
+	free(pool->meta);
+	free(pool->bufs);
+	pop_ring_free(pool->ring);
+	free(pool);
+}
+
+static inline int pktpool_get_idx(pop_pktpool_t *pool, uint32_t *idx)
+{
+	struct pktpool_cache *c;
+	int tid;
+
+	tid = pktpool_tid();
+	if (__builtin_expect(tid >= POP_PKTPOOL_MAX_THREADS, 0)) {
+		/* no cache for this thread */
+		if (pop_ring_mc_dequeue_burst(pool->ring, idx, 1) == 0)
+			return -1;
+		return 0;
+	}
+
+	c = &pool->caches[tid];
+	if (c->len == 0) {
+		c->len = pop_ring_mc_dequeue_burst(pool->ring, c->objs,
+					    POP_PKTPOOL_BULK);
+		if (c->len == 0)
+			return -1;
+	}
+	*idx = c->objs[--c->len];
+
+	return 0;
+}
+
+static inline void pktpool_put_idx(pop_pktpool_t *pool, uint32_t idx)
+{
+	struct pktpool_cache *c;
+	int tid;
+
+	tid = pktpool_tid();
+	if (__builtin_expect(tid >= POP_PKTPOOL_MAX_THREADS, 0)) {
+		pop_ring_mp_enqueue_burst(pool->ring, &idx, 1);
+		return;
+	}
+
+	c = &pool->caches[tid];
+	if (c->len == POP_PKTPOOL_CACHE_SIZE) {
+		/* the ring has room for all objects, never fails */
+		c->len -= POP_PKTPOOL_BULK;
+		pop_ring_mp_enqueue_burst(pool->ring, &c->objs[c->len],
+				   POP_PKTPOOL_BULK);
+	}
+	c->objs[c->len++] = idx;
+}
+
+pop_buf_t *pop_pktpool_get(pop_pktpool_t *pool)
+{
+	pop_buf_t *pbuf;
+	uint32_t idx;
+
+	if (pktpool_get_idx(pool, &idx) < 0) {
+		errno = ENOBUFS;
+		return NULL;
+	}
+
+	pbuf = &pool->bufs[idx];
+	pbuf->offset = 0;
+	pbuf->length = 0;
+	pbuf->refcnt = 1;
+	return pbuf;
+}
+
+void pop_pktpool_put(pop_buf_t *pbuf)
+{
+	pop_pktpool_t *pool = pbuf->pool;
+
+	pktpool_put_idx(pool, pbuf - pool->bufs);
+}
+
+int pop_pktpool_get_bulk(pop_pktpool_t *pool, pop_buf_t **bufs,
+			 unsigned int n)
+{
+	struct pktpool_cache *c = NULL;
+	uint32_t idxs[POP_PKTPOOL_BULK], *objs = idxs;
+	unsigned int got = 0, max = POP_PKTPOOL_BULK, i, nr;
+	pop_buf_t *pbuf;
+	int tid;
+
+	tid = pktpool_tid();
+	if (__builtin_expect(tid < POP_PKTPOOL_MAX_THREADS, 1)) {
+		/* take objects from the cache first */
+		c = &pool->caches[tid];
+		while (got < n && c->len > 0)
+			bufs[got++] = &pool->bufs[c->objs[--c->len]];
+
+		/* the empty cache is the buffer to dequeue the rest */
+		objs = c->objs;
+		max = POP_PKTPOOL_CACHE_SIZE;
+	}
+
+	while (got < n) {
+		nr = pop_ring_mc_dequeue_burst(pool->ring, objs,
+					n - got < max ? n - got : max);
+		if (nr == 0)
+			goto empty;
+		for (i = 0; i < nr; i++)
+			bufs[got++] = &pool->bufs[objs[i]];
+	}
+
+	for (i = 0; i < n; i++) {
+		pbuf = bufs[i];
+		pbuf->offset = 0;
+		pbuf->length = 0;
+		pbuf->refcnt = 1;
+	}
+
+	return 0;
+
+empty:
+	pop_pktpool_put_bulk(bufs, got);
+	errno = ENOBUFS;
+	return -1;
+}
+
+void pop_pktpool_put_bulk(pop_buf_t **bufs, unsigned int n)
+{
+	pop_pktpool_t *pool;
+	struct pktpool_cache *c;
+	uint32_t idxs[POP_PKTPOOL_BULK];
+	unsigned int i, nr;
+	int tid;
+
+	if (n == 0)
+		return;
+
+	pool = bufs[0]->pool;
+	tid = pktpool_tid();
+	if (__builtin_expect(tid >= POP_PKTPOOL_MAX_THREADS, 0)) {
+		for (i = 0; i < n; i += nr) {
+			for (nr = 0; nr < POP_PKTPOOL_BULK && i + nr < n; nr++)
+				idxs[nr] = bufs[i + nr] - pool->bufs;
+			pop_ring_mp_enqueue_burst(pool->ring, idxs, nr);
+		}
+		return;
+	}
+
+	c = &pool->caches[tid];
+	for (i = 0; i < n; i++) {
+		if (c->len == POP_PKTPOOL_CACHE_SIZE) {
+			c->len -= POP_PKTPOOL_BULK;
+			pop_ring_mp_enqueue_burst(pool->ring, &c->objs[c->len],
+					   POP_PKTPOOL_BULK);
+		}
+		c->objs[c->len++] = bufs[i] - pool->bufs;
+	}
+}
+
+
+/* pop_pkt_t handles */
+
+pop_pkt_t pop_pkt_alloc(pop_pktpool_t *pool)
+{
+	uint32_t idx;
+
+	if (pktpool_get_idx(pool, &idx) < 0) {
+		errno = ENOBUFS;
+		return POP_PKT_NONE;
+	}
+
+	pool->meta[idx].offset = 0;
+	pool->meta[idx].length = 0;
+	return idx;
+}
+
+void pop_pkt_free(pop_pktpool_t *pool, pop_pkt_t h)
+{
+	pktpool_put_idx(pool, h);
+}
+
+int pop_pkt_alloc_bulk(pop_pktpool_t *pool, pop_pkt_t *hs, unsigned int n)
+{
+	struct pktpool_cache *c = NULL;
+	unsigned int got = 0, nr, i;
+	int tid;
+
+	tid = pktpool_tid();
+	if (__builtin_expect(tid < POP_PKTPOOL_MAX_THREADS, 1)) {
+		c = &pool->caches[tid];
+		while (got < n && c->len > 0)
+			hs[got++] = c->objs[--c->len];
+	}
+
+	/* handles are object indexes in the ring as they are */
+	while (got < n) {
+		nr = pop_ring_mc_dequeue_burst(pool->ring, &hs[got], n - got);
+		if (nr == 0) {
+			pop_pkt_free_bulk(pool, hs, got);
+			errno = ENOBUFS;
+			return -1;
+		}
+		got += nr;
+	}
+
+	for (i = 0; i < n; i++) {
+		pool->meta[hs[i]].offset = 0;
+		pool->meta[hs[i]].length = 0;
+	}
+
+	return 0;
+}
+
+void pop_pkt_free_bulk(pop_pktpool_t *pool, pop_pkt_t *hs, unsigned int n)
+{
+	struct pktpool_cache *c;
+	unsigned int i;
+	int tid;
+
+	tid = pktpool_tid();
+	if (__builtin_expect(tid >= POP_PKTPOOL_MAX_THREADS, 0)) {
+		pop_ring_mp_enqueue_burst(pool->ring, hs, n);
+		return;
+	}
+
+	c = &pool->caches[tid];
+	for (i = 0; i < n; i++) {
+		if (c->len == POP_PKTPOOL_CACHE_SIZE) {
+			c->len -= POP_PKTPOOL_BULK;
+			pop_ring_mp_enqueue_burst(pool->ring, &c->objs[c->len],
+					   POP_PKTPOOL_BULK);
+		}
+		c->objs[c->len++] = hs[i];
+	}
+}
+
+void *pop_pkt_data(pop_pktpool_t *pool, pop_pkt_t h)
+{
+	return pool->base + pool->objsize * h + pool->meta[h].offset;
+}
+
+uintptr_t pop_pkt_paddr(pop_pktpool_t *pool, pop_pkt_t h)
+{
+	return pop_virt_to_phys(pool->mem, pop_pkt_data(pool, h));
+}
+
+size_t pop_pkt_len(pop_pktpool_t *pool, pop_pkt_t h)
+{
+	return pool->meta[h].length;
+}
+
+void *pop_pkt_append(pop_pktpool_t *pool, pop_pkt_t h, size_t len)
+{
+	struct pop_pkt_meta *m = &pool->meta[h];
+
+	if (m->offset + m->length + len > pool->objsize) {
+		pr_ve("failed to append: objsize=%lu off=%u length=%u len=%lu",
+		      pool->objsize, m->offset, m->length, len);
+		return NULL;
+	}
+
+	m->length += len;
+	return pop_pkt_data(pool, h);
+}
+
+void *pop_pkt_adj(pop_pktpool_t *pool, pop_pkt_t h, size_t len)
+{
+	struct pop_pkt_meta *m = &pool->meta[h];
+
+	if (m->length < len) {
+		pr_ve("failed to adj: objsize=%lu off=%u length=%u len=%lu",
+		      pool->objsize, m->offset, m->length, len);
+		return NULL;
+	}
+
+	m->length -= len;
+	m->offset += len;
+	return pop_pkt_data(pool, h);
+}
+
+pop_buf_t *pop_pkt_buf(pop_pktpool_t *pool, pop_pkt_t h)
+{
+	pop_buf_t *pbuf = &pool->bufs[h];
+
+	pbuf->offset = pool->meta[h].offset;
+	pbuf->length = pool->meta[h].length;
+	pbuf->refcnt = 1;
+	return pbuf;
+}
+
+pop_pkt_t pop_buf_pkt(pop_buf_t *pbuf)
+{
+	pop_pktpool_t *pool = pbuf->pool;
+	uint32_t idx = pbuf - pool->bufs;
+
+	pool->meta[idx].offset = pbuf->offset;
+	pool->meta[idx].length = pbuf->length;
+	return idx;
+}
+
+size_t pop_pktpool_objsize(pop_pktpool_t *pool)
+{
+	return pool->objsize;
+}
+
+unsigned int pop_pktpool_count(pop_pktpool_t *pool)
+{
+	return pool->count;
+}
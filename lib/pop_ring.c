@@ -0,0 +1,41 @@
+/* pop_ring.c: allocation of lock-free rings in libpop_ring.h */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define PROGNAME "libpop-ring"
+
+#include <libpop_ring.h>
+#include <libpop_util.h>
+
+pop_ring_t *pop_ring_create(unsigned int count, int flags)
+{
+	pop_ring_t *r;
+	uint32_t size;
+
+	if (count == 0 || count > (1U << 31)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (size = 1; size < count; size <<= 1);
+
+	if (posix_memalign((void **)&r, POP_RING_CACHE_LINE,
+			   sizeof(*r) + sizeof(uint32_t) * size)) {
+		pr_ve("failed to allocate ring for %u entries", size);
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(r, 0, sizeof(*r));
+	r->size = size;
+	r->mask = size - 1;
+	r->flags = flags;
+
+	return r;
+}
+
+void pop_ring_free(pop_ring_t *r)
+{
+	free(r);
+}
@@ -0,0 +1,243 @@
+/* pop_shared.c: pop_mem regions shared by processes */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <x86_64-linux-gnu/sys/user.h>
+
+#define PROGNAME "libpop-shared"
+
+#include <libpop.h>
+#include <libpop_util.h>
+#include <pop_buddy.h>
+#include <pop_mem.h>
+
+#define ALIGN_UP(x, a)	(((x) + (a) - 1) & ~((a) - 1))
+
+static size_t nr_paddrs(pop_mem_t *mem)
+{
+	return (mem->size + mem->page_mask) >> mem->page_shift;
+}
+
+int pop_mem_share(pop_mem_t *mem, const char *name)
+{
+	/*
+	 * create /dev/shm/libpop-NAME.meta for the metadata of mem, and move
+	 * the paddr table and the buddy of mem to there. The file is
+	 * created exclusively, so that only one process creates NAME.
+	 */
+
+	struct pop_mem_shared *sh;
+	pthread_mutexattr_t mattr;
+	char path[64];
+	size_t size, paddrs_off, buddy_off;
+	int fd;
+
+	paddrs_off = ALIGN_UP(sizeof(*sh), 64);
+	buddy_off = ALIGN_UP(paddrs_off + sizeof(uintptr_t) * nr_paddrs(mem),
+			     64);
+	size = buddy_off + pop_buddy_size(mem->num_pages);
+
+	snprintf(path, sizeof(path), POP_SHM_PATH, name);
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		pr_ve("failed to create %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		pr_ve("failed to truncate %s: %s", path, strerror(errno));
+		goto err_unlink;
+	}
+
+	sh = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (sh == MAP_FAILED) {
+		pr_ve("failed to mmap %s: %s", path, strerror(errno));
+		goto err_unlink;
+	}
+	close(fd);
+
+	sh->magic = POP_SHM_MAGIC;
+	sh->version = POP_SHM_VERSION;
+	strncpy(sh->ops_name, mem->ops->name, sizeof(sh->ops_name) - 1);
+	strncpy(sh->devname, mem->devname, sizeof(sh->devname) - 1);
+	strncpy(sh->path, mem->path, sizeof(sh->path) - 1);
+	sh->reg = mem->reg;
+	sh->vaddr = (uintptr_t)mem->mem;
+	sh->size = mem->size;
+	sh->pagesize = mem->pagesize;
+	sh->page_shift = mem->page_shift;
+	sh->numa_node = mem->numa_node;
+	sh->alloced_pages = mem->alloced_pages;
+	sh->paddrs_off = paddrs_off;
+	sh->buddy_off = buddy_off;
+
+	/* a process may die holding the lock */
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&sh->mutex, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+
+	/* the buddy is position independent */
+	memcpy((char *)sh + paddrs_off, mem->paddrs,
+	       sizeof(uintptr_t) * nr_paddrs(mem));
+	memcpy((char *)sh + buddy_off, mem->buddy,
+	       pop_buddy_size(mem->num_pages));
+	free(mem->paddrs);
+	free(mem->buddy);
+	mem->paddrs = (uintptr_t *)((char *)sh + paddrs_off);
+	mem->buddy = (struct pop_buddy *)((char *)sh + buddy_off);
+
+	mem->lock = &sh->mutex;
+	mem->shared = sh;
+	mem->shared_size = size;
+
+	__atomic_store_n(&sh->ready, 1, __ATOMIC_RELEASE);
+
+	pr_vs("%s shared as %s, metadata %lu bytes", mem->devname, name, size);
+
+	return 0;
+
+err_unlink:
+	close(fd);
+	unlink(path);
+	return -1;
+}
+
+void pop_mem_unshare(pop_mem_t *mem)
+{
+	/* detach this process from the region */
+	munmap(mem->mem, mem->size);
+	if (mem->fd != -1)
+		close(mem->fd);
+	munmap(mem->shared, mem->shared_size);
+	mem->shared = NULL;
+}
+
+pop_mem_t *pop_mem_attach(const char *name)
+{
+	/*
+	 * map the region at the vaddr in the header first, and then
+	 * the metadata. mapping the metadata first may take the vaddr.
+	 */
+
+	struct pop_mem_shared hdr, *sh;
+	struct stat st;
+	pop_mem_t *mem;
+	char path[64];
+	int fd;
+
+	snprintf(path, sizeof(path), POP_SHM_PATH, name);
+	fd = open(path, O_RDWR);
+	if (fd < 0) {
+		pr_ve("failed to open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 ||
+	    pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		pr_ve("failed to read %s", path);
+		errno = EINVAL;
+		goto err_close;
+	}
+
+	if (hdr.magic != POP_SHM_MAGIC || hdr.version != POP_SHM_VERSION ||
+	    !hdr.ready) {
+		pr_ve("%s is not a ready libpop region", path);
+		errno = EINVAL;
+		goto err_close;
+	}
+
+	mem = calloc(1, sizeof(*mem));
+	if (!mem)
+		goto err_close;
+
+	mem->ops = pop_mem_ops_by_name(hdr.ops_name);
+	if (!mem->ops || !mem->ops->attach) {
+		pr_ve("unknown backend %s on %s", hdr.ops_name, path);
+		errno = EINVAL;
+		goto err_free_mem;
+	}
+
+	strncpy(mem->name, name, POP_MEM_NAME_MAX - 1);
+	strncpy(mem->devname, hdr.devname, POP_PCI_DEVNAME_MAX - 1);
+	strncpy(mem->path, hdr.path, POP_MEM_PATH_MAX - 1);
+	mem->reg = hdr.reg;
+	mem->fd = -1;
+	mem->mem = (void *)hdr.vaddr;
+	mem->size = hdr.size;
+	mem->committed = hdr.size;
+	mem->pagesize = hdr.pagesize;
+	mem->page_shift = hdr.page_shift;
+	mem->page_mask = (1UL << hdr.page_shift) - 1;
+	mem->num_pages = hdr.size >> PAGE_SHIFT;
+	mem->numa_node = hdr.numa_node;
+
+	/* no registration, no translation, and no new pages */
+	if (mem->ops->attach(mem) < 0)
+		goto err_free_mem;
+
+	sh = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (sh == MAP_FAILED) {
+		pr_ve("failed to mmap %s: %s", path, strerror(errno));
+		goto err_detach;
+	}
+	close(fd);
+
+	mem->paddrs = (uintptr_t *)((char *)sh + sh->paddrs_off);
+	mem->buddy = (struct pop_buddy *)((char *)sh + sh->buddy_off);
+	mem->paddr = mem->paddrs[0];
+	mem->lock = &sh->mutex;
+	mem->shared = sh;
+	mem->shared_size = st.st_size;
+
+	pr_vs("attached to %s, %lu-byte %s at %p", name, mem->size,
+	      mem->devname, mem->mem);
+
+	return mem;
+
+err_detach:
+	munmap(mem->mem, mem->size);
+	close(mem->fd);
+err_free_mem:
+	free(mem);
+err_close:
+	close(fd);
+	return NULL;
+}
+
+int pop_mem_unlink(const char *name)
+{
+	/* release the region, e.g., unregister p2pmem, and the name */
+
+	pop_mem_t *mem;
+	char path[64];
+	int ret;
+
+	mem = pop_mem_attach(name);
+	if (!mem)
+		return -1;
+
+	munmap(mem->shared, mem->shared_size);
+	mem->shared = NULL;
+
+	ret = mem->ops->exit(mem);
+	if (mem->ops != &pop_mem_p2pmem_ops)
+		unlink(mem->path);
+
+	snprintf(path, sizeof(path), POP_SHM_PATH, name);
+	unlink(path);
+
+	free(mem);
+
+	return ret;
+}
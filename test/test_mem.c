@@ -21,8 +21,9 @@ pop_mem_t *test_mem_init_will_success(char *dev, int size)
 		perror("init");
 
 	assert(mem);
-	printf("%lu-byte allocated on %s\n", pop_mem_size(mem),
-	       (dev) ? dev : "hugepage");
+	printf("%lu-byte allocated on %s with %lu-byte pages\n",
+	       pop_mem_size(mem), (dev) ? dev : "hugepage",
+	       pop_mem_page_size(mem));
 
 	usleep(100000);
 	return mem;
@@ -41,6 +42,41 @@ pop_mem_t *test_mem_init_will_fail(char *dev, int size)
 	return mem;
 }
 
+void test_mem_grow(char *dev, size_t chunk)
+{
+	pop_mem_attr_t attr;
+	pop_buf_t *pbufs[16];
+	pop_mem_t *mem;
+	int n;
+
+	pop_mem_attr_init(&attr);
+	attr.initial = chunk;
+	attr.grow_chunk = chunk;
+	attr.watermark = 90;
+
+	mem = pop_mem_init_attr(dev, 0, &attr);
+	if (!mem)
+		perror("init");
+	assert(mem);
+	printf("%lu-byte reserved, %lu-byte committed\n",
+	       pop_mem_size(mem), pop_mem_committed(mem));
+	assert(pop_mem_committed(mem) == chunk);
+
+	for (n = 0; n < 16; n++) {
+		pbufs[n] = pop_buf_alloc(mem, chunk / 2);
+		assert(pbufs[n]);
+		memset(pop_buf_data(pbufs[n]), 0, chunk / 2);
+	}
+	printf("%lu-byte committed after allocating %lu bytes\n",
+	       pop_mem_committed(mem), chunk / 2 * 16);
+	assert(pop_mem_committed(mem) >= chunk / 2 * 16);
+
+	for (n = 0; n < 16; n++)
+		pop_buf_free(pbufs[n]);
+
+	assert(pop_mem_exit(mem) == 0);
+}
+
 void test_mem_exit(pop_mem_t *mem) {
 	int ret = pop_mem_exit(mem);
 	if (ret != 0)
@@ -109,6 +145,16 @@ int main(int argc, char **argv)
 	mem = test_mem_init_will_success(NULL, 1024);
 	test_mem_exit(mem);
 
+	printf("\n= create 2MB mem on 1GB hugepage: success\n");
+	mem = test_mem_init_will_success("hugepage:1G", 2 * 1024 * 1024);
+	test_mem_exit(mem);
+
+	printf("\n= create mem on hugepage committed on demand: success\n");
+	test_mem_grow(NULL, 2 * 1024 * 1024);
+
+	printf("\n= create mem on memfd committed on demand: success\n");
+	test_mem_grow("memfd", 1024 * 1024);
+
 	printf("\n= create mem on hugepage twice: success\n");
 	printf("1st\n");
 	mem = test_mem_init_will_success(NULL, 0);
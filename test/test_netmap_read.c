@@ -15,6 +15,8 @@
 #define NETMAP_WITH_LIBS
 #include <net/netmap_user.h>
 
+#define HELD_MAX	64
+
 
 void hexdump(void *buf, int len)
 {
@@ -39,7 +41,8 @@ void usage(void) {
 	printf("usage: mem, testing pop_mem_t\n"
 	       "    -b pci    PCI bus slot\n"
 	       "    -p port   netmap port\n"
-	       "    -c count  number of received packet to end\n");
+	       "    -c count  number of received packet to end\n"
+	       "    -s        swap mode, hold packets from a pktpool\n");
 }
 
 int main(int argc, char **argv)
@@ -47,13 +50,16 @@ int main(int argc, char **argv)
 	int ch;
 	char *pci = NULL;
 	char *port = NULL;
-	int cnt = -1, received = 0;
+	int cnt = -1, received = 0, swap = 0;
 	pop_mem_t *mem;
+	pop_pktpool_t *pool = NULL;
+	pop_buf_t *held[HELD_MAX];
+	int nheld = 0;
 
 	/* enable verbose log */
 	libpop_verbose_enable();
 
-	while ((ch = getopt(argc, argv, "b:p:c:")) != -1){
+	while ((ch = getopt(argc, argv, "b:p:c:s")) != -1){
 
 		switch (ch) {
 		case 'b' :
@@ -65,6 +71,9 @@ int main(int argc, char **argv)
 		case 'c':
 			cnt = atoi(optarg);
 			break;
+		case 's':
+			swap = 1;
+			break;
 		default:
 			usage();
 			return -1;
@@ -93,10 +102,26 @@ int main(int argc, char **argv)
 	/* correlate netmap rxring with p2p memory */
 	struct pop_nm_rxring *prxrings[64];
 	unsigned int ri;
+
+	if (swap) {
+		/* slots of all rings and held packets */
+		ri = d->last_rx_ring - d->first_rx_ring + 1;
+		pool = pop_pktpool_create(mem, 0,
+			ri * NETMAP_RXRING(d->nifp, 0)->num_slots + HELD_MAX);
+		if (!pool) {
+			perror("pop_pktpool_create: failed");
+			return -1;
+		}
+	}
+
 	for (ri = d->first_rx_ring; ri <= d->last_rx_ring; ri++) {
 		struct netmap_ring *ring = NETMAP_RXRING(d->nifp, ri);
 
-		prxrings[ri] = pop_nm_rxring_init(d->fd, ring, mem);
+		if (swap)
+			prxrings[ri] = pop_nm_rxring_init_pool(d->fd, ring,
+							       pool);
+		else
+			prxrings[ri] = pop_nm_rxring_init(d->fd, ring, mem);
 		if (!prxrings[ri]) {
 			perror("pop_nm_rxring_init: failed");
 			return -1;
@@ -123,6 +148,19 @@ int main(int argc, char **argv)
 				printf("%uth pkt at ring %u, at %p, ptr %lx\n",
 				       received, ri, pkt, slot->ptr);
 				hexdump(pkt, slot->len);
+
+				/* hold the packet, e.g., until it is
+				 * written to NVMe, and release in bulk */
+				if (swap) {
+					held[nheld] = pop_nm_rxring_swap(prxring,
+									 head);
+					if (held[nheld])
+						nheld++;
+					if (nheld == HELD_MAX) {
+						pop_buf_free_bulk(held, nheld);
+						nheld = 0;
+					}
+				}
 				head = nm_ring_next(ring, head);
 				ring->head = ring->cur = head;
 			}
@@ -133,8 +171,12 @@ int main(int argc, char **argv)
 			break;
 	}
 
+	if (nheld)
+		pop_buf_free_bulk(held, nheld);
 	for (ri = d->first_rx_ring; ri <= d->last_rx_ring; ri++)
 		pop_nm_rxring_exit(prxrings[ri]);
+	if (pool)
+		pop_pktpool_destroy(pool);
 
 	nm_close(d);
 	pop_mem_exit(mem);
@@ -170,16 +170,10 @@ int main(int argc, char **argv)
 
 	/* xmit packet at bulk */
 	struct netmap_ring *ring = NETMAP_TXRING(d->nifp, qid);
-	unsigned int head = ring->head;
 
-
-	for (n = 0; n < num; n++) {
-		struct netmap_slot *slot = &ring->slot[head];
-		pop_nm_set_buf(slot, pbuf[n]);
-		head = nm_ring_next(ring, head);
-	}
-
-	ring->head = ring->cur = head;
+	n = pop_nm_tx_burst(ring, pbuf, num);
+	if (n < num)
+		fprintf(stderr, "only %d slots available\n", n);
 
 	printf("start to send %d packets at a batch\n", num);
 	while (nm_tx_pending(ring)) {
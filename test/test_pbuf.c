@@ -3,6 +3,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <stdint.h>
 
 #include <libpop.h>
 
@@ -20,6 +21,8 @@ int main(int argc, char **argv)
 #define NUM_BUFS	4
 	pop_mem_t *mem;
 	pop_buf_t *pbuf[NUM_BUFS];
+	pop_arena_t *arenas;
+	struct pop_arena_stat stat;
 
 	libpop_verbose_enable();
 
@@ -71,6 +74,113 @@ int main(int argc, char **argv)
 		pop_buf_free(pbuf[n]);
 	}
 
+	/* freed pages must be reused, so that allocating and freeing
+	 * more than the size of mem never fails */
+	printf("\n\nallocate and free %lu-byte pbuf over and over\n",
+	       pop_mem_size(mem) / 4);
+	for (n = 0; n < NUM_BUFS * 4; n++) {
+		pbuf[0] = pop_buf_alloc(mem, pop_mem_size(mem) / 4);
+		if (!pbuf[0])
+			perror("pop_buf_alloc");
+		assert(pbuf[0]);
+		pop_buf_free(pbuf[0]);
+	}
+	printf("alloced_pages after free: %lu\n", mem->alloced_pages);
+
+	/* bulk allocation is all or nothing */
+	printf("\n\nallocate %d pbufs at once\n", NUM_BUFS);
+	n = mem->alloced_pages;
+	assert(pop_buf_alloc_bulk(mem, pop_mem_size(mem) / 2, pbuf,
+				  NUM_BUFS) < 0);
+	assert(mem->alloced_pages == n);
+	assert(pop_buf_alloc_bulk(mem, 4096, pbuf, NUM_BUFS) == 0);
+	assert(mem->alloced_pages == n + NUM_BUFS);
+	pop_buf_free_bulk(pbuf, NUM_BUFS);
+	assert(mem->alloced_pages == n);
+
+	/* data is released when the original and its clones are freed */
+	printf("\n\nclone a pbuf to %d destinations\n", NUM_BUFS);
+	pbuf[0] = pop_buf_alloc(mem, 4096);
+	assert(pbuf[0]);
+	pop_buf_put(pbuf[0], 1500);
+	for (n = 1; n < NUM_BUFS; n++) {
+		pbuf[n] = pop_buf_clone(pbuf[0]);
+		assert(pbuf[n]);
+		pop_buf_pull(pbuf[n], 14 * n);
+		assert(pbuf[n]->length == 1500 - 14 * n);
+	}
+	pop_buf_get(pbuf[1]);
+	print_pop_buf(pbuf[0]);
+	assert(pbuf[0]->refcnt == NUM_BUFS);
+	n = mem->alloced_pages;
+	pop_buf_free(pbuf[0]);
+	pop_buf_free(pbuf[1]);
+	pop_buf_free(pbuf[2]);
+	pop_buf_free(pbuf[3]);
+	assert(mem->alloced_pages == n);
+	pop_buf_free(pbuf[1]);
+	assert(mem->alloced_pages == n - 1);
+
+	/* a 9000-byte frame is 5 segments, not crossing 4096-byte pages */
+	printf("\n\nsegment a jumbo frame\n");
+	pbuf[0] = pop_buf_alloc(mem, 9000);
+	assert(pbuf[0]);
+	pop_buf_put(pbuf[0], 9000);
+	pbuf[1] = pop_buf_segment(pbuf[0], 2048);
+	assert(pbuf[1]);
+	pop_buf_free(pbuf[0]);
+	printf("%u segments, %lu bytes\n", pop_buf_chain_count(pbuf[1]),
+	       pop_buf_chain_len(pbuf[1]));
+	assert(pop_buf_chain_count(pbuf[1]) == 5);
+	assert(pop_buf_chain_len(pbuf[1]) == 9000);
+	pop_buf_chain_for_each(pbuf[2], pbuf[1])
+		assert(pop_buf_len(pbuf[2]) <= 2048);
+	n = mem->alloced_pages;
+	pop_buf_chain_free(pbuf[1]);
+	assert(mem->alloced_pages == n - 3);
+
+	/* arenas are page-aligned, and return cache-line-aligned
+	 * memory until exhausted */
+	printf("\n\nsplit %d arenas\n", NUM_BUFS);
+	arenas = pop_mem_split(mem, NUM_BUFS, 10000);
+	if (!arenas)
+		perror("pop_mem_split");
+	assert(arenas);
+	for (n = 0; n < NUM_BUFS; n++) {
+		void *p;
+
+		assert(((uintptr_t)arenas[n].base & 4095) == 0);
+		while ((p = pop_arena_alloc(&arenas[n], 100)) != NULL)
+			assert(((uintptr_t)p & (POP_ARENA_ALIGN - 1)) == 0);
+		pop_arena_stat(&arenas[n], &stat);
+		printf("arena %d: base %p allocs %lu fails %lu peak %lu\n",
+		       n, arenas[n].base, stat.allocs, stat.fails, stat.peak);
+		assert(stat.allocs == arenas[n].size / 128);
+		pop_arena_reset(&arenas[n]);
+		assert(pop_arena_alloc(&arenas[n], arenas[n].size));
+	}
+	pop_mem_unsplit(arenas);
+
+	pop_mem_exit(mem);
+
+	/* a whole region is allocated at once even if its size is not a
+	 * power of two */
+	printf("\n\nallocate a whole %d-byte region\n", 6 << 20);
+	mem = pop_mem_init(pci, 6 << 20);
+	if (!mem)
+		perror("pop_mem_init");
+	assert(mem);
+	pbuf[0] = pop_buf_alloc(mem, pop_mem_size(mem));
+	assert(pbuf[0]);
+	pop_buf_free(pbuf[0]);
+	pbuf[0] = pop_buf_alloc(mem, pop_mem_size(mem) - (1 << 20));
+	assert(pbuf[0]);
+	pbuf[1] = pop_buf_alloc(mem, 1 << 20);
+	assert(pbuf[1]);
+	pop_buf_free(pbuf[0]);
+	pop_buf_free(pbuf[1]);
+	assert(mem->alloced_pages == 0);
+
 	pop_mem_exit(mem);
 	return 0;
 }
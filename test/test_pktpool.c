@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <libpop.h>
+
+#define MAX_THREADS	16
+#define NUM_OBJS	8192
+#define NUM_LOOPS	100000
+#define BURST		64
+
+pop_pktpool_t *pool;
+pop_buf_t *all[NUM_OBJS + 1];
+pop_pkt_t hs[BURST];
+
+void usage(void) {
+
+	printf("usage: pktpool, testing pop_pktpool_t\n"
+	       "    -b pci    PCI bus slot\n"
+	       "    -n num    number of threads\n");
+}
+
+void *thread_body(void *arg)
+{
+	pop_buf_t *pbuf[BURST];
+	int n, i, id = *((int *)arg);
+
+	for (n = 0; n < NUM_LOOPS; n++) {
+		/* every other burst is obtained at once */
+		if (n & 1)
+			assert(pop_pktpool_get_bulk(pool, pbuf, BURST) == 0);
+
+		for (i = 0; i < BURST; i++) {
+			if (!(n & 1))
+				pbuf[i] = pop_pktpool_get(pool);
+			assert(pbuf[i]);
+			assert(pop_buf_len(pbuf[i]) == 0);
+			pop_buf_put(pbuf[i], 64);
+			*((int *)pop_buf_data(pbuf[i])) = id;
+		}
+
+		for (i = 0; i < BURST; i++) {
+			/* nobody else touches the buffer we own */
+			assert(*((int *)pop_buf_data(pbuf[i])) == id);
+			if (n & 1)
+				continue;
+			else if (i & 1)
+				pop_pktpool_put(pbuf[i]);
+			else
+				pop_buf_free(pbuf[i]);
+		}
+		if (n & 1)
+			pop_pktpool_put_bulk(pbuf, BURST);
+	}
+
+	return NULL;
+}
+
+void *short_thread_body(void *arg)
+{
+	/* leave an object in the cache of this thread */
+	pop_pktpool_put(pop_pktpool_get(pool));
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int ch, n, nthreads = 4;
+	int ids[MAX_THREADS];
+	char *pci = NULL;
+	pthread_t tids[MAX_THREADS];
+	pop_buf_t *pbuf;
+	pop_mem_t *mem;
+
+	libpop_verbose_enable();
+
+	while ((ch = getopt(argc, argv, "b:n:")) != -1) {
+
+		switch (ch) {
+		case 'b':
+			pci = optarg;
+			break;
+		case 'n':
+			nthreads = atoi(optarg);
+			if (nthreads < 1 || nthreads > MAX_THREADS) {
+				printf("invalid number of threads\n");
+				return 1;
+			}
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	mem = pop_mem_init(pci, 0);
+	if (!mem)
+		perror("pop_mem_init");
+	assert(mem);
+
+	printf("create pktpool with %d objects\n", NUM_OBJS);
+	pool = pop_pktpool_create(mem, 0, NUM_OBJS);
+	if (!pool)
+		perror("pop_pktpool_create");
+	assert(pool);
+	assert(pop_pktpool_objsize(pool) == POP_PKTPOOL_OBJSIZE);
+
+	printf("\nobject 0\n");
+	pbuf = pop_pktpool_get(pool);
+	print_pop_buf(pbuf);
+	pop_pktpool_put(pbuf);
+
+	printf("\nget all objects at once\n");
+	assert(pop_pktpool_get_bulk(pool, all, NUM_OBJS + 1) < 0);
+	assert(pop_pktpool_get_bulk(pool, all, NUM_OBJS) == 0);
+	assert(pop_pktpool_get(pool) == NULL);
+	pop_pktpool_put_bulk(all, NUM_OBJS);
+
+	printf("\nhandles and pop_bufs share objects\n");
+	assert(pop_pkt_alloc_bulk(pool, hs, BURST) == 0);
+	for (n = 0; n < BURST; n++) {
+		assert(pop_pkt_len(pool, hs[n]) == 0);
+		assert(pop_pkt_append(pool, hs[n], 100));
+		assert(pop_pkt_adj(pool, hs[n], 14));
+		assert(pop_pkt_len(pool, hs[n]) == 86);
+		pbuf = pop_pkt_buf(pool, hs[n]);
+		assert(pop_buf_data(pbuf) == pop_pkt_data(pool, hs[n]));
+		assert(pop_buf_paddr(pbuf) == pop_pkt_paddr(pool, hs[n]));
+		assert(pop_buf_pkt(pbuf) == hs[n]);
+	}
+	pop_pkt_free_bulk(pool, hs, BURST);
+
+	printf("\nget and put objects on %d threads\n", nthreads);
+	for (n = 0; n < nthreads; n++) {
+		ids[n] = n;
+		pthread_create(&tids[n], NULL, thread_body, &ids[n]);
+	}
+	for (n = 0; n < nthreads; n++)
+		pthread_join(tids[n], NULL);
+
+	printf("\ncaches of exited threads return to the pool\n");
+	for (n = 0; n < POP_PKTPOOL_MAX_THREADS * 2; n++) {
+		pthread_create(&tids[0], NULL, short_thread_body, NULL);
+		pthread_join(tids[0], NULL);
+	}
+	assert(pop_pktpool_get_bulk(pool, all, NUM_OBJS) == 0);
+	pop_pktpool_put_bulk(all, NUM_OBJS);
+
+	printf("destroy pktpool\n");
+	pop_pktpool_destroy(pool);
+
+	pop_mem_exit(mem);
+	return 0;
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/wait.h>
+
+#include <libpop.h>
+
+#define NAME	"test_shared"
+#define BUFSIZE	(64 * 1024)
+
+void usage(void) {
+
+	printf("usage: shared, testing pop_mem_t shared by processes\n"
+	       "    -b dev    hugetlbfs[:dir] or PCI bus slot\n");
+}
+
+void child_body(pop_mem_t *inherited, int wfd)
+{
+	pop_mem_t *mem;
+	pop_buf_t *pbuf;
+	size_t offset;
+
+	/* drop the mapping inherited by fork() to attach like others */
+	pop_mem_exit(inherited);
+
+	/* a secondary process attaches, and hands a buffer over */
+	mem = pop_mem_attach(NAME);
+	if (!mem)
+		perror("pop_mem_attach");
+	assert(mem);
+
+	pbuf = pop_buf_alloc(mem, BUFSIZE);
+	assert(pbuf);
+	memset(pop_buf_data(pbuf), 0xbe, BUFSIZE);
+	printf("child: alloced pbuf at %p\n", pop_buf_data(pbuf));
+
+	offset = pop_buf_export(pbuf);
+	assert(write(wfd, &offset, sizeof(offset)) == sizeof(offset));
+
+	pop_mem_exit(mem);
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	int ch, n, fds[2], status;
+	char *dev = "hugetlbfs";
+	pop_mem_attr_t attr;
+	pop_mem_t *mem;
+	pop_buf_t *pbuf;
+	size_t offset;
+	pid_t pid;
+
+	libpop_verbose_enable();
+
+	while ((ch = getopt(argc, argv, "b:")) != -1) {
+
+		switch (ch) {
+		case 'b':
+			dev = optarg;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	/* a leftover of a previous run */
+	pop_mem_unlink(NAME);
+
+	printf("\n= create shared region %s on %s\n", NAME, dev);
+	pop_mem_attr_init(&attr);
+	attr.shared_name = NAME;
+	mem = pop_mem_init_attr(dev, 16 * 1024 * 1024, &attr);
+	if (!mem)
+		perror("pop_mem_init_attr");
+	assert(mem);
+
+	printf("\n= receive a pop_buf from another process\n");
+	assert(pipe(fds) == 0);
+	fflush(stdout);
+	pid = fork();
+	if (pid == 0)
+		child_body(mem, fds[1]);
+	close(fds[1]);
+	assert(read(fds[0], &offset, sizeof(offset)) == sizeof(offset));
+	waitpid(pid, &status, 0);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	pbuf = pop_buf_import(mem, offset, BUFSIZE);
+	assert(pbuf);
+	printf("parent: imported pbuf at %p\n", pop_buf_data(pbuf));
+	for (n = 0; n < BUFSIZE; n++)
+		assert(((unsigned char *)pop_buf_data(pbuf))[n] == 0xbe);
+	pop_buf_free(pbuf);
+
+	printf("\n= detach and attach again\n");
+	pop_mem_exit(mem);
+	mem = pop_mem_init_attr(dev, 16 * 1024 * 1024, &attr);
+	assert(mem);
+	pbuf = pop_buf_alloc(mem, BUFSIZE);
+	assert(pbuf);
+	pop_buf_free(pbuf);
+	pop_mem_exit(mem);
+
+	printf("\n= unlink %s\n", NAME);
+	assert(pop_mem_unlink(NAME) == 0);
+	assert(pop_mem_attach(NAME) == NULL);
+
+	return 0;
+}